@@ -24,17 +24,18 @@ struct buf_wri *
 buf_wri_init(size_t len)
 {
   struct buf_wri *w;
+  unsigned char *base;
 
   w = malloc(sizeof(struct buf_wri));
   if (w == NULL)
     return NULL;
 
-  w->base = malloc(len);
-  if (w->base == NULL) {
+  base = malloc(len);
+  if (base == NULL) {
     free(w);
     return NULL;
   }
-  w->len = 0;
+  buf_wri_open(w, base, len);
 
   return w;
 }
@@ -48,86 +49,42 @@ buf_wri_free(struct buf_wri *w)
   }
 }
 
-void
-buf_add8(struct buf_wri *w, uint8_t val)
+size_t
+buf_write_span(struct buf_wri *w, const void *src, size_t n)
 {
-  w->base[w->len++] = val;
+  if (n > w->cap - w->len) {
+    n = w->cap - w->len;
+    w->overflow = 1;
+  }
+  memcpy(w->base + w->len, src, n);
+  w->len += n;
+  return n;
 }
 
 /* Buffer reader implementation */
 struct buf_rdr *
-buf_rdr_init(unsigned char *data, size_t len)
+buf_rdr_init(const unsigned char *data, size_t len)
 {
   struct buf_rdr *r;
 
   r = malloc(sizeof(struct buf_rdr));
   if (r == NULL) return NULL;
 
-  r->data = data;
-  r->len = len;
-  r->offset = 0;
+  buf_rdr_open(r, data, len);
 
   return r;
 }
 
-void
-buf_reset(struct buf_rdr *r)
-{
-  r->offset = 0;
-}
-
-uint8_t
-buf_get8(struct buf_rdr *r)
-{
-  return r->data[r->offset++];
-}
-
-uint16_t
-buf_get16le(struct buf_rdr *r)
-{
-  uint16_t ret;
-
-  ret = r->data[r->offset++];
-  ret += r->data[r->offset++] << 8;
-
-  return ret;
-}
-
-uint16_t
-buf_get16be(struct buf_rdr *r)
+size_t
+buf_read_span(struct buf_rdr *r, void *dst, size_t n)
 {
-  uint16_t ret;
-
-  ret = r->data[r->offset++] << 8;
-  ret += r->data[r->offset++];
-
-  return ret;
-}
-
-uint32_t
-buf_get32le(struct buf_rdr *r)
-{
-  uint32_t ret;
-
-  ret = r->data[r->offset++];
-  ret += r->data[r->offset++] << 8;
-  ret += r->data[r->offset++] << 16;
-  ret += r->data[r->offset++] << 24;
-
-  return ret;
-}
-
-uint32_t
-buf_get32be(struct buf_rdr *r)
-{
-  uint32_t ret;
-
-  ret = r->data[r->offset++] << 24;
-  ret += r->data[r->offset++] << 16;
-  ret += r->data[r->offset++] << 8;
-  ret += r->data[r->offset++];
-
-  return ret;
+  if (n > r->len - r->offset) {
+    n = r->len - r->offset;
+    r->overflow = 1;
+  }
+  memcpy(dst, r->data + r->offset, n);
+  r->offset += n;
+  return n;
 }
 
 void
@@ -19,41 +19,137 @@
 #ifndef __DW_BUFIO_H__
 #define __DW_BUFIO_H__
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* Readers and writers can live on the stack (set up with buf_rdr_open and
+ * buf_wri_open) or on the heap (buf_rdr_init and buf_wri_init). Reading
+ * past the end or writing past the capacity doesn't touch memory, it sets
+ * the sticky overflow flag instead and reads return 0. Check the flag once
+ * after a run of calls. */
+
 struct buf_wri {
   unsigned char *base;
   size_t len;
+  size_t cap;
+  int overflow;
 };
 
 struct buf_rdr {
-  unsigned char *data;
+  const unsigned char *data;
   size_t len;
-  int offset;
+  size_t offset;
+  int overflow;
 };
 
+static inline void buf_wri_open(struct buf_wri *w, unsigned char *base,
+    size_t cap)
+{
+  w->base = base;
+  w->len = 0;
+  w->cap = cap;
+  w->overflow = 0;
+}
+
+static inline void buf_rdr_open(struct buf_rdr *r, const unsigned char *data,
+    size_t len)
+{
+  r->data = data;
+  r->len = len;
+  r->offset = 0;
+  r->overflow = 0;
+}
+
 /* Buffer writing functions */
 struct buf_wri *buf_wri_init(size_t len);
 void buf_wri_free(struct buf_wri *w);
 
-void buf_add8(struct buf_wri *w, uint8_t val);
+static inline void buf_add8(struct buf_wri *w, uint8_t val)
+{
+  if (w->len >= w->cap) {
+    w->overflow = 1;
+    return;
+  }
+  w->base[w->len++] = val;
+}
+
+/* Appends n bytes, returns the number written. */
+size_t buf_write_span(struct buf_wri *w, const void *src, size_t n);
 
 
 /* Buffer reader functions */
-struct buf_rdr *buf_rdr_init(unsigned char *data, size_t len);
+struct buf_rdr *buf_rdr_init(const unsigned char *data, size_t len);
 void buf_rdr_free(struct buf_rdr *r);
 
+static inline void buf_reset(struct buf_rdr *r)
+{
+  r->offset = 0;
+  r->overflow = 0;
+}
+
+static inline size_t buf_remaining(const struct buf_rdr *r)
+{
+  return r->len - r->offset;
+}
+
+/* Returns the next n bytes and moves past them, NULL if there aren't n
+ * left. */
+static inline const unsigned char *buf_take(struct buf_rdr *r, size_t n)
+{
+  const unsigned char *p;
+
+  if (n > r->len - r->offset) {
+    r->offset = r->len;
+    r->overflow = 1;
+    return NULL;
+  }
+  p = r->data + r->offset;
+  r->offset += n;
+  return p;
+}
+
 /* read data */
-void buf_reset(struct buf_rdr *r);
-uint8_t buf_get8(struct buf_rdr *r);
-uint16_t buf_get16le(struct buf_rdr *r);
-uint16_t buf_get16be(struct buf_rdr *r);
-uint32_t buf_get32le(struct buf_rdr *r);
-uint32_t buf_get32be(struct buf_rdr *r);
+static inline uint8_t buf_get8(struct buf_rdr *r)
+{
+  const unsigned char *p = buf_take(r, 1);
+
+  return p ? p[0] : 0;
+}
+
+static inline uint16_t buf_get16le(struct buf_rdr *r)
+{
+  const unsigned char *p = buf_take(r, 2);
+
+  return p ? p[0] | p[1] << 8 : 0;
+}
+
+static inline uint16_t buf_get16be(struct buf_rdr *r)
+{
+  const unsigned char *p = buf_take(r, 2);
+
+  return p ? p[0] << 8 | p[1] : 0;
+}
+
+static inline uint32_t buf_get32le(struct buf_rdr *r)
+{
+  const unsigned char *p = buf_take(r, 4);
+
+  return p ? p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24 : 0;
+}
+
+static inline uint32_t buf_get32be(struct buf_rdr *r)
+{
+  const unsigned char *p = buf_take(r, 4);
+
+  return p ? (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3] : 0;
+}
+
+/* Copies the next n bytes to dst, returns the number copied. */
+size_t buf_read_span(struct buf_rdr *r, void *dst, size_t n);
 
 #ifdef __cplusplus
 }
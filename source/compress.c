@@ -14,152 +14,335 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <compress.h>
-#include <utils.h>
+#include <trace.h>
 
+#define DICT_SIZE 2048
+#define DICT_NODES (DICT_SIZE / 4)
+
+/* Bit reader used while building the dictionary, it works like the one in
+ * DRAGON.COM: dx holds counter bits, the next one at the top. */
 struct compress_ctx {
   int counter;
   uint16_t dx;
-  int output_idx;
 
-  unsigned char *dict_base;
-  unsigned char *dict_ptr;
+  struct buf_rdr input;
 };
 
-/* Constructs a dictionary from input buffered reader. */
-static void build_dictionary(struct buf_rdr *input, struct compress_ctx *ctx)
+static int dict_get8(struct compress_ctx *ctx, uint8_t *val)
 {
-  uint16_t res;
-  uint8_t al;
-  uint16_t ax = 0;
+  *val = buf_get8(&ctx->input);
+  return ctx->input.overflow ? -1 : 0;
+}
 
+static int dict_get_bit(struct compress_ctx *ctx, int *bit)
+{
   ctx->counter--;
 
   if (ctx->counter < 0) {
-    ctx->dx = buf_get16be(input);
+    ctx->dx = buf_get16be(&ctx->input);
+    if (ctx->input.overflow)
+      return -1;
     ctx->counter = 15;
   }
 
-  res = ctx->dx << 1;
-  if (res < ctx->dx) {
-    ctx->dx = res;
+  *bit = ctx->dx >> 15;
+  ctx->dx <<= 1;
+  return 0;
+}
+
+/* Reads the 8 bit symbol of a leaf. */
+static int dict_get_symbol(struct compress_ctx *ctx, uint8_t *sym)
+{
+  uint8_t al;
+
+  if (ctx->counter == 0)
+    return dict_get8(ctx, sym);
 
-    /* Shift overflow */
+  if (ctx->counter >= 8) {
+    ctx->counter -= 8;
+  } else {
+    if (dict_get8(ctx, &al) != 0)
+      return -1;
+    ctx->dx |= (al << 8) >> ctx->counter;
+  }
 
-    if (ctx->counter == 0) {
-      al = buf_get8(input);
-      ax = (ax & 0xFF00);
-      ax += al;
-    } else {
-      if (ctx->counter >= 8) {
-        ctx->counter -= 8;
-      } else {
-        al = buf_get8(input);
-        ax = (al << 8 & 0xFF00) + (ctx->counter & 0xFF00 >> 8);
-        ax = ax >> (ctx->counter & 0xFF);
-        ctx->dx = ctx->dx | ax;
-      }
+  /* mov al, dh
+   * mov dh, dl */
+  *sym = ctx->dx >> 8;
+  ctx->dx <<= 8;
+  return 0;
+}
 
-      /* mov al, dh */
-      ax = (ax & 0xFF00);
-      ax += (ctx->dx & 0xFF00) >> 8;
+static inline void dict_put16(unsigned char *dict, int off, uint16_t val)
+{
+  dict[off] = val & 0xFF;
+  dict[off + 1] = val >> 8;
+}
 
-      /* mov dh, dl
-       * mov dl, ch */
-      ctx->dx = (ctx->dx & 0x00FF) << 8;
-      ctx->dx += (ctx->counter & 0xFF00) >> 8;
+/* Constructs the dictionary, a tree stored in preorder with a 0 bit for a
+ * node with two children and a 1 bit followed by the symbol for a leaf.
+ * Nodes are 4 bytes: leaves have 0 and the symbol, other nodes the offsets
+ * of their 0 and 1 children. Returns DATA1_OK or an error for trees that
+ * don't fit the dictionary or run out of input. */
+static int build_dictionary(struct compress_ctx *ctx, unsigned char *dict)
+{
+  /* Nodes that still need their 1 child. */
+  int pending[DICT_NODES];
+  int npending = 0;
+  int node = 0;
+  int next = 0;
+
+  while (1) {
+    uint8_t sym;
+    int bit;
+
+    if (dict_get_bit(ctx, &bit) != 0)
+      return DATA1_ERR_DICT_INPUT;
+
+    if (bit == 0) {
+      next += 4;
+      if (next >= DICT_SIZE)
+        return DATA1_ERR_DICT_SIZE;
+      dict_put16(dict, node, next);
+      pending[npending++] = node;
+      node = next;
+      continue;
     }
-    ax = (ax & 0x00FF);
-    ax += (ctx->counter & 0xFF00);
 
-    /* Write 16 bit (word) ax to output buffer in little endian format. */
-    *(ctx->dict_ptr + 2) = (ax & 0xff);
-    *(ctx->dict_ptr + 3) = (ax & 0xff00) >> 8;
+    if (dict_get_symbol(ctx, &sym) != 0)
+      return DATA1_ERR_DICT_INPUT;
+    dict_put16(dict, node, 0);
+    dict_put16(dict, node + 2, sym);
 
-    /* mov al, ah */
-    ax = (ax & 0xFF00); // wipe low.
-    ax += ((ax & 0xFF00) >> 8);
+    if (npending == 0)
+      return DATA1_OK;
 
-    /* Write 16 bit (word) ax to output buffer in little endian format. */
-    *(ctx->dict_ptr) = (ax & 0xff);
-    *(ctx->dict_ptr + 1) = (ax & 0xff00) >> 8;
-    return;
+    next += 4;
+    if (next >= DICT_SIZE)
+      return DATA1_ERR_DICT_SIZE;
+    dict_put16(dict, pending[--npending] + 2, next);
+    node = next;
   }
-  else {
-    unsigned char *save_offset;
-    ctx->dx = res;
-    ctx->output_idx += 4;
+}
 
-    /* write output_idx (16 bits) to output in little endian format. */
-    *(ctx->dict_ptr) = (ctx->output_idx & 0xff);
-    *(ctx->dict_ptr + 1) = (ctx->output_idx & 0xff00) >> 8;
+/* Little endian fetch from the dictionary. Leaves have 0 in the first
+ * word and the symbol in the second, other nodes hold the offsets of their
+ * 0 and 1 children. */
+static inline uint16_t dict_word(const unsigned char *dict, int off)
+{
+  return dict[off] | (dict[off + 1] << 8);
+}
 
-    save_offset = ctx->dict_ptr;
-    ctx->dict_ptr = ctx->dict_base + ctx->output_idx;
+/* Fills the table entries for every code starting with the prefix that
+ * leads to node off. */
+static void fill_table(struct data1_code *table, const unsigned char *dict,
+    int off, int depth, unsigned int prefix)
+{
+  if (dict_word(dict, off) == 0 || depth == DATA1_TABLE_BITS) {
+    int shift = DATA1_TABLE_BITS - depth;
+    struct data1_code e;
 
-    build_dictionary(input, ctx);
+    if (dict_word(dict, off) == 0) {
+      e.value = dict[off + 2];
+      e.len = depth;
+    } else {
+      e.value = off;
+      e.len = 0;
+    }
+    for (unsigned int i = 0; i < (1U << shift); i++)
+      table[(prefix << shift) | i] = e;
+    return;
+  }
 
-    ctx->dict_ptr = save_offset;
-    ctx->output_idx += 4;
-    *(ctx->dict_ptr + 2) = (ctx->output_idx & 0xff);
-    *(ctx->dict_ptr + 3) = (ctx->output_idx & 0xff00) >> 8;
-    save_offset = ctx->dict_ptr;
+  fill_table(table, dict, dict_word(dict, off), depth + 1, prefix << 1);
+  fill_table(table, dict, dict_word(dict, off + 2), depth + 1,
+      (prefix << 1) | 1);
+}
 
-    ctx->dict_ptr = ctx->dict_base + ctx->output_idx;
-    build_dictionary(input, ctx);
-    ctx->dict_ptr = save_offset;
-  }
+void data1_decoder_init(struct data1_decoder *d, unsigned char *out,
+    size_t out_len)
+{
+  d->out = out;
+  d->out_len = out_len;
+  d->size = 0;
+  d->produced = 0;
+  d->status = DATA1_NEED_INPUT;
+  d->dict_ready = 0;
+  d->head_len = 0;
+  d->head_off = 0;
+  d->bits = 0;
+  d->count = 0;
+  d->node = 0;
+  d->pad = 0;
 }
 
-/* Decompress the data into output. */
-static void decompress(struct buf_rdr *input, struct compress_ctx *ctx,
-    int size, struct buf_wri *output)
+/* Reads the size and the dictionary from the collected head of the section,
+ * the rest of the head is the start of the codes. */
+static void start_codes(struct data1_decoder *d)
 {
-  uint16_t res;
-  uint16_t ax;
-  int bx;
-  int bp = ctx->counter;
-  unsigned char *ptr;
+  struct compress_ctx ctx;
+  int rc;
 
-  ctx->counter = size;
+  /* Bytes past what was fed read as 0. */
+  memset(d->head + d->head_len, 0, sizeof(d->head) - d->head_len);
 
-  bx = 0;
-  while (ctx->counter > 0) {
-    ptr = ctx->dict_base + bx;
+  d->size = d->head[0] | (d->head[1] << 8);
+  if (d->size > d->out_len) {
+    d->status = DATA1_ERR_OUTPUT;
+    return;
+  }
 
-    /* little endian fetch from dictionary */
-    ax = *ptr;
-    ax += *(ptr + 1) << 8;
+  ctx.counter = 0;
+  ctx.dx = 0;
+  buf_rdr_open(&ctx.input, d->head + 2, sizeof(d->head) - 2);
 
-    if (ax != 0) {
-      bp--;
-      if (bp < 0) {
-        ctx->dx = buf_get16be(input);
-        bp = 15;
-      }
-      res = ctx->dx << 1;
-      if (res < ctx->dx) {
-        /* Carry */
-        ctx->dx = res;
-        bx = *(ptr + 2);
-        bx += *(ptr + 3) << 8;
+  rc = build_dictionary(&ctx, d->dict);
+  if (rc != DATA1_OK) {
+    d->status = rc;
+    return;
+  }
+  TRACE(DICTIONARY, ctx.input.offset + 2, ctx.counter, ctx.dx);
+  d->dict_ready = 1;
+
+  d->head_off = ctx.input.offset + 2;
+  if (d->head_off > d->head_len) {
+    d->status = DATA1_ERR_INPUT;
+    return;
+  }
+  d->count = ctx.counter;
+  d->bits = ctx.counter == 0 ? 0 :
+    (uint64_t)(ctx.dx >> (16 - ctx.counter)) << (64 - ctx.counter);
+
+  /* A dictionary of a single symbol takes no bits per symbol. */
+  if (dict_word(d->dict, 0) == 0) {
+    memset(d->out, d->dict[2], d->size);
+    d->produced = d->size;
+    d->status = DATA1_OK;
+    return;
+  }
+
+  fill_table(d->table, d->dict, 0, 0, 0);
+}
+
+/* Decodes as much as the input allows. At the end of the section the
+ * missing bits read as 0, the section is truncated if any of them is
+ * used. */
+static void decode_codes(struct data1_decoder *d, const unsigned char *in,
+    size_t len, int at_end)
+{
+  const unsigned char *dict = d->dict;
+  unsigned char *out = d->out + d->produced;
+  unsigned char *out_end = d->out + d->size;
+  uint64_t bits = d->bits;
+  int count = d->count;
+  int node = d->node;
+  int pad = d->pad;
+  size_t off = 0;
+
+  while (out < out_end) {
+    /* Refill from what's left of the head, then from in. */
+    while (count <= 56) {
+      uint64_t byte;
+
+      if (d->head_off < d->head_len) {
+        byte = d->head[d->head_off++];
+      } else if (off < len) {
+        byte = in[off++];
+      } else if (at_end) {
+        byte = 0;
+        pad += 8;
       } else {
-        /* No carry */
-        ctx->dx = res;
-        bx = ax; /* .loc_4FA5 */
+        break;
       }
+      bits |= byte << (56 - count);
+      count += 8;
+    }
 
-    } else {
-      uint8_t al = *(ptr + 2);
+    if (node == 0) {
+      const struct data1_code *e = &d->table[bits >> (64 - DATA1_TABLE_BITS)];
+
+      if (e->len != 0 && e->len <= count) {
+        bits <<= e->len;
+        count -= e->len;
+        *out++ = e->value;
+        continue;
+      }
+      if (e->len == 0 && count >= DATA1_TABLE_BITS) {
+        bits <<= DATA1_TABLE_BITS;
+        count -= DATA1_TABLE_BITS;
+        node = e->value;
+      }
+    }
 
-      buf_add8(output, al);
-      ctx->counter--;
-      bx = 0;
+    /* Long code or not enough input for the table, one bit at a time. */
+    while (dict_word(dict, node) != 0 && count > 0) {
+      node = (bits >> 63) ? dict_word(dict, node + 2) : dict_word(dict, node);
+      bits <<= 1;
+      count--;
     }
+    if (dict_word(dict, node) != 0)
+      break;
+
+    *out++ = dict[node + 2];
+    node = 0;
   }
+
+  d->bits = bits;
+  d->count = count;
+  d->node = node;
+  d->pad = pad;
+  d->produced = out - d->out;
+  if (out == out_end)
+    d->status = count < pad ? DATA1_ERR_INPUT : DATA1_OK;
+}
+
+int data1_decoder_feed(struct data1_decoder *d, const unsigned char *in,
+    size_t len)
+{
+  if (d->status != DATA1_NEED_INPUT)
+    return d->status;
+
+  /* The dictionary is built once enough input has come in for the
+   * largest one. */
+  if (!d->dict_ready) {
+    size_t n = sizeof(d->head) - d->head_len;
+
+    if (n > len)
+      n = len;
+    memcpy(d->head + d->head_len, in, n);
+    d->head_len += n;
+    in += n;
+    len -= n;
+
+    if (d->head_len < sizeof(d->head))
+      return d->status;
+
+    start_codes(d);
+    if (d->status != DATA1_NEED_INPUT)
+      return d->status;
+  }
+
+  decode_codes(d, in, len, 0);
+  return d->status;
+}
+
+int data1_decoder_finish(struct data1_decoder *d)
+{
+  if (d->status != DATA1_NEED_INPUT)
+    return d->status;
+
+  if (!d->dict_ready) {
+    start_codes(d);
+    if (d->status != DATA1_NEED_INPUT)
+      return d->status;
+  }
+
+  decode_codes(d, NULL, 0, 1);
+  return d->status;
 }
 
 /*
@@ -172,27 +355,235 @@ static void decompress(struct buf_rdr *input, struct compress_ctx *ctx,
  */
 void decompress_data1(struct buf_rdr *input, struct buf_wri *output, int size)
 {
-  struct compress_ctx ctx;
-  unsigned char *dictionary;
+  struct data1_decoder d;
+  unsigned char sz[2] = { size & 0xFF, (size >> 8) & 0xFF };
 
-  dictionary = malloc(2048);
+  if ((size_t)size > output->cap - output->len) {
+    output->overflow = 1;
+    return;
+  }
 
-  ctx.counter = 0;
-  ctx.dx = 0;
-  ctx.output_idx = 0;
-  ctx.dict_ptr = dictionary;
-  ctx.dict_base = dictionary;
+  /* The input is past the size word already. */
+  data1_decoder_init(&d, output->base + output->len, size);
+  data1_decoder_feed(&d, sz, sizeof(sz));
+  data1_decoder_feed(&d, input->data + input->offset,
+      input->len - input->offset);
+  data1_decoder_finish(&d);
+  input->offset = input->len;
+  output->len += d.produced;
+}
+
+/* Symbol and how often it appears, for ordering the symbols. */
+struct symbol_freq {
+  size_t freq;
+  int sym;
+};
+
+static int cmp_symbol_freq(const void *a, const void *b)
+{
+  const struct symbol_freq *x = a;
+  const struct symbol_freq *y = b;
+
+  if (x->freq != y->freq)
+    return x->freq < y->freq ? -1 : 1;
+  return x->sym - y->sym;
+}
 
-  build_dictionary(input, &ctx);
-  printf("%d\n", input->offset);
-  dump_hex(ctx.dict_base, 64);
+/* Computes Huffman code lengths for the n symbols of syms (sorted by
+ * frequency, least frequent first) and limits them to max_bits. */
+static void code_lengths(const struct symbol_freq *syms, int n, int max_bits,
+    uint8_t *lens)
+{
+  size_t weight[2 * 256];
+  int parent[2 * 256];
+  int depth[2 * 256];
+  int count[32] = { 0 };
+  int leaf = 0, node = n, next = n;
+  int longest = 0;
+  int total;
+
+  if (n == 1) {
+    lens[syms[0].sym] = 0;
+    return;
+  }
 
-  printf("Counter: %d\n", ctx.counter);
-  printf("DX: %04x\n", ctx.dx);
+  /* Leaves and the merged nodes both come out in increasing weight, so the
+   * two lightest are always at the front of one of the two queues. */
+  for (int i = 0; i < n; i++)
+    weight[i] = syms[i].freq;
+  while (next < 2 * n - 1) {
+    for (int k = 0; k < 2; k++) {
+      int pick;
+
+      if (leaf < n && (node == next || weight[leaf] <= weight[node]))
+        pick = leaf++;
+      else
+        pick = node++;
+      parent[pick] = next;
+      weight[next] = k == 0 ? weight[pick] : weight[next] + weight[pick];
+    }
+    next++;
+  }
+
+  depth[2 * n - 2] = 0;
+  for (int i = 2 * n - 3; i >= 0; i--)
+    depth[i] = depth[parent[i]] + 1;
 
-  /* Using above dictionary, decompress */
-  decompress(input, &ctx, size, output);
+  /* At most 0xFFFF symbols, codes are shorter than 32 bits. */
+  for (int i = 0; i < n; i++) {
+    int len = depth[i];
 
-  free(dictionary);
+    if (max_bits != 0 && len > max_bits)
+      len = max_bits;
+    count[len]++;
+    if (len > longest)
+      longest = len;
+  }
+
+  /* Codes that were cut short leave the tree over full, lengthen the
+   * longest codes under the limit until it fits. */
+  total = 0;
+  for (int len = 1; len <= longest; len++)
+    total += count[len] << (longest - len);
+  while (total > (1 << longest)) {
+    count[longest]--;
+    for (int len = longest - 1; len > 0; len--) {
+      if (count[len] != 0) {
+        count[len]--;
+        count[len + 1] += 2;
+        break;
+      }
+    }
+    total--;
+  }
+
+  /* The least frequent symbols get the longest codes. */
+  for (int len = longest, i = 0; len > 0; len--) {
+    for (int k = 0; k < count[len]; k++)
+      lens[syms[i++].sym] = len;
+  }
+}
+
+struct bit_writer {
+  unsigned char *p;
+  size_t pos;         /* In bits. */
+};
+
+static void put_bits(struct bit_writer *w, uint32_t val, int nbits)
+{
+  while (nbits-- > 0) {
+    if ((val >> nbits) & 1)
+      w->p[w->pos >> 3] |= 0x80 >> (w->pos & 7);
+    w->pos++;
+  }
 }
 
+struct buf_wri *compress_data1(const unsigned char *data, size_t len,
+    int max_bits)
+{
+  struct symbol_freq syms[256];
+  size_t freq[256] = { 0 };
+  uint8_t lens[256] = { 0 };
+  uint32_t codes[256];
+  /* Tree built from the codes, sym is -1 for internal nodes. */
+  int child[2 * 256][2];
+  int sym[2 * 256];
+  int stack[2 * 256];
+  int nodes = 1, depth = 0;
+  int n = 0;
+  size_t bits, out_len;
+  uint32_t code = 0;
+  struct buf_wri *w;
+  struct bit_writer bw;
+
+  if (len > 0xFFFF)
+    return NULL;
+
+  for (size_t i = 0; i < len; i++)
+    freq[data[i]]++;
+  for (int i = 0; i < 256; i++) {
+    if (freq[i] != 0) {
+      syms[n].freq = freq[i];
+      syms[n].sym = i;
+      n++;
+    }
+  }
+
+  /* The tree needs one leaf even without any data. */
+  if (n == 0) {
+    syms[0].freq = 0;
+    syms[0].sym = 0;
+    n = 1;
+  }
+  if (max_bits < 0 || (max_bits > 0 && max_bits < 8 && n > (1 << max_bits)))
+    return NULL;
+
+  qsort(syms, n, sizeof(struct symbol_freq), cmp_symbol_freq);
+  code_lengths(syms, n, max_bits, lens);
+
+  /* Canonical codes, shorter codes first and by symbol within a length. */
+  child[0][0] = 0;
+  child[0][1] = 0;
+  sym[0] = n == 1 ? syms[0].sym : -1;
+  for (int l = 1; l < 32; l++) {
+    for (int s = 0; s < 256; s++) {
+      int cur = 0;
+
+      if (freq[s] == 0 || lens[s] != l)
+        continue;
+      codes[s] = code++;
+
+      for (int b = l - 1; b >= 0; b--) {
+        int bit = (codes[s] >> b) & 1;
+
+        if (child[cur][bit] == 0) {
+          child[nodes][0] = 0;
+          child[nodes][1] = 0;
+          sym[nodes] = -1;
+          child[cur][bit] = nodes++;
+        }
+        cur = child[cur][bit];
+      }
+      sym[cur] = s;
+    }
+    code <<= 1;
+  }
+
+  /* A 0 bit for internal nodes, a 1 bit and the symbol for leaves. */
+  bits = 0;
+  for (int i = 0; i < nodes; i++)
+    bits += sym[i] >= 0 ? 9 : 1;
+  for (int s = 0; s < 256; s++)
+    bits += freq[s] * lens[s];
+
+  /* The codes are read 16 bits at a time. */
+  out_len = 2 + (bits + 15) / 16 * 2;
+  w = buf_wri_init(out_len);
+  if (w == NULL)
+    return NULL;
+  memset(w->base, 0, out_len);
+  buf_add8(w, len & 0xFF);
+  buf_add8(w, len >> 8);
+
+  bw.p = w->base + 2;
+  bw.pos = 0;
+  stack[depth++] = 0;
+  while (depth > 0) {
+    int cur = stack[--depth];
+
+    if (sym[cur] >= 0) {
+      put_bits(&bw, 1, 1);
+      put_bits(&bw, sym[cur], 8);
+    } else {
+      put_bits(&bw, 0, 1);
+      stack[depth++] = child[cur][1];
+      stack[depth++] = child[cur][0];
+    }
+  }
+
+  for (size_t i = 0; i < len; i++)
+    put_bits(&bw, codes[data[i]], lens[data[i]]);
+
+  w->len = out_len;
+  return w;
+}
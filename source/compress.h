@@ -23,6 +23,78 @@
 extern "C" {
 #endif
 
+/* Codes up to this many bits are decoded with one table lookup. */
+#define DATA1_TABLE_BITS 10
+
+/* Input the largest dictionary (256 symbols) can take, after the size. */
+#define DATA1_DICT_INPUT_MAX 324
+
+enum data1_status {
+  DATA1_OK = 0,       /* The whole section has been decoded. */
+  DATA1_NEED_INPUT,   /* Feed more input or finish. */
+  DATA1_ERR_OUTPUT,   /* The section doesn't fit the output buffer. */
+  DATA1_ERR_DICT_SIZE,  /* Corrupt dictionary, too many nodes. */
+  DATA1_ERR_DICT_INPUT, /* Corrupt dictionary, longer than any valid one. */
+  DATA1_ERR_INPUT,    /* Truncated, the input ran out before the section. */
+};
+
+struct data1_code {
+  uint16_t value;     /* Symbol, or dictionary offset if len is 0. */
+  uint8_t len;        /* Bits used by the symbol. */
+};
+
+/* Decoder for one compressed section, kept by the caller so that decoding
+ * needs no allocation. */
+struct data1_decoder {
+  unsigned char *out;
+  size_t out_len;
+  size_t size;        /* Uncompressed size, once the head has been read. */
+  size_t produced;    /* Bytes of out decoded so far. */
+  int status;
+
+  /* Start of the section, collected until the dictionary can be built. */
+  unsigned char head[2 + DATA1_DICT_INPUT_MAX];
+  size_t head_len;
+  size_t head_off;
+  int dict_ready;
+
+  unsigned char dict[2048];
+  struct data1_code table[1 << DATA1_TABLE_BITS];
+
+  uint64_t bits;      /* Next bit is the top bit. */
+  int count;          /* Valid bits in bits. */
+  int node;           /* Dictionary node reached by a partial code. */
+  int pad;            /* Bits of bits that were added past the input. */
+};
+
+/*!***************************************************************************
+ * @short  Starts decoding a compressed section into out.
+ * @param  d       Decoder.
+ * @param  out     Buffer to write the uncompressed section to.
+ * @param  out_len Size of out.
+ *****************************************************************************/
+void data1_decoder_init(struct data1_decoder *d, unsigned char *out,
+    size_t out_len);
+
+/*!***************************************************************************
+ * @short  Decodes the next part of the section.
+ * @param  d   Decoder.
+ * @param  in  Next bytes of the section, starting with the size word.
+ * @param  len Number of bytes in in.
+ * @return DATA1_NEED_INPUT while there's output left to decode, DATA1_OK
+ *         when done or an error. d->produced bytes of out are ready.
+ *****************************************************************************/
+int data1_decoder_feed(struct data1_decoder *d, const unsigned char *in,
+    size_t len);
+
+/*!***************************************************************************
+ * @short  Decodes the rest of the section once all input has been fed.
+ * @param  d Decoder.
+ * @return DATA1_OK or an error, DATA1_ERR_INPUT if the section needs more
+ *         bits than were fed (the missing bits are decoded as 0).
+ *****************************************************************************/
+int data1_decoder_finish(struct data1_decoder *d);
+
 /*!***************************************************************************
  * @short  Decompress data1 content.
  * @param  input  Buffered reader to read from.
@@ -32,6 +104,18 @@ extern "C" {
  *****************************************************************************/
 void decompress_data1(struct buf_rdr *input, struct buf_wri *output, int size);
 
+/*!***************************************************************************
+ * @short  Compress data in the data1 format.
+ * @param  data     Bytes to compress, at most 0xFFFF.
+ * @param  len      Number of bytes in data.
+ * @param  max_bits Longest code to use, 0 for plain Huffman codes. With
+ *                  DATA1_TABLE_BITS every code is decoded with one lookup.
+ * @return A writer holding the section, starting with the size word, or
+ *         NULL on errors. Free with buf_wri_free.
+ *****************************************************************************/
+struct buf_wri *compress_data1(const unsigned char *data, size_t len,
+    int max_bits);
+
 #ifdef __cplusplus
 }
 #endif
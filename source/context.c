@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "context.h"
+#include "engine.h"
+#include "offsets.h"
+#include "player.h"
+#include "resource.h"
+#include "state.h"
+#include "ui.h"
+
+_Thread_local struct dw_context *dw_ctx;
+
+struct dw_context *
+dw_context_new(void)
+{
+  struct dw_context *ctx;
+
+  ctx = calloc(1, sizeof(struct dw_context));
+  if (ctx == NULL)
+    goto fail;
+
+  ctx->engine = engine_state_new();
+  ctx->state = calloc(1, sizeof(*ctx->state));
+  ctx->offsets = offsets_state_new();
+  ctx->player = player_state_new();
+  ctx->resource = resource_state_new();
+  ctx->ui = ui_state_new();
+  if (ctx->engine == NULL || ctx->state == NULL || ctx->offsets == NULL ||
+      ctx->player == NULL || ctx->resource == NULL || ctx->ui == NULL) {
+    dw_context_free(ctx);
+    goto fail;
+  }
+
+  return ctx;
+
+fail:
+  fprintf(stderr, "Failed to allocate engine context.\n");
+  return NULL;
+}
+
+void
+dw_context_free(struct dw_context *ctx)
+{
+  if (ctx == NULL)
+    return;
+
+  if (dw_ctx == ctx)
+    dw_ctx = NULL;
+
+  free(ctx->engine);
+  free(ctx->state);
+  free(ctx->offsets);
+  free(ctx->player);
+  free(ctx->resource);
+  free(ctx->ui);
+  free(ctx);
+}
+
+struct dw_context *
+dw_context_set(struct dw_context *ctx)
+{
+  struct dw_context *prev = dw_ctx;
+
+  dw_ctx = ctx;
+  return prev;
+}
+
+void
+dw_exit(int status)
+{
+  if (dw_ctx != NULL && dw_ctx->exit_jmp != NULL) {
+    dw_ctx->exit_status = status;
+    longjmp(*dw_ctx->exit_jmp, 1);
+  }
+  exit(status);
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Engine context.
+ *
+ * Everything that DRAGON.COM keeps in its data segment for one running
+ * game lives in a dw_context, split up by the module that owns it. Each
+ * thread runs the game of its current context (dw_ctx), so one process
+ * can run as many independent games as it has threads.
+ *
+ * The modules keep their original variable names, they are defined as
+ * macros over the current context (see the top of engine.c). Tables that
+ * never change after startup (tables.c, offsets) stay process wide. */
+
+#ifndef DW_CONTEXT_H
+#define DW_CONTEXT_H
+
+#include <setjmp.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct engine_state;
+struct game_state;
+struct offsets_state;
+struct player_state;
+struct resource_state;
+struct ui_state;
+
+struct dw_context {
+  struct engine_state *engine;
+  struct game_state *state;
+  struct offsets_state *offsets;
+  struct player_state *player;
+  struct resource_state *resource;
+  struct ui_state *ui;
+
+  // Owned by the video driver.
+  void *vga;
+
+  // Where dw_exit returns to, see game_run.
+  jmp_buf *exit_jmp;
+  int exit_status;
+};
+
+// Status of a game that stopped.
+#define DW_EXIT_DONE 0     // The script engine returned.
+#define DW_EXIT_ERROR 1    // Unhandled op code or unimplemented code path.
+#define DW_EXIT_NO_INPUT 2 // Scripted input ran out (headless driver).
+
+extern _Thread_local struct dw_context *dw_ctx;
+
+struct dw_context *dw_context_new(void);
+void dw_context_free(struct dw_context *ctx);
+
+// Makes ctx the current context of the calling thread, returns the
+// previous one.
+struct dw_context *dw_context_set(struct dw_context *ctx);
+
+// Stops the game of the current context. Inside game_run this only ends
+// that game, otherwise the process exits.
+void dw_exit(int status) __attribute__((noreturn));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DW_CONTEXT_H */
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+
+#include "decode.h"
+
+// Longest decoded instruction (op code + word operand).
+#define DECODE_MAX_LEN 3
+
+struct decoded_script *
+decode_new(size_t len)
+{
+  struct decoded_script *ds;
+
+  ds = malloc(sizeof(struct decoded_script));
+  if (ds == NULL)
+    return NULL;
+
+  ds->slots = calloc(len, sizeof(uint16_t));
+  if (ds->slots == NULL) {
+    free(ds);
+    return NULL;
+  }
+  ds->len = len;
+  ds->ops = NULL;
+  ds->nops = 0;
+  ds->cap = 0;
+
+  return ds;
+}
+
+void
+decode_free(struct decoded_script *ds)
+{
+  if (ds == NULL)
+    return;
+
+  free(ds->slots);
+  free(ds->ops);
+  free(ds);
+}
+
+struct decoded_op *
+decode_put(struct decoded_script *ds, size_t offset,
+    const struct decoded_op *op)
+{
+  uint16_t slot;
+  size_t idx;
+
+  if (offset >= ds->len)
+    return NULL;
+
+  slot = ds->slots[offset];
+  if (slot != DECODE_EMPTY && slot != DECODE_GENERIC) {
+    // Reuse the entry that was there before it went stale.
+    idx = (slot & ~DECODE_STALE) - 1;
+  } else {
+    if (ds->nops == DECODE_MAX_OPS) {
+      ds->slots[offset] = DECODE_GENERIC;
+      return NULL;
+    }
+    if (ds->nops == ds->cap) {
+      size_t cap = ds->cap == 0 ? 64 : ds->cap * 2;
+      struct decoded_op *ops = realloc(ds->ops, cap * sizeof(*ops));
+      if (ops == NULL)
+        return NULL;
+      ds->ops = ops;
+      ds->cap = cap;
+    }
+    idx = ds->nops++;
+  }
+
+  ds->ops[idx] = *op;
+  ds->slots[offset] = idx + 1;
+  return &ds->ops[idx];
+}
+
+void
+decode_mark_generic(struct decoded_script *ds, size_t offset)
+{
+  if (offset < ds->len && ds->slots[offset] == DECODE_EMPTY)
+    ds->slots[offset] = DECODE_GENERIC;
+}
+
+void
+decode_invalidate(struct decoded_script *ds, size_t offset, size_t n)
+{
+  size_t start, end;
+
+  // Any instruction starting up to DECODE_MAX_LEN - 1 bytes before the
+  // write can have an operand inside it.
+  start = offset >= DECODE_MAX_LEN - 1 ? offset - (DECODE_MAX_LEN - 1) : 0;
+  end = offset + n;
+  if (end > ds->len)
+    end = ds->len;
+
+  for (size_t i = start; i < end; i++) {
+    uint16_t slot = ds->slots[i];
+    if (slot != DECODE_EMPTY && slot != DECODE_GENERIC)
+      ds->slots[i] = slot | DECODE_STALE;
+  }
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef DW_DECODE_H
+#define DW_DECODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Pre-decoded script instructions.
+ *
+ * A script resource gets a decoded_script the first time the VM runs it.
+ * Every offset the VM has executed maps to either a decoded instruction
+ * (operands already read, jump targets kept as script offsets) or to a marker
+ * saying the op code has no decoded form and must go through the regular
+ * dispatcher. The cache hangs off the resource and is dropped when the
+ * resource is released or its bytes are written to. */
+
+struct decoded_op;
+
+typedef void (*decoded_func)(const struct decoded_op *op);
+
+struct decoded_op {
+  decoded_func exec;
+  uint16_t operand; // byte or word operand, width already resolved.
+  uint16_t next;    // offset of the following instruction.
+  uint8_t op_code;
+  uint8_t mode;     // byte_3AE1 at decode time, 0xFF if width is fixed.
+};
+
+struct decoded_script {
+  size_t len;       // length of the script resource.
+  uint16_t *slots;  // offset -> DECODE_* marker or op index + 1.
+  struct decoded_op *ops;
+  size_t nops;
+  size_t cap;
+};
+
+#define DECODE_EMPTY 0x0000   // not looked at yet.
+#define DECODE_GENERIC 0xFFFF // use the regular dispatcher.
+#define DECODE_STALE 0x8000   // set on an op that must be decoded again.
+#define DECODE_MAX_OPS 0x7FFE
+
+struct decoded_script *decode_new(size_t len);
+void decode_free(struct decoded_script *ds);
+
+// Returns the decoded instruction at offset, or NULL if there is none that
+// can be used.
+static inline const struct decoded_op *
+decode_get(const struct decoded_script *ds, size_t offset)
+{
+  uint16_t slot;
+
+  if (offset >= ds->len)
+    return NULL;
+  slot = ds->slots[offset];
+  if (slot == DECODE_EMPTY || (slot & DECODE_STALE) != 0)
+    return NULL;
+  return &ds->ops[slot - 1];
+}
+
+// Non zero when offset is known to have no decoded form.
+static inline int decode_is_generic(const struct decoded_script *ds,
+    size_t offset)
+{
+  return offset >= ds->len || ds->slots[offset] == DECODE_GENERIC;
+}
+
+// Stores op at offset, returns NULL when out of memory.
+struct decoded_op *decode_put(struct decoded_script *ds, size_t offset,
+    const struct decoded_op *op);
+void decode_mark_generic(struct decoded_script *ds, size_t offset);
+
+// Forget any instruction that overlaps bytes [offset, offset + n).
+void decode_invalidate(struct decoded_script *ds, size_t offset, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DW_DECODE_H */
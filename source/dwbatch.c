@@ -0,0 +1,311 @@
+/*
+ * Copyright (c) 2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Runs many headless games at once.
+ *
+ * usage: dwbatch [-j threads] session-file
+ *
+ * Every line of the session file is one game:
+ *
+ *   name seed [key ...]
+ *
+ * The seed (hex) starts the random number generator at 0x2D09 and the keys
+ * (hex key codes, as returned by getkey) are fed to the game in order. A
+ * game ends when the script engine stops, on an unhandled op code or when
+ * it asks for more keys than it was given. Blank lines and lines starting
+ * with '#' are skipped.
+ *
+ * The sessions run on a thread pool with one engine context each, the
+ * DATA1 sections are decompressed once and shared. When all are done one
+ * line is printed per session: name, how it ended, op codes executed, wall
+ * time, FNV-1a hashes of the framebuffer and the game state and the
+ * resource cache hits, misses and evictions. The debug output the games
+ * print on stdout is dropped. */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "context.h"
+#include "engine.h"
+#include "game.h"
+#include "log.h"
+#include "pool.h"
+#include "resource.h"
+#include "state.h"
+#include "tables.h"
+#include "vga.h"
+#include "vga_null.h"
+
+struct session {
+  char *name;
+  uint16_t seed;
+  uint16_t *keys;
+  size_t nkeys;
+
+  // Results
+  int status;
+  uint64_t op_count;
+  double wall_ms;
+  uint64_t fb_hash;
+  uint64_t state_hash;
+  struct resource_cache_stats cache;
+};
+
+static void
+usage(void)
+{
+  fprintf(stderr, "usage: dwbatch [-j threads] session-file\n");
+  exit(1);
+}
+
+static double
+now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void
+run_session(void *arg)
+{
+  struct session *s = arg;
+  struct dw_context *ctx;
+  const uint8_t *fb;
+  double start;
+
+  ctx = dw_context_new();
+  if (ctx == NULL) {
+    s->status = DW_EXIT_ERROR;
+    return;
+  }
+  dw_context_set(ctx);
+
+  if (vga_null_set_keys(s->keys, s->nkeys) != 0) {
+    s->status = DW_EXIT_ERROR;
+    dw_context_free(ctx);
+    return;
+  }
+  ctx->engine->word_2D09 = s->seed;
+
+  start = now_ms();
+  s->status = game_run();
+  s->wall_ms = now_ms() - start;
+
+  s->op_count = ctx->engine->op_count;
+  fb = vga->memory();
+  if (fb != NULL)
+    s->fb_hash = resource_hash(fb, GAME_WIDTH * GAME_HEIGHT);
+  s->state_hash = resource_hash(game_state.unknown, sizeof(game_state.unknown));
+  resource_cache_get_stats(&s->cache);
+
+  game_end();
+  dw_context_free(ctx);
+}
+
+// Parses "name seed [key ...]", returns 0 for a session, 1 for a line to
+// skip and -1 on errors.
+static int
+parse_session(char *line, struct session *s)
+{
+  char *tok, *end;
+  size_t cap = 0;
+
+  memset(s, 0, sizeof(struct session));
+
+  tok = strtok(line, " \t\r\n");
+  if (tok == NULL || tok[0] == '#')
+    return 1;
+  s->name = strdup(tok);
+
+  tok = strtok(NULL, " \t\r\n");
+  if (tok == NULL)
+    return -1;
+  s->seed = strtoul(tok, &end, 16);
+  if (*end != '\0')
+    return -1;
+
+  while ((tok = strtok(NULL, " \t\r\n")) != NULL) {
+    if (s->nkeys == cap) {
+      cap = cap ? cap * 2 : 64;
+      s->keys = realloc(s->keys, cap * sizeof(uint16_t));
+      if (s->keys == NULL)
+        return -1;
+    }
+    s->keys[s->nkeys++] = strtoul(tok, &end, 16);
+    if (*end != '\0')
+      return -1;
+  }
+
+  // An empty (but not NULL) key list still stops at the first key read.
+  if (s->keys == NULL)
+    s->keys = malloc(sizeof(uint16_t));
+  return 0;
+}
+
+static struct session *
+load_sessions(const char *fname, size_t *countp)
+{
+  struct session *sessions = NULL;
+  size_t count = 0, cap = 0;
+  char *line = NULL;
+  size_t line_sz = 0;
+  int linenum = 0;
+  FILE *fp;
+
+  fp = fopen(fname, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "Failed to open %s: %s\n", fname, strerror(errno));
+    return NULL;
+  }
+
+  while (getline(&line, &line_sz, fp) != -1) {
+    struct session s;
+    int rc;
+
+    linenum++;
+    rc = parse_session(line, &s);
+    if (rc == 1)
+      continue;
+    if (rc != 0) {
+      fprintf(stderr, "%s:%d: invalid session.\n", fname, linenum);
+      exit(1);
+    }
+
+    if (count == cap) {
+      cap = cap ? cap * 2 : 16;
+      sessions = realloc(sessions, cap * sizeof(struct session));
+      if (sessions == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+      }
+    }
+    sessions[count++] = s;
+  }
+
+  free(line);
+  fclose(fp);
+  *countp = count;
+  return sessions;
+}
+
+static const char *
+status_name(int status)
+{
+  switch (status) {
+  case DW_EXIT_DONE:
+    return "done";
+  case DW_EXIT_NO_INPUT:
+    return "input";
+  default:
+    return "error";
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct session *sessions;
+  struct pool *pool;
+  FILE *report;
+  size_t count = 0;
+  int nthreads = 0;
+  double start, wall_ms;
+  int i;
+
+  for (i = 1; i < argc - 1; i++) {
+    if (strcmp(argv[i], "-j") != 0 || i + 1 >= argc - 1)
+      usage();
+    nthreads = atoi(argv[++i]);
+  }
+  if (i != argc - 1)
+    usage();
+
+  sessions = load_sessions(argv[i], &count);
+  if (sessions == NULL)
+    return 1;
+
+  if (check_files() == 0 || resource_open() != 0)
+    return 1;
+
+  // Keep the real stdout for the report, the games only write debug
+  // output there.
+  report = fdopen(dup(STDOUT_FILENO), "w");
+  if (report == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+    fprintf(stderr, "Failed to redirect stdout: %s\n", strerror(errno));
+    return 1;
+  }
+  log_set_quiet(true);
+
+  load_chr_table();
+
+  pool = pool_new(nthreads);
+  if (pool == NULL) {
+    fprintf(stderr, "Failed to start thread pool.\n");
+    return 1;
+  }
+
+  if (resource_store_load(pool) != 0) {
+    fprintf(stderr, "Failed to load data1.\n");
+    return 1;
+  }
+
+  start = now_ms();
+  for (size_t n = 0; n < count; n++) {
+    if (pool_submit(pool, run_session, &sessions[n]) != 0) {
+      fprintf(stderr, "Failed to queue session %s.\n", sessions[n].name);
+      return 1;
+    }
+  }
+  pool_wait(pool);
+  wall_ms = now_ms() - start;
+
+  fprintf(report,
+      "# session status op_codes wall_ms framebuffer_hash state_hash "
+      "cache_hits cache_misses cache_evictions\n");
+  for (size_t n = 0; n < count; n++) {
+    struct session *s = &sessions[n];
+
+    fprintf(report, "%s %s %llu %.3f %016llx %016llx %llu %llu %llu\n",
+        s->name, status_name(s->status), (unsigned long long)s->op_count,
+        s->wall_ms, (unsigned long long)s->fb_hash,
+        (unsigned long long)s->state_hash,
+        (unsigned long long)s->cache.hits,
+        (unsigned long long)s->cache.misses,
+        (unsigned long long)s->cache.evictions);
+  }
+  fprintf(report, "# %zu sessions on %d threads in %.3f ms\n", count,
+      pool_threads(pool), wall_ms);
+
+  pool_free(pool);
+  resource_store_free();
+  unload_chr_table();
+  resource_close();
+  for (size_t n = 0; n < count; n++) {
+    free(sessions[n].name);
+    free(sessions[n].keys);
+  }
+  free(sessions);
+  fclose(report);
+  return 0;
+}
@@ -0,0 +1,484 @@
+/*
+ * Copyright (c) 2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Benchmarks the data1 loading pipeline.
+ *
+ * usage: dwbench [-r runs] [-w warmup] [-g baseline [-t percent]] [dir]
+ *
+ * Every workload runs warmup times untimed and then runs times, the median
+ * run is reported:
+ *
+ *   decompress  decompress_data1 over every compressed section.
+ *   load_cold   resource_load of every section into a new context, each
+ *               one decompressed from data1.
+ *   load_warm   the same with every section already in the shared store.
+ *
+ * The workloads run on a synthetic data1, written by compress_data1 to a
+ * temporary directory, and on the game files in dir when one is given.
+ * With -g the results are compared with an earlier report and dwbench
+ * fails when a workload got more than percent (10) slower or allocates
+ * more. */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bufio.h"
+#include "compress.h"
+#include "context.h"
+#include "log.h"
+#include "resource.h"
+
+#define SYNTHETIC_SECTIONS 48
+
+struct result {
+  const char *workload;
+  const char *fixture;
+  double mb_s;
+  double ns_byte;
+  uint64_t allocs;       /* Per run. */
+};
+
+static int runs = 20;
+static int warmup = 3;
+
+static struct result results[16];
+static int nresults;
+
+/* Allocations are counted by wrapping the allocator at link time
+ * (-Wl,--wrap=malloc and friends). */
+static uint64_t alloc_count;
+
+void *__real_malloc(size_t n);
+void *__real_calloc(size_t count, size_t n);
+void *__real_realloc(void *p, size_t n);
+
+void *
+__wrap_malloc(size_t n)
+{
+  alloc_count++;
+  return __real_malloc(n);
+}
+
+void *
+__wrap_calloc(size_t count, size_t n)
+{
+  alloc_count++;
+  return __real_calloc(count, n);
+}
+
+void *
+__wrap_realloc(void *p, size_t n)
+{
+  alloc_count++;
+  return __real_realloc(p, n);
+}
+
+static void
+usage(void)
+{
+  fprintf(stderr, "usage: dwbench [-r runs] [-w warmup] "
+      "[-g baseline [-t percent]] [dir]\n");
+  exit(1);
+}
+
+static double
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* Workloads, each returns the number of bytes it produced. */
+
+static size_t
+bench_decompress(void)
+{
+  static unsigned char out[0x10000];
+  size_t total = 0;
+
+  for (int sec = 0; sec < RESOURCE_MAX; sec++) {
+    const struct resource_dir_entry *e = resource_dir_lookup(sec);
+    struct file_view view;
+    struct buf_rdr in;
+    struct buf_wri w;
+
+    if (e == NULL || !e->is_compressed || data1_view(sec, &view) != 0)
+      continue;
+
+    /* decompress_data1 is handed the section past its size word. */
+    buf_rdr_open(&in, view.bytes + 2, view.len - 2);
+    buf_wri_open(&w, out, sizeof(out));
+    decompress_data1(&in, &w, e->uncompressed_len);
+    total += w.len;
+  }
+  return total;
+}
+
+static size_t
+load_all(void)
+{
+  struct dw_context *ctx;
+  size_t total = 0;
+
+  ctx = dw_context_new();
+  if (ctx == NULL)
+    exit(1);
+  dw_context_set(ctx);
+  if (rm_init() != 0)
+    exit(1);
+
+  for (int sec = 0; sec < RESOURCE_MAX; sec++) {
+    struct resource *res;
+
+    if (resource_dir_lookup(sec) == NULL)
+      continue;
+    res = resource_load(sec);
+    if (res == NULL) {
+      fprintf(stderr, "Failed to load section 0x%02X.\n", sec);
+      exit(1);
+    }
+    total += res->len;
+    resource_index_release(res->index);
+  }
+
+  rm_exit();
+  dw_context_free(ctx);
+  return total;
+}
+
+static void
+run_workload(const char *workload, const char *fixture, size_t (*fn)(void))
+{
+  double *times;
+  double median;
+  uint64_t allocs;
+  size_t bytes = 0;
+  struct result *r;
+
+  times = malloc(runs * sizeof(double));
+  if (times == NULL)
+    exit(1);
+
+  for (int i = 0; i < warmup; i++)
+    fn();
+
+  allocs = alloc_count;
+  for (int i = 0; i < runs; i++) {
+    double start = now_ns();
+
+    bytes = fn();
+    times[i] = now_ns() - start;
+  }
+  allocs = (alloc_count - allocs) / runs;
+
+  qsort(times, runs, sizeof(double), cmp_double);
+  median = times[runs / 2];
+  free(times);
+
+  if (nresults == (int)(sizeof(results) / sizeof(results[0])))
+    return;
+  r = &results[nresults++];
+  r->workload = workload;
+  r->fixture = fixture;
+  r->ns_byte = bytes ? median / bytes : 0;
+  r->mb_s = median > 0 ? bytes / (median / 1e9) / 1e6 : 0;
+  r->allocs = allocs;
+  printf("%-10s %-10s %6d %10.1f %8.2f %8llu\n", r->workload, r->fixture,
+      runs, r->mb_s, r->ns_byte, (unsigned long long)r->allocs);
+  fflush(stdout);
+}
+
+static int
+run_fixture(const char *fixture)
+{
+  if (resource_open() != 0) {
+    fprintf(stderr, "Failed to open the %s game files.\n", fixture);
+    return -1;
+  }
+
+  run_workload("decompress", fixture, bench_decompress);
+  run_workload("load_cold", fixture, load_all);
+
+  if (resource_store_load(NULL) != 0) {
+    fprintf(stderr, "Failed to load the %s data1.\n", fixture);
+    resource_close();
+    return -1;
+  }
+  run_workload("load_warm", fixture, load_all);
+  resource_store_free();
+
+  resource_close();
+  return 0;
+}
+
+/* Synthetic fixture */
+
+static uint32_t
+xorshift(uint32_t *state)
+{
+  uint32_t x = *state;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+/* Fills a section with one of three kinds of data: 4 bit pixels with runs
+ * (tiles and pictures), skewed text like bytes and uniform noise. */
+static void
+make_section(int kind, unsigned char *p, size_t len, uint32_t *rng)
+{
+  static const char letters[] = "eeeeeeeetttttaaaaoooiiinnnsshhrrdlu ";
+  unsigned char px = 0;
+
+  for (size_t i = 0; i < len; i++) {
+    switch (kind) {
+    case 0:
+      if (xorshift(rng) % 4 == 0)
+        px = xorshift(rng) & 0x0F;
+      p[i] = px << 4 | (xorshift(rng) % 3 == 0 ? px ^ 1 : px);
+      break;
+    case 1:
+      p[i] = letters[xorshift(rng) % (sizeof(letters) - 1)] |
+        (xorshift(rng) % 16 == 0 ? 0x80 : 0);
+      break;
+    default:
+      p[i] = xorshift(rng);
+      break;
+    }
+  }
+}
+
+static int
+write_file(const char *fname, const unsigned char *p, size_t len)
+{
+  FILE *fp = fopen(fname, "wb");
+
+  if (fp == NULL || fwrite(p, 1, len, fp) != len) {
+    fprintf(stderr, "Failed to write %s: %s\n", fname, strerror(errno));
+    if (fp != NULL)
+      fclose(fp);
+    return -1;
+  }
+  return fclose(fp);
+}
+
+/* Writes data1, data2 and an empty dragon.com to the current directory. */
+static int
+write_synthetic(void)
+{
+  unsigned char hdr[768];
+  struct buf_wri *sections[SYNTHETIC_SECTIONS] = { NULL };
+  unsigned char *raw, *body = NULL, *com = NULL;
+  size_t body_len = 0;
+  uint32_t rng = 0x2D09;
+  int rc = -1;
+
+  raw = malloc(0x10000);
+  if (raw == NULL)
+    goto out;
+  memset(hdr, 0xFF, sizeof(hdr));
+
+  /* A small uncompressed script section and compressed ones above 0x17. */
+  for (int i = 0; i < SYNTHETIC_SECTIONS; i++) {
+    int sec = i == 0 ? 0 : 0x17 + i;
+    size_t len = i == 0 ? 0x400 : 16000 + xorshift(&rng) % 48000;
+
+    make_section(i % 3, raw, len, &rng);
+    if (i == 0) {
+      sections[i] = buf_wri_init(len);
+      if (sections[i] != NULL)
+        buf_write_span(sections[i], raw, len);
+    } else {
+      sections[i] = compress_data1(raw, len, 0);
+    }
+    if (sections[i] == NULL)
+      goto out;
+    hdr[sec * 2] = sections[i]->len & 0xFF;
+    hdr[sec * 2 + 1] = sections[i]->len >> 8;
+    body_len += sections[i]->len;
+  }
+
+  body = malloc(sizeof(hdr) + body_len);
+  com = calloc(1, 0x10000);
+  if (body == NULL || com == NULL)
+    goto out;
+  memcpy(body, hdr, sizeof(hdr));
+  body_len = sizeof(hdr);
+  for (int i = 0; i < SYNTHETIC_SECTIONS; i++) {
+    memcpy(body + body_len, sections[i]->base, sections[i]->len);
+    body_len += sections[i]->len;
+  }
+
+  rc = write_file("data1", body, body_len) |
+    write_file("data2", com, 16) |
+    write_file("dragon.com", com, 0x10000);
+
+out:
+  if (rc != 0)
+    fprintf(stderr, "Failed to write the synthetic fixture.\n");
+  for (int i = 0; i < SYNTHETIC_SECTIONS; i++)
+    buf_wri_free(sections[i]);
+  free(raw);
+  free(body);
+  free(com);
+  return rc;
+}
+
+static int
+run_synthetic(void)
+{
+  char dir[] = "/tmp/dwbench.XXXXXX";
+  char cwd[FILENAME_MAX];
+  int rc = -1;
+
+  if (getcwd(cwd, sizeof(cwd)) == NULL || mkdtemp(dir) == NULL) {
+    fprintf(stderr, "Failed to set up the synthetic fixture: %s\n",
+        strerror(errno));
+    return -1;
+  }
+  if (chdir(dir) != 0) {
+    fprintf(stderr, "Failed to set up the synthetic fixture: %s\n",
+        strerror(errno));
+    rmdir(dir);
+    return -1;
+  }
+
+  if (write_synthetic() == 0)
+    rc = run_fixture("synthetic");
+
+  /* Whatever write_synthetic got to write. */
+  remove("data1");
+  remove("data2");
+  remove("dragon.com");
+  if (chdir(cwd) != 0 || rmdir(dir) != 0)
+    rc = -1;
+  return rc;
+}
+
+/* Regression gate */
+
+static int
+check_baseline(const char *fname, double tolerance)
+{
+  char workload[32], fixture[32];
+  double mb_s, ns_byte;
+  unsigned long long allocs;
+  int n, failed = 0;
+  char line[256];
+  FILE *fp;
+
+  fp = fopen(fname, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "Failed to open %s: %s\n", fname, strerror(errno));
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (line[0] == '#' || sscanf(line, "%31s %31s %d %lf %lf %llu",
+          workload, fixture, &n, &mb_s, &ns_byte, &allocs) != 6)
+      continue;
+
+    for (int i = 0; i < nresults; i++) {
+      struct result *r = &results[i];
+
+      if (strcmp(r->workload, workload) != 0 ||
+          strcmp(r->fixture, fixture) != 0)
+        continue;
+      if (r->mb_s < mb_s * (1 - tolerance / 100)) {
+        fprintf(stderr, "%s %s: %.1f MB/s, baseline %.1f MB/s\n", workload,
+            fixture, r->mb_s, mb_s);
+        failed = 1;
+      }
+      if (r->allocs > allocs) {
+        fprintf(stderr, "%s %s: %llu allocations, baseline %llu\n", workload,
+            fixture, (unsigned long long)r->allocs, allocs);
+        failed = 1;
+      }
+    }
+  }
+  fclose(fp);
+  return failed ? -1 : 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  const char *baseline = NULL;
+  double tolerance = 10;
+  int rc = 0;
+  int c;
+
+  while ((c = getopt(argc, argv, "r:w:g:t:")) != -1) {
+    switch (c) {
+    case 'r':
+      runs = atoi(optarg);
+      break;
+    case 'w':
+      warmup = atoi(optarg);
+      break;
+    case 'g':
+      baseline = optarg;
+      break;
+    case 't':
+      tolerance = atof(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (runs <= 0 || warmup < 0 || argc - optind > 1)
+    usage();
+
+  log_set_quiet(true);
+
+  printf("# workload fixture runs MB/s ns/byte allocs/run\n");
+  if (run_synthetic() != 0)
+    rc = 1;
+
+  if (optind < argc) {
+    if (chdir(argv[optind]) != 0) {
+      fprintf(stderr, "Failed to change to %s: %s\n", argv[optind],
+          strerror(errno));
+      return 1;
+    }
+    if (run_fixture("data1") != 0)
+      rc = 1;
+  }
+
+  if (baseline != NULL && check_baseline(baseline, tolerance) != 0) {
+    fprintf(stderr, "Regressed against %s.\n", baseline);
+    rc = 1;
+  }
+  return rc;
+}
@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Rebuilds a DATA1 file.
+ *
+ * usage: dwpack [-a] [-b bits] data1 out-file [section=file ...]
+ *
+ * Sections named on the command line (hex numbers) are replaced by the
+ * uncompressed contents of the file, sections above 0x17 are compressed.
+ * With -a all the compressed sections are decompressed and compressed again.
+ * -b limits the length of the codes, 10 (DATA1_TABLE_BITS) makes every code
+ * fit a single table lookup when decoding. The other sections are copied
+ * as they are and the 768 byte header is written with the new lengths. */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compress.h"
+#include "utils.h"
+
+#define DATA1_SECTIONS 384
+#define DATA1_HEADER_SIZE (DATA1_SECTIONS * 2)
+
+struct section {
+  uint16_t hdr_len;       /* As in the header, 0xFF00 and up when missing. */
+  const unsigned char *stored;
+  unsigned char *data;    /* Uncompressed contents to pack, or NULL. */
+  size_t len;
+  struct buf_wri *packed;
+};
+
+static void
+usage(void)
+{
+  fprintf(stderr,
+      "usage: dwpack [-a] [-b bits] data1 out-file [section=file ...]\n");
+  exit(1);
+}
+
+// Splits the stored sections of data1 out into sections.
+static int
+parse_data1(const unsigned char *d1, size_t len, struct section *sections)
+{
+  size_t offset = DATA1_HEADER_SIZE;
+
+  if (len < DATA1_HEADER_SIZE) {
+    fprintf(stderr, "Failed to read data1 header bytes.\n");
+    return -1;
+  }
+
+  for (int sec = 0; sec < DATA1_SECTIONS; sec++) {
+    struct section *s = &sections[sec];
+
+    s->hdr_len = d1[sec * 2] | (d1[sec * 2 + 1] << 8);
+    if (s->hdr_len >= 0xFF00)
+      continue;
+    if (offset + s->hdr_len > len) {
+      fprintf(stderr, "Section 0x%02X is past the end of data1 file.\n", sec);
+      return -1;
+    }
+    s->stored = d1 + offset;
+    offset += s->hdr_len;
+  }
+  return 0;
+}
+
+static int
+unpack_section(int sec, struct section *s)
+{
+  struct data1_decoder *d;
+  size_t size;
+
+  if (s->hdr_len < 2) {
+    fprintf(stderr, "Section 0x%02X is too short.\n", sec);
+    return -1;
+  }
+
+  size = s->stored[0] | (s->stored[1] << 8);
+  s->data = malloc(size + 1);
+  d = malloc(sizeof(struct data1_decoder));
+  if (s->data == NULL || d == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    free(d);
+    return -1;
+  }
+
+  data1_decoder_init(d, s->data, size);
+  data1_decoder_feed(d, s->stored, s->hdr_len);
+  if (data1_decoder_finish(d) != DATA1_OK) {
+    fprintf(stderr, "Failed to decompress section 0x%02X.\n", sec);
+    free(d);
+    return -1;
+  }
+  s->len = size;
+  free(d);
+  return 0;
+}
+
+static int
+pack_section(int sec, struct section *s, int max_bits)
+{
+  if (sec <= 0x17) {
+    s->packed = buf_wri_init(s->len + 1);
+    if (s->packed != NULL)
+      buf_write_span(s->packed, s->data, s->len);
+  } else {
+    s->packed = compress_data1(s->data, s->len, max_bits);
+  }
+
+  if (s->packed == NULL) {
+    fprintf(stderr, "Failed to compress section 0x%02X.\n", sec);
+    return -1;
+  }
+  if (s->packed->len >= 0xFF00) {
+    fprintf(stderr, "Section 0x%02X is too large (%zu bytes).\n", sec,
+        s->packed->len);
+    return -1;
+  }
+  return 0;
+}
+
+static int
+write_data1(const char *fname, struct section *sections)
+{
+  unsigned char hdr[DATA1_HEADER_SIZE];
+  FILE *fp;
+  int rc = 0;
+
+  for (int sec = 0; sec < DATA1_SECTIONS; sec++) {
+    struct section *s = &sections[sec];
+    uint16_t len = s->packed ? s->packed->len : s->hdr_len;
+
+    hdr[sec * 2] = len & 0xFF;
+    hdr[sec * 2 + 1] = len >> 8;
+  }
+
+  fp = fopen(fname, "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "Failed to open %s: %s\n", fname, strerror(errno));
+    return -1;
+  }
+  if (fwrite(hdr, 1, sizeof(hdr), fp) != sizeof(hdr))
+    rc = -1;
+  for (int sec = 0; sec < DATA1_SECTIONS && rc == 0; sec++) {
+    struct section *s = &sections[sec];
+
+    if (s->packed != NULL) {
+      if (fwrite(s->packed->base, 1, s->packed->len, fp) != s->packed->len)
+        rc = -1;
+    } else if (s->hdr_len < 0xFF00) {
+      if (fwrite(s->stored, 1, s->hdr_len, fp) != s->hdr_len)
+        rc = -1;
+    }
+  }
+  if (fclose(fp) != 0)
+    rc = -1;
+
+  if (rc != 0)
+    fprintf(stderr, "Failed to write %s.\n", fname);
+  return rc;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct section *sections;
+  unsigned char *d1;
+  size_t d1_len;
+  size_t old_total = 0, new_total = 0;
+  int repack_all = 0;
+  int max_bits = 0;
+  int rc = 0;
+  int i;
+
+  for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+    if (strcmp(argv[i], "-a") == 0) {
+      repack_all = 1;
+    } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+      max_bits = atoi(argv[++i]);
+      if (max_bits < 8 || max_bits > 16)
+        usage();
+    } else {
+      usage();
+    }
+  }
+  if (argc - i < 2)
+    usage();
+
+  d1 = read_file(argv[i], &d1_len);
+  if (d1 == NULL)
+    return 1;
+
+  sections = calloc(DATA1_SECTIONS, sizeof(struct section));
+  if (sections == NULL || parse_data1(d1, d1_len, sections) != 0)
+    return 1;
+
+  for (int n = i + 2; n < argc; n++) {
+    char *end;
+    long sec = strtol(argv[n], &end, 16);
+    struct section *s;
+
+    if (end == argv[n] || *end != '=' || sec < 0 || sec >= DATA1_SECTIONS)
+      usage();
+    s = &sections[sec];
+    free(s->data);
+    s->data = read_file(end + 1, &s->len);
+    if (s->data == NULL)
+      return 1;
+    if (sec > 0x17 && s->len > 0xFFFF) {
+      fprintf(stderr, "%s is too large for section 0x%02lX.\n", end + 1, sec);
+      return 1;
+    }
+  }
+
+  for (int sec = 0; sec < DATA1_SECTIONS && rc == 0; sec++) {
+    struct section *s = &sections[sec];
+
+    if (s->data == NULL && repack_all && sec > 0x17 && s->hdr_len < 0xFF00)
+      rc = unpack_section(sec, s);
+    if (rc == 0 && s->data != NULL)
+      rc = pack_section(sec, s, max_bits);
+  }
+
+  if (rc == 0)
+    rc = write_data1(argv[i + 1], sections);
+
+  for (int sec = 0; sec < DATA1_SECTIONS; sec++) {
+    struct section *s = &sections[sec];
+
+    if (s->hdr_len < 0xFF00)
+      old_total += s->hdr_len;
+    if (s->packed != NULL)
+      new_total += s->packed->len;
+    else if (s->hdr_len < 0xFF00)
+      new_total += s->hdr_len;
+    free(s->data);
+    buf_wri_free(s->packed);
+  }
+  if (rc == 0) {
+    printf("%s: %zu bytes of sections, was %zu\n", argv[i + 1], new_total,
+        old_total);
+  }
+
+  free(sections);
+  free(d1);
+  return rc == 0 ? 0 : 1;
+}
@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Finds the packed text in a DATA1 file.
+ *
+ * usage: dwstrings [-a] [-m glyphs] [-o index-file] data1
+ *
+ * Every section is decompressed and searched for strings with the game's
+ * decoder (text.c). There's no telling text from other bytes, so a string
+ * is taken where the scripts print one: right after a 0x78 or 0x7B op code
+ * byte, and right after another string (tables of strings read one after
+ * the other by 0x7A and 0x7C). With -a every offset is tried. A string
+ * must end inside its section and have at least -m glyphs (default 2).
+ *
+ * One line is printed per string: section, offset, the bit after its last
+ * code and the text, with 0xAF/0xDC text and the 0x1E shifts as decoded.
+ * With -o the strings are also written to an index file (see text.h) for
+ * $DW_TEXT_INDEX, the game then takes them from the index instead of
+ * decoding them. */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "resource.h"
+#include "text.h"
+
+struct found_string {
+  uint16_t section;
+  uint16_t offset;
+  uint16_t nsrc;
+  uint32_t end_bit;
+  struct text_string ts;
+};
+
+struct found_list {
+  struct found_string *strings;
+  size_t count;
+  size_t cap;
+};
+
+static void
+usage(void)
+{
+  fprintf(stderr, "usage: dwstrings [-a] [-m glyphs] [-o index-file] data1\n");
+  exit(1);
+}
+
+static int
+add_string(struct found_list *list, const struct found_string *s)
+{
+  if (list->count == list->cap) {
+    size_t cap = list->cap ? list->cap * 2 : 256;
+    struct found_string *strings;
+
+    strings = realloc(list->strings, cap * sizeof(struct found_string));
+    if (strings == NULL)
+      return -1;
+    list->strings = strings;
+    list->cap = cap;
+  }
+  list->strings[list->count++] = *s;
+  return 0;
+}
+
+static void
+print_glyph(uint8_t glyph, void *arg)
+{
+  FILE *fp = arg;
+  int c = glyph & 0x7F;
+
+  if (c == '\\')
+    fputs("\\\\", fp);
+  else if (c >= 0x20 && c < 0x7F)
+    fputc(c, fp);
+  else
+    fprintf(fp, "\\x%02x", glyph);
+}
+
+static int
+scan_section(int sec, const unsigned char *bytes, size_t len, int all,
+    size_t min_glyphs, struct found_list *list)
+{
+  unsigned char *candidate;
+
+  candidate = calloc(len + 1, 1);
+  if (candidate == NULL)
+    return -1;
+
+  for (size_t off = 0; off < len; off++) {
+    if (all || (off > 0 && (bytes[off - 1] == 0x78 || bytes[off - 1] == 0x7B)))
+      candidate[off] = 1;
+  }
+
+  for (size_t off = 0; off < len; off++) {
+    struct found_string s;
+
+    if (!candidate[off])
+      continue;
+    if (text_unpack(bytes, len, off, &s.ts) != 0) {
+      free(candidate);
+      return -1;
+    }
+
+    if (!s.ts.complete || s.ts.end > len || s.ts.nglyphs < min_glyphs ||
+        s.ts.nglyphs > UINT16_MAX) {
+      free(s.ts.glyphs);
+      continue;
+    }
+
+    s.section = sec;
+    s.offset = off;
+    s.nsrc = s.ts.end - off;
+    s.end_bit = s.ts.end_bit;
+    if (add_string(list, &s) != 0) {
+      free(s.ts.glyphs);
+      free(candidate);
+      return -1;
+    }
+    candidate[s.ts.end] = 1;
+  }
+
+  free(candidate);
+  return 0;
+}
+
+static int
+write_index(const char *fname, const struct found_list *list,
+    const unsigned char *const *sections, uint64_t hash)
+{
+  struct text_index_header hdr;
+  size_t data = sizeof(hdr) + list->count * sizeof(struct text_index_entry);
+  FILE *fp;
+  int rc = 0;
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, TEXT_INDEX_MAGIC, sizeof(TEXT_INDEX_MAGIC));
+  hdr.version = TEXT_INDEX_VERSION;
+  hdr.count = list->count;
+  hdr.data1_hash = hash;
+
+  fp = fopen(fname, "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "Failed to open %s: %s\n", fname, strerror(errno));
+    return -1;
+  }
+  if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+    rc = -1;
+
+  for (size_t i = 0; i < list->count && rc == 0; i++) {
+    const struct found_string *s = &list->strings[i];
+    struct text_index_entry e;
+
+    e.section = s->section;
+    e.offset = s->offset;
+    e.nsrc = s->nsrc;
+    e.nglyphs = s->ts.nglyphs;
+    e.end_bit = s->end_bit;
+    e.data = data;
+    data += s->nsrc + s->ts.nglyphs;
+    if (fwrite(&e, sizeof(e), 1, fp) != 1)
+      rc = -1;
+  }
+
+  for (size_t i = 0; i < list->count && rc == 0; i++) {
+    const struct found_string *s = &list->strings[i];
+
+    if (fwrite(sections[s->section] + s->offset, 1, s->nsrc, fp) != s->nsrc ||
+        fwrite(s->ts.glyphs, 1, s->ts.nglyphs, fp) != s->ts.nglyphs)
+      rc = -1;
+  }
+
+  if (fclose(fp) != 0)
+    rc = -1;
+  if (rc != 0)
+    fprintf(stderr, "Failed to write %s.\n", fname);
+  return rc;
+}
+
+int
+main(int argc, char *argv[])
+{
+  unsigned char *sections[RESOURCE_MAX] = { NULL };
+  struct found_list list = { NULL, 0, 0 };
+  const char *index_name = NULL;
+  size_t min_glyphs = 2;
+  int all = 0;
+  int rc = 0;
+  int i;
+
+  for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+    if (strcmp(argv[i], "-a") == 0) {
+      all = 1;
+    } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+      min_glyphs = strtoul(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      index_name = argv[++i];
+    } else {
+      usage();
+    }
+  }
+  if (argc - i != 1)
+    usage();
+
+  if (resource_open_data1(argv[i]) != 0)
+    return 1;
+
+  for (int sec = 0; sec < RESOURCE_MAX && rc == 0; sec++) {
+    const struct resource_dir_entry *e = resource_dir_lookup(sec);
+    size_t len;
+
+    // Missing or empty section.
+    if (e == NULL || e->uncompressed_len == 0)
+      continue;
+
+    sections[sec] = resource_read_section(sec, &len);
+    if (sections[sec] == NULL) {
+      fprintf(stderr, "Failed to load section 0x%02X.\n", sec);
+      rc = -1;
+    } else {
+      rc = scan_section(sec, sections[sec], len, all, min_glyphs, &list);
+    }
+  }
+
+  for (size_t n = 0; n < list.count && rc == 0; n++) {
+    const struct found_string *s = &list.strings[n];
+
+    // Both sides of 0xAF/0xDC text, so the lines don't depend on the game.
+    printf("%02X %04X %u ", s->section, s->offset, s->end_bit);
+    for (size_t g = 0; g < s->ts.nglyphs; g++)
+      print_glyph(s->ts.glyphs[g], stdout);
+    putchar('\n');
+  }
+
+  if (rc == 0 && index_name != NULL)
+    rc = write_index(index_name, &list, (const unsigned char *const *)sections,
+        resource_data1_hash());
+  if (rc != 0)
+    fprintf(stderr, "Failed to index strings.\n");
+
+  for (size_t n = 0; n < list.count; n++)
+    free(list.strings[n].ts.glyphs);
+  free(list.strings);
+  for (int sec = 0; sec < RESOURCE_MAX; sec++)
+    free(sections[sec]);
+  resource_close();
+  return rc == 0 ? 0 : 1;
+}
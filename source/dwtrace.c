@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Prints a trace file written by the engine (see trace.h) as text. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+static const char *subsystem_names[TRACE_SUBSYSTEM_COUNT] = {
+  "vm", "ui", "res"
+};
+
+static const char *event_formats[TRACE_EVENT_COUNT] = {
+#define TRACE_EVENT_FORMAT(name, sub, fmt) fmt,
+  TRACE_EVENTS(TRACE_EVENT_FORMAT)
+#undef TRACE_EVENT_FORMAT
+};
+
+static void
+usage(void)
+{
+  fprintf(stderr, "usage: dwtrace [-s vm|ui|res] trace-file\n");
+  exit(1);
+}
+
+static void
+print_record(uint32_t ring, uint64_t ticks, const struct trace_record *rec)
+{
+  const int32_t *a = rec->args;
+
+  printf("%u %12llu %-3s ", ring, (unsigned long long)ticks,
+      rec->subsystem < TRACE_SUBSYSTEM_COUNT ?
+      subsystem_names[rec->subsystem] : "?");
+  if (rec->event >= TRACE_EVENT_COUNT) {
+    printf("unknown event %u: %d %d %d %d %d\n", rec->event,
+        a[0], a[1], a[2], a[3], a[4]);
+    return;
+  }
+  printf(event_formats[rec->event], a[0], a[1], a[2], a[3], a[4]);
+  printf("\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct trace_file_header hdr;
+  int subsystem = -1;
+  FILE *fp;
+  int i;
+
+  for (i = 1; i < argc - 1; i++) {
+    if (strcmp(argv[i], "-s") != 0)
+      usage();
+    i++;
+    for (subsystem = 0; subsystem < TRACE_SUBSYSTEM_COUNT; subsystem++) {
+      if (strcmp(argv[i], subsystem_names[subsystem]) == 0)
+        break;
+    }
+    if (subsystem == TRACE_SUBSYSTEM_COUNT)
+      usage();
+  }
+  if (i != argc - 1)
+    usage();
+
+  fp = fopen(argv[i], "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "Failed to open %s.\n", argv[i]);
+    return 1;
+  }
+
+  if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+      memcmp(hdr.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0) {
+    fprintf(stderr, "%s is not a trace file.\n", argv[i]);
+    return 1;
+  }
+  if (hdr.version != TRACE_VERSION ||
+      hdr.record_size != sizeof(struct trace_record)) {
+    fprintf(stderr, "%s: unsupported trace version %u.\n", argv[i],
+        hdr.version);
+    return 1;
+  }
+
+  printf("# ring %s subsystem event\n", hdr.clock_cycles ? "cycles" : "ns");
+  for (uint32_t r = 0; r < hdr.nrings; r++) {
+    struct trace_file_ring ring;
+    struct trace_record rec;
+    uint64_t start = 0;
+
+    if (fread(&ring, sizeof(ring), 1, fp) != 1) {
+      fprintf(stderr, "Truncated trace file.\n");
+      return 1;
+    }
+    if (ring.dropped != 0) {
+      printf("# ring %u: %llu older records were overwritten\n", ring.id,
+          (unsigned long long)ring.dropped);
+    }
+    for (uint32_t n = 0; n < ring.count; n++) {
+      if (fread(&rec, sizeof(rec), 1, fp) != 1) {
+        fprintf(stderr, "Truncated trace file.\n");
+        return 1;
+      }
+      if (n == 0)
+        start = rec.timestamp;
+      if (subsystem == -1 || rec.subsystem == subsystem)
+        print_record(ring.id, rec.timestamp - start, &rec);
+    }
+  }
+
+  fclose(fp);
+  return 0;
+}
@@ -19,11 +19,15 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "decode.h"
 #include "engine.h"
 #include "player.h"
+#include "profile.h"
 #include "resource.h"
 #include "state.h"
 #include "tables.h"
+#include "text.h"
+#include "trace.h"
 #include "ui.h"
 #include "utils.h"
 #include "vga.h"
@@ -31,50 +35,10 @@
 /* Represents the engine that Dragon wars runs.
  *
  * It appears that Dragon Wars executes a script where each op code
- * does some action.
- *
- * Lots of global variables here until we can figure out how they are used. */
-
-uint16_t counter_104D;
-
-unsigned char byte_104E;
-// 104F is technically a dword with segment:offset.
-uint16_t word_104F = 0; // offset into 1051
-struct resource *word_1051;
-
-uint16_t word_11C0 = 0;
-uint16_t word_11C2 = 0;
-uint16_t word_11C4 = 0;
-uint16_t word_11C6 = 0;
-uint16_t word_11C8 = 0;
-
-uint16_t word_11CA = 0;
-uint16_t word_11CC = 0;
-
-
-uint8_t byte_1CE1 = 0;
-uint8_t byte_1CE2 = 0;
-
-// 0x1CE3
-// Represents number of bits that are remaining to be read from bit_buffer.
-uint8_t num_bits = 0;
-// 0x1CE5
-// Will contain actual remaining bits.
-uint8_t bit_buffer = 0;
-
-uint8_t byte_1BE5 = 0;
-
-// 0x1C63
-// Typically will be (player number * 0x200) + 0xC960
-uint16_t player_base_offset = 0;
+ * does some action. */
 
-uint8_t byte_1CE4 = 0;
-uint8_t byte_1E1F = 0;
-uint8_t byte_1E20 = 0;
-
-// This is an unknown size, currently guessing at
-// 0x1E21 - 0x1F0F
-unsigned char *data_1E21;
+// Read only tables from the data segment, the variables of a running game
+// are in struct engine_state (engine.h) and used through the macros below.
 
 // 0x1EB9, 2 bytes, since there's a function at 0x1EBB
 unsigned char data_1EB9[] = { 0xC2, 0x00 };
@@ -84,64 +48,8 @@ unsigned char data_1EB9[] = { 0xC2, 0x00 };
 // 0x824, 0x9B (Escape)
 unsigned char data_2C0E[] = { 0x04, 0x82, 0x9B, 0x00, 0x00, 0xFF };
 
-uint8_t byte_1F07 = 0;
-uint8_t byte_1F08 = 0;
-
-// 0x246D
-uint16_t word_246D;
-
-unsigned char byte_2476;
-
-uint16_t word_2AA2;
-unsigned char *word_2AA4;
-
-uint8_t byte_2AA6;
-// 0x2AA7
-uint16_t word_2AA7;
-uint8_t byte_2AA9;
-uint8_t data_2AAA[32] = { 0 };
-
-// 0x2D09
-uint16_t word_2D09; // timer ticks?
 uint16_t word_2DD7 = 0xFFFF;
 uint16_t word_2DD9 = 0xFFFF;
-uint8_t data_2DDB[160] = { 0 };
-
-uint16_t word_36C0;
-uint16_t word_36C2;
-uint16_t g_linenum; // 36C4
-
-uint8_t byte_3855 = 0;
-uint16_t word_3856 = 0;
-uint8_t byte_3867 = 0;
-uint8_t byte_387F = 0;
-
-uint8_t byte_3AE1 = 0;
-uint16_t word_3AE2 = 0;
-uint16_t word_3AE4 = 0;
-uint16_t word_3AE6 = 0;
-uint16_t word_3AE8 = 0;
-uint16_t word_3AEA = 0;
-// 0x3AEC
-uint16_t saved_stack = 0;
-
-uint16_t word_3ADB = 0;
-
-struct bit_extractor {
-  unsigned char *data;
-  uint16_t offset;
-};
-
-// "Bit extraction"
-// 0x1CEF
-struct bit_extractor bit_extractor_info;
-
-/* 0x3ADD */
-const struct resource *running_script = NULL;
-const struct resource *word_3ADF = NULL;
-
-uint16_t word_42D6 = 0;
-uint16_t word_4454 = 0;
 
 // 0x4A99
 unsigned char data_4A99[] = { 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01 };
@@ -152,23 +60,6 @@ unsigned char data_49AB[] = { 0xFE, 0x6, 0x97, 0x7F, 0x2B, 0xC0 };
 // 0x49CA (keys ?)
 unsigned char data_49CA[] = { 0x00, 0x00, 0xCE, 0x00, 0x00, 0xD9, 0x00, 0x00, 0xFF };
 
-unsigned char byte_4F0F;
-unsigned char byte_4F10 = 0;
-
-// 0x4F19 - 0x4F2A ? (how big is this really?)
-unsigned char data_4F19[17] = { 0 };
-uint8_t byte_4F2B = 0;
-
-// Another function pointer.
-void (*word_5038)(unsigned char *dest, unsigned int offset);
-
-// Length unknown, purpose unknown, from COM file.
-unsigned char *data_5303;
-
-unsigned char *data_5521;
-uint8_t byte_551E;
-uint16_t word_551F;
-
 // 0x558F - 0x55BE
 unsigned short data_558F[] = {
   0x0020, 0x0000, 0x0080, 0xFFC0,
@@ -250,81 +141,11 @@ unsigned char data_56B5[] = {
   0x0006, 0x0004, 0x0008
 };
 
-// Unknown how large this is.
-// But also referenced as: 56E5 (not sure if this is correct at this point)
-unsigned char data_56C7[128];
-unsigned char data_56E5[128];
-unsigned char data_5A04[128];
-
-static struct resource *data_59E4[128];
-
-uint16_t word_5864; // offset
-unsigned char *data_5866; // data
-
-// Unknown how large this is
-// 0x5897
-unsigned char data_5897[256];
-
-
-// 0x4C31 - 0x4C34
-unsigned char word_4C31[4];
-
-/* Timers? */
-struct timer_ctx {
-  uint8_t  timer0; // 0x4C35
-  uint8_t  timer1; // 0x4C36
-  uint8_t  timer2; // 0x4C37
-  uint16_t timer3; // 0x4C38
-  uint16_t timer4; // 0x4C3A
-  uint8_t  timer5; // 0x4C3C
-};
-
-struct timer_ctx timers;
-
-unsigned char *data_2A68 = NULL;
-unsigned char *data_D760 = NULL;
-
-// XXX:How big should these be???
-// It looks like they can be 0x0E00 bytes, but we round up to 4096.
-unsigned char data_CA4C[4096] = { 0 };
-
-// The function signature for this function pointer is not entirely correct
-// but we'll figure it out as we decode more of DW.
-void (*word_3163)(unsigned char byte);
-
 struct len_bytes {
   uint16_t len;
   uint8_t bytes[40];
 };
 
-// Small stack, hopefully we don't use much of it.
-#define STACK_SIZE 32
-
-// virtual CPU
-struct virtual_cpu {
-  // registers
-  uint16_t ax;
-  uint16_t bx;
-  uint16_t cx;
-  uint16_t dx;
-
-  uint16_t di;
-  uint16_t si;
-
-  // stack
-  uint8_t stack[STACK_SIZE]; // stacks;
-  uint8_t sp;
-
-  // flags
-  uint8_t cf;
-  uint8_t zf;
-  uint8_t sf;
-
-  // program counter
-  unsigned char *pc;
-  unsigned char *base_pc;
-};
-
 /* | Bit # |  Mask  | Abbreviation       | Description                     |
  * +-------+--------+--------------------+---------------------------------+
  * | 0     | 0x0001 | CF                 | Carry flag                      |
@@ -347,20 +168,95 @@ struct virtual_cpu {
 #define ZERO_FLAG_MASK 0x40
 #define SIGN_FLAG_MASK 0x80
 
-struct virtual_cpu cpu;
-struct mouse_status mouse;
+// Variables of the current game.
+#define ENGINE (dw_ctx->engine)
+#define counter_104D (ENGINE->counter_104D)
+#define word_104F (ENGINE->word_104F)
+#define word_1051 (ENGINE->word_1051)
+#define word_11C0 (ENGINE->word_11C0)
+#define word_11C2 (ENGINE->word_11C2)
+#define word_11C4 (ENGINE->word_11C4)
+#define word_11C6 (ENGINE->word_11C6)
+#define word_11C8 (ENGINE->word_11C8)
+#define word_11CA (ENGINE->word_11CA)
+#define word_11CC (ENGINE->word_11CC)
+#define byte_1BE5 (ENGINE->byte_1BE5)
+#define player_base_offset (ENGINE->player_base_offset)
+#define byte_1E1F (ENGINE->byte_1E1F)
+#define byte_1E20 (ENGINE->byte_1E20)
+#define data_1E21 (ENGINE->data_1E21)
+#define byte_1F07 (ENGINE->byte_1F07)
+#define byte_1F08 (ENGINE->byte_1F08)
+#define word_246D (ENGINE->word_246D)
+#define word_2AA2 (ENGINE->word_2AA2)
+#define word_2AA4 (ENGINE->word_2AA4)
+#define byte_2AA6 (ENGINE->byte_2AA6)
+#define word_2AA7 (ENGINE->word_2AA7)
+#define byte_2AA9 (ENGINE->byte_2AA9)
+#define word_2D09 (ENGINE->word_2D09)
+#define data_2DDB (ENGINE->data_2DDB)
+#define word_36C0 (ENGINE->word_36C0)
+#define word_36C2 (ENGINE->word_36C2)
+#define g_linenum (ENGINE->g_linenum)
+#define byte_3855 (ENGINE->byte_3855)
+#define word_3856 (ENGINE->word_3856)
+#define byte_3867 (ENGINE->byte_3867)
+#define byte_387F (ENGINE->byte_387F)
+#define byte_3AE1 (ENGINE->byte_3AE1)
+#define word_3AE2 (ENGINE->word_3AE2)
+#define word_3AE4 (ENGINE->word_3AE4)
+#define word_3AE6 (ENGINE->word_3AE6)
+#define word_3AE8 (ENGINE->word_3AE8)
+#define word_3AEA (ENGINE->word_3AEA)
+#define saved_stack (ENGINE->saved_stack)
+#define word_3ADB (ENGINE->word_3ADB)
+#define running_script (ENGINE->running_script)
+#define word_3ADF (ENGINE->word_3ADF)
+#define word_42D6 (ENGINE->word_42D6)
+#define word_4454 (ENGINE->word_4454)
+#define data_4F19 (ENGINE->data_4F19)
+#define byte_4F2B (ENGINE->byte_4F2B)
+#define word_5038 (ENGINE->word_5038)
+#define data_5303 (ENGINE->data_5303)
+#define data_5521 (ENGINE->data_5521)
+#define byte_551E (ENGINE->byte_551E)
+#define word_551F (ENGINE->word_551F)
+#define data_56C7 (ENGINE->data_56C7)
+#define data_56E5 (ENGINE->data_56E5)
+#define data_5A04 (ENGINE->data_5A04)
+#define data_59E4 (ENGINE->data_59E4)
+#define word_5864 (ENGINE->word_5864)
+#define data_5866 (ENGINE->data_5866)
+#define data_5866_len (ENGINE->data_5866_len)
+#define data_5897 (ENGINE->data_5897)
+#define map_next (ENGINE->map_next)
+#define map_prev (ENGINE->map_prev)
+#define timers (ENGINE->timers)
+#define data_2A68 (ENGINE->data_2A68)
+#define data_D760 (ENGINE->data_D760)
+#define data_CA4C (ENGINE->data_CA4C)
+#define word_3163 (ENGINE->word_3163)
+#define cpu (ENGINE->cpu)
+#define mouse (ENGINE->mouse)
+
+struct engine_state *
+engine_state_new(void)
+{
+  return calloc(1, sizeof(struct engine_state));
+}
 
 static void run_script(uint8_t script_index, uint16_t src_offset);
 static void sub_11A0(int set_11C4);
-static uint8_t sub_1CF8();
-static uint8_t bit_extract(int n);
 static void sub_3150(unsigned char byte);
 static void sub_316C();
 static void append_string(unsigned char byte);
 static void sub_280E();
-static void sub_1C79(unsigned char *src_ptr, uint16_t offset);
+static void sub_1C79(const unsigned char *src_ptr, size_t len,
+    uint16_t offset, struct text_cache *cache);
+static struct text_cache *resource_text(int index, const unsigned char *src);
 static void sub_1BF8(uint8_t color, uint8_t y_adjust);
-static void sub_27E3(unsigned char *base_ptr, uint16_t offset);
+static void sub_27E3(unsigned char *base_ptr, size_t len, uint16_t offset,
+    struct text_cache *cache);
 static void sub_2CF5();
 static void sub_3165();
 static void sub_4A7D();
@@ -503,265 +399,294 @@ struct op_call_table {
   const char *src_offset;
 };
 
+/* All 256 op codes in order. X(op, handler, addr) is an implemented op code,
+ * N(op, addr) is a slot we have not decoded yet. The address is where the
+ * handler lives inside DRAGON.COM. */
+#define OP_TABLE(X, N) \
+  X(0x00, set_word_mode, "0x3B18")            \
+  X(0x01, set_byte_mode, "0x3B0E")            \
+  N(0x02, "0x3B1F")                           \
+  X(0x03, op_03, "0x3B2F")                    \
+  X(0x04, op_04, "0x3B2A")                    \
+  X(0x05, op_05, "0x3B3D")                    \
+  X(0x06, op_06, "0x3B4A")                    \
+  X(0x07, op_07, "0x3B52")                    \
+  X(0x08, op_08, "0x3B59")                    \
+  X(0x09, set_word3AE2_arg, "0x3B67")         \
+  X(0x0A, load_word3AE2_gamestate, "0x3B7A")  \
+  X(0x0B, op_0B, "0x3B8C")                    \
+  X(0x0C, op_0C, "0x3BA2")                    \
+  X(0x0D, op_0D, "0x3BB7")                    \
+  N(0x0E, "0x3BD0")                           \
+  X(0x0F, op_0F, "0x3BED")                    \
+  X(0x10, op_10, "0x3C10")                    \
+  X(0x11, op_11, "0x3C2D")                    \
+  X(0x12, op_12, "0x3C59")                    \
+  X(0x13, op_13, "0x3C72")                    \
+  X(0x14, op_14, "0x3C8F")                    \
+  X(0x15, op_15, "0x3CAB")                    \
+  X(0x16, op_16, "0x3CCB")                    \
+  X(0x17, store_data_into_resource, "0x3CEF") \
+  X(0x18, op_18, "0x3D19")                    \
+  X(0x19, op_19, "0x3D3D")                    \
+  X(0x1A, op_1A, "0x3D5A")                    \
+  N(0x1B, "0x3D73")                           \
+  X(0x1C, op_1C, "0x3D92")                    \
+  X(0x1D, op_1D, "0x4ACC")                    \
+  N(0x1E, "0x01B2")                           \
+  N(0x1F, "0x4AF6")                           \
+  N(0x20, "0x0000")                           \
+  X(0x21, op_21, "0x3DAE")                    \
+  X(0x22, op_22, "0x3DB7")                    \
+  X(0x23, op_23, "0x3DC0")                    \
+  X(0x24, op_24, "0x3DD7")                    \
+  X(0x25, op_25, "0x3DE5")                    \
+  X(0x26, op_26, "0x3DEC")                    \
+  X(0x27, op_27, "0x3E06")                    \
+  X(0x28, op_28, "0x3E14")                    \
+  N(0x29, "0x3E1B")                           \
+  X(0x2A, op_2A, "0x3E36")                    \
+  X(0x2B, op_2B, "0x3E45")                    \
+  N(0x2C, "0x3E4C")                           \
+  X(0x2D, op_2D, "0x3E67")                    \
+  N(0x2E, "0x3E6E")                           \
+  X(0x2F, op_2F, "0x3E75")                    \
+  X(0x30, op_30, "0x3E9D")                    \
+  X(0x31, op_31, "0x3EC1")                    \
+  X(0x32, op_32, "0x3EEB")                    \
+  N(0x33, "0x3F11")                           \
+  X(0x34, op_34, "0x3F4D")                    \
+  N(0x35, "0x3F66")                           \
+  N(0x36, "0x3F8C")                           \
+  N(0x37, "0x3FAD")                           \
+  X(0x38, op_38, "0x3FBC")                    \
+  X(0x39, op_39, "0x3FD4")                    \
+  N(0x3A, "0x3FEA")                           \
+  N(0x3B, "0x4002")                           \
+  N(0x3C, "0x4018")                           \
+  X(0x3D, op_3D, "0x4030")                    \
+  X(0x3E, op_3E, "0x4051")                    \
+  X(0x3F, op_3F, "0x4067")                    \
+  X(0x40, op_40, "0x4074")                    \
+  X(0x41, op_41, "0x407C")                    \
+  X(0x42, op_42, "0x4085")                    \
+  N(0x43, "0x408E")                           \
+  X(0x44, op_jnz, "0x4099")                   \
+  X(0x45, op_jz, "0x40A3")                    \
+  X(0x46, op_js, "0x40AF")                    \
+  X(0x47, op_47, "0x40B8")                    \
+  X(0x48, op_48, "0x40ED")                    \
+  X(0x49, loop, "0x4106")                     \
+  X(0x4A, op_4A, "0x4113")                    \
+  X(0x4B, op_4B, "0x4122")                    \
+  X(0x4C, op_4C, "0x412A")                    \
+  X(0x4D, op_4D, "0x4132")                    \
+  N(0x4E, "0x414B")                           \
+  X(0x4F, op_4F, "0x4155")                    \
+  N(0x50, "0x4161")                           \
+  X(0x51, op_51, "0x418B")                    \
+  X(0x52, op_52, "0x41B9")                    \
+  X(0x53, op_53, "0x41C0")                    \
+  X(0x54, op_54, "0x41E1")                    \
+  X(0x55, op_55, "0x41E5")                    \
+  X(0x56, op_56, "0x41FD")                    \
+  X(0x57, op_57, "0x4215")                    \
+  X(0x58, op_58, "0x4239")                    \
+  X(0x59, op_59, "0x41C8")                    \
+  X(0x5A, op_5A, "0x3AEE")                    \
+  N(0x5B, "0x427A")                           \
+  X(0x5C, op_5C, "0x4295")                    \
+  X(0x5D, get_character_data, "0x42D8")       \
+  X(0x5E, set_character_data, "0x4322")       \
+  N(0x5F, "0x4372")                           \
+  N(0x60, "0x438B")                           \
+  X(0x61, op_61, "0x43A6")                    \
+  N(0x62, "0x43BF")                           \
+  X(0x63, op_63, "0x43F7")                    \
+  N(0x64, "0x446E")                           \
+  N(0x65, "0x44B8")                           \
+  X(0x66, op_66, "0x40C1")                    \
+  N(0x67, "0x44CB")                           \
+  N(0x68, "0x450A")                           \
+  X(0x69, op_69, "0x453F")                    \
+  X(0x6A, op_6A, "0x4573")                    \
+  N(0x6B, "0x45A1")                           \
+  X(0x6C, op_6C, "0x45A8")                    \
+  N(0x6D, "0x45F0")                           \
+  N(0x6E, "0x45FA")                           \
+  X(0x6F, op_6F, "0x4607")                    \
+  N(0x70, "0x4632")                           \
+  X(0x71, op_71, "0x465B")                    \
+  N(0x72, "0x46B6")                           \
+  X(0x73, op_73, "0x47B7")                    \
+  X(0x74, op_74, "0x47C0")                    \
+  X(0x75, op_75, "0x47D1")                    \
+  X(0x76, op_76, "0x47D9")                    \
+  X(0x77, op_77, "0x47E3")                    \
+  X(0x78, op_78, "0x47EC")                    \
+  N(0x79, "0x47FA")                           \
+  X(0x7A, op_7A, "0x4801")                    \
+  X(0x7B, read_header_bytes, "0x482D")        \
+  X(0x7C, op_7C, "0x4817")                    \
+  X(0x7D, op_7D, "0x483B")                    \
+  N(0x7E, "0x4845")                           \
+  N(0x7F, "0x486D")                           \
+  X(0x80, op_80, "0x487F")                    \
+  X(0x81, op_81, "0x48C5")                    \
+  X(0x82, op_82, "0x48D2")                    \
+  X(0x83, op_83, "0x48EE")                    \
+  X(0x84, op_84, "0x4907")                    \
+  X(0x85, op_85, "0x4920")                    \
+  X(0x86, load_word3AE2_resource, "0x493E")   \
+  N(0x87, "0x4955")                           \
+  X(0x88, op_88, "0x496D")                    \
+  X(0x89, op_89, "0x4977")                    \
+  X(0x8A, op_8A, "0x498E")                    \
+  X(0x8B, op_8B, "0x499B")                    \
+  X(0x8C, op_8C, "0x49A5")                    \
+  X(0x8D, op_8D, "0x49D3")                    \
+  N(0x8E, "0x0000")                           \
+  N(0x8F, "0x49DD")                           \
+  X(0x90, op_90, "0x49E7")                    \
+  X(0x91, op_91, "0x49F3")                    \
+  N(0x92, "0x49FD")                           \
+  X(0x93, op_93, "0x4A67")                    \
+  X(0x94, op_94, "0x4A6D")                    \
+  X(0x95, op_95, "0x4894")                    \
+  X(0x96, op_96, "0x48B5")                    \
+  X(0x97, op_97, "0x42FB")                    \
+  X(0x98, op_98, "0x4348")                    \
+  X(0x99, op_99, "0x40E7")                    \
+  X(0x9A, op_9A, "0x3C42")                    \
+  X(0x9B, op_9B, "0x416B")                    \
+  N(0x9C, "0x4175")                           \
+  X(0x9D, op_9D, "0x4181")                    \
+  N(0x9E, "0x492D")                           \
+  N(0x9F, "0x4AF0")                           \
+  N(0xA0, "0x8A06")                           \
+  N(0xA1, "0xE80E")                           \
+  N(0xA2, "0x513A")                           \
+  N(0xA3, "0x36FF")                           \
+  N(0xA4, "0x3ADB")                           \
+  N(0xA5, "0x36FF")                           \
+  N(0xA6, "0x3AEC")                           \
+  N(0xA7, "0x2689")                           \
+  N(0xA8, "0x3AEC")                           \
+  N(0xA9, "0xE8A2")                           \
+  N(0xAA, "0xA23A")                           \
+  N(0xAB, "0x3AEA")                           \
+  N(0xAC, "0xE853")                           \
+  N(0xAD, "0x0FE5")                           \
+  N(0xAE, "0x325E")                           \
+  N(0xAF, "0xA2C0")                           \
+  N(0xB0, "0x3AE1")                           \
+  N(0xB1, "0xE3A2")                           \
+  N(0xB2, "0xEB3A")                           \
+  N(0xB3, "0x8B04")                           \
+  N(0xB4, "0xDB36")                           \
+  N(0xB5, "0x8E3A")                           \
+  N(0xB6, "0xDD06")                           \
+  N(0xB7, "0x263A")                           \
+  N(0xB8, "0x32AC")                           \
+  N(0xB9, "0x8BE4")                           \
+  N(0xBA, "0xD1D8")                           \
+  N(0xBB, "0xFFE3")                           \
+  N(0xBC, "0x60A7")                           \
+  N(0xBD, "0x0039")                           \
+  N(0xBE, "0x0000")                           \
+  N(0xBF, "0x0000")                           \
+  N(0xC0, "0x0000")                           \
+  N(0xC1, "0x0000")                           \
+  N(0xC2, "0x0000")                           \
+  N(0xC3, "0x0000")                           \
+  N(0xC4, "0x0000")                           \
+  N(0xC5, "0x0000")                           \
+  N(0xC6, "0x0000")                           \
+  N(0xC7, "0x268B")                           \
+  N(0xC8, "0x3AEC")                           \
+  N(0xC9, "0x068F")                           \
+  N(0xCA, "0x3AEC")                           \
+  N(0xCB, "0x068F")                           \
+  N(0xCC, "0x3ADB")                           \
+  N(0xCD, "0xA258")                           \
+  N(0xCE, "0x3AE8")                           \
+  N(0xCF, "0xEAA2")                           \
+  N(0xD0, "0xE83A")                           \
+  N(0xD1, "0x0F9D")                           \
+  N(0xD2, "0xC032")                           \
+  N(0xD3, "0xE1A2")                           \
+  N(0xD4, "0xA23A")                           \
+  N(0xD5, "0x3AE3")                           \
+  N(0xD6, "0xC307")                           \
+  N(0xD7, "0x2688")                           \
+  N(0xD8, "0x3AE3")                           \
+  N(0xD9, "0x2688")                           \
+  N(0xDA, "0x3AE1")                           \
+  N(0xDB, "0xB7EB")                           \
+  N(0xDC, "0x06C6")                           \
+  N(0xDD, "0x3AE1")                           \
+  N(0xDE, "0xEBFF")                           \
+  N(0xDF, "0xA0B0")                           \
+  N(0xE0, "0x3AEA")                           \
+  N(0xE1, "0x8B4C")                           \
+  N(0xE2, "0x88EC")                           \
+  N(0xE3, "0x0046")                           \
+  N(0xE4, "0xA5EB")                           \
+  N(0xE5, "0xE8A0")                           \
+  N(0xE6, "0xEB3A")                           \
+  N(0xE7, "0x8BF3")                           \
+  N(0xE8, "0x8AEC")                           \
+  N(0xE9, "0x0046")                           \
+  N(0xEA, "0xA244")                           \
+  N(0xEB, "0x3AEA")                           \
+  N(0xEC, "0x66E8")                           \
+  N(0xED, "0xEB0F")                           \
+  N(0xEE, "0x2692")                           \
+  N(0xEF, "0x8BAC")                           \
+  N(0xF0, "0x8AD8")                           \
+  N(0xF1, "0x6087")                           \
+  N(0xF2, "0xA238")                           \
+  N(0xF3, "0x3AE4")                           \
+  N(0xF4, "0x85EB")                           \
+  N(0xF5, "0xAC26")                           \
+  N(0xF6, "0xE4A2")                           \
+  N(0xF7, "0xE93A")                           \
+  N(0xF8, "0xFF7D")                           \
+  N(0xF9, "0x2688")                           \
+  N(0xFA, "0x3AE4")                           \
+  N(0xFB, "0x76E9")                           \
+  N(0xFC, "0x26FF")                           \
+  N(0xFD, "0x8BAC")                           \
+  N(0xFE, "0xA0D8")                           \
+  N(0xFF, "0x3AE4")
+
+#define OP_CALL_ENTRY(op, func, addr) { func, addr },
+#define OP_CALL_EMPTY(op, addr) { NULL, addr },
+
 struct op_call_table targets[] = {
-  { set_word_mode, "0x3B18" },
-  { set_byte_mode, "0x3B0E" },
-  { NULL, "0x3B1F" },
-  { op_03, "0x3B2F" },
-  { op_04, "0x3B2A" },
-  { op_05, "0x3B3D" },
-  { op_06, "0x3B4A" },
-  { op_07, "0x3B52" },
-  { op_08, "0x3B59" },
-  { set_word3AE2_arg, "0x3B67" },
-  { load_word3AE2_gamestate, "0x3B7A" },
-  { op_0B, "0x3B8C" },
-  { op_0C, "0x3BA2" },
-  { op_0D, "0x3BB7" },
-  { NULL, "0x3BD0" },
-  { op_0F, "0x3BED" },
-  { op_10, "0x3C10" },
-  { op_11, "0x3C2D" },
-  { op_12, "0x3C59" },
-  { op_13, "0x3C72" },
-  { op_14, "0x3C8F" },
-  { op_15, "0x3CAB" },
-  { op_16, "0x3CCB" },
-  { store_data_into_resource, "0x3CEF" },
-  { op_18, "0x3D19" },
-  { op_19, "0x3D3D" },
-  { op_1A, "0x3D5A" },
-  { NULL, "0x3D73" },
-  { op_1C, "0x3D92" },
-  { op_1D, "0x4ACC" },
-  { NULL, "0x01B2" },
-  { NULL, "0x4AF6" },
-  { NULL, "0x0000" },
-  { op_21, "0x3DAE" },
-  { op_22, "0x3DB7" },
-  { op_23, "0x3DC0" },
-  { op_24, "0x3DD7" },
-  { op_25, "0x3DE5" },
-  { op_26, "0x3DEC" },
-  { op_27, "0x3E06" },
-  { op_28, "0x3E14" },
-  { NULL, "0x3E1B" },
-  { op_2A, "0x3E36" },
-  { op_2B, "0x3E45" },
-  { NULL, "0x3E4C" },
-  { op_2D, "0x3E67" },
-  { NULL, "0x3E6E" },
-  { op_2F, "0x3E75" },
-  { op_30, "0x3E9D" },
-  { op_31, "0x3EC1" },
-  { op_32, "0x3EEB" },
-  { NULL, "0x3F11" },
-  { op_34, "0x3F4D" },
-  { NULL, "0x3F66" },
-  { NULL, "0x3F8C" },
-  { NULL, "0x3FAD" },
-  { op_38, "0x3FBC" },
-  { op_39, "0x3FD4" },
-  { NULL, "0x3FEA" },
-  { NULL, "0x4002" },
-  { NULL, "0x4018" },
-  { op_3D, "0x4030" },
-  { op_3E, "0x4051" },
-  { op_3F, "0x4067" },
-  { op_40, "0x4074" },
-  { op_41, "0x407C" },
-  { op_42, "0x4085" },
-  { NULL, "0x408E" },
-  { op_jnz, "0x4099" },
-  { op_jz, "0x40A3" },
-  { op_js, "0x40AF" },
-  { op_47, "0x40B8" },
-  { op_48, "0x40ED" },
-  { loop, "0x4106" },
-  { op_4A, "0x4113" },
-  { op_4B, "0x4122" },
-  { op_4C, "0x412A" },
-  { op_4D, "0x4132" },
-  { NULL, "0x414B" },
-  { op_4F, "0x4155" },
-  { NULL, "0x4161" },
-  { op_51, "0x418B" },
-  { op_52, "0x41B9" },
-  { op_53, "0x41C0" },
-  { op_54, "0x41E1" },
-  { op_55, "0x41E5" },
-  { op_56, "0x41FD" },
-  { op_57, "0x4215" },
-  { op_58, "0x4239" },
-  { op_59, "0x41C8" },
-  { op_5A, "0x3AEE" },
-  { NULL, "0x427A" },
-  { op_5C, "0x4295" },
-  { get_character_data, "0x42D8" },
-  { set_character_data, "0x4322" },
-  { NULL, "0x4372" },
-  { NULL, "0x438B" },
-  { op_61, "0x43A6" },
-  { NULL, "0x43BF" },
-  { op_63, "0x43F7" },
-  { NULL, "0x446E" },
-  { NULL, "0x44B8" },
-  { op_66, "0x40C1" },
-  { NULL, "0x44CB" },
-  { NULL, "0x450A" },
-  { op_69, "0x453F" },
-  { op_6A, "0x4573" },
-  { NULL, "0x45A1" },
-  { op_6C, "0x45A8" },
-  { NULL, "0x45F0" },
-  { NULL, "0x45FA" },
-  { op_6F, "0x4607" },
-  { NULL, "0x4632" },
-  { op_71, "0x465B" },
-  { NULL, "0x46B6" },
-  { op_73, "0x47B7" },
-  { op_74, "0x47C0" },
-  { op_75, "0x47D1" },
-  { op_76, "0x47D9" },
-  { op_77, "0x47E3" },
-  { op_78, "0x47EC" },
-  { NULL, "0x47FA" },
-  { op_7A, "0x4801" },
-  { read_header_bytes, "0x482D" },
-  { op_7C, "0x4817" },
-  { op_7D, "0x483B" },
-  { NULL, "0x4845" },
-  { NULL, "0x486D" },
-  { op_80, "0x487F" },
-  { op_81, "0x48C5" },
-  { op_82, "0x48D2" },
-  { op_83, "0x48EE" },
-  { op_84, "0x4907" },
-  { op_85, "0x4920" },
-  { load_word3AE2_resource, "0x493E" },
-  { NULL, "0x4955" },
-  { op_88, "0x496D" },
-  { op_89, "0x4977" },
-  { op_8A, "0x498E" },
-  { op_8B, "0x499B" },
-  { op_8C, "0x49A5" },
-  { op_8D, "0x49D3" },
-  { NULL, "0x0000" },
-  { NULL, "0x49DD" },
-  { op_90, "0x49E7" },
-  { op_91, "0x49F3" },
-  { NULL, "0x49FD" },
-  { op_93, "0x4A67" },
-  { op_94, "0x4A6D" },
-  { op_95, "0x4894" },
-  { op_96, "0x48B5" },
-  { op_97, "0x42FB" },
-  { op_98, "0x4348" },
-  { op_99, "0x40E7" },
-  { op_9A, "0x3C42" },
-  { op_9B, "0x416B" },
-  { NULL, "0x4175" },
-  { op_9D, "0x4181" },
-  { NULL, "0x492D" },
-  { NULL, "0x4AF0" },
-  { NULL, "0x8A06" },
-  { NULL, "0xE80E" },
-  { NULL, "0x513A" },
-  { NULL, "0x36FF" },
-  { NULL, "0x3ADB" },
-  { NULL, "0x36FF" },
-  { NULL, "0x3AEC" },
-  { NULL, "0x2689" },
-  { NULL, "0x3AEC" },
-  { NULL, "0xE8A2" },
-  { NULL, "0xA23A" },
-  { NULL, "0x3AEA" },
-  { NULL, "0xE853" },
-  { NULL, "0x0FE5" },
-  { NULL, "0x325E" },
-  { NULL, "0xA2C0" },
-  { NULL, "0x3AE1" },
-  { NULL, "0xE3A2" },
-  { NULL, "0xEB3A" },
-  { NULL, "0x8B04" },
-  { NULL, "0xDB36" },
-  { NULL, "0x8E3A" },
-  { NULL, "0xDD06" },
-  { NULL, "0x263A" },
-  { NULL, "0x32AC" },
-  { NULL, "0x8BE4" },
-  { NULL, "0xD1D8" },
-  { NULL, "0xFFE3" },
-  { NULL, "0x60A7" },
-  { NULL, "0x0039" },
-  { NULL, "0x0000" },
-  { NULL, "0x0000" },
-  { NULL, "0x0000" },
-  { NULL, "0x0000" },
-  { NULL, "0x0000" },
-  { NULL, "0x0000" },
-  { NULL, "0x0000" },
-  { NULL, "0x0000" },
-  { NULL, "0x0000" },
-  { NULL, "0x268B" },
-  { NULL, "0x3AEC" },
-  { NULL, "0x068F" },
-  { NULL, "0x3AEC" },
-  { NULL, "0x068F" },
-  { NULL, "0x3ADB" },
-  { NULL, "0xA258" },
-  { NULL, "0x3AE8" },
-  { NULL, "0xEAA2" },
-  { NULL, "0xE83A" },
-  { NULL, "0x0F9D" },
-  { NULL, "0xC032" },
-  { NULL, "0xE1A2" },
-  { NULL, "0xA23A" },
-  { NULL, "0x3AE3" },
-  { NULL, "0xC307" },
-  { NULL, "0x2688" },
-  { NULL, "0x3AE3" },
-  { NULL, "0x2688" },
-  { NULL, "0x3AE1" },
-  { NULL, "0xB7EB" },
-  { NULL, "0x06C6" },
-  { NULL, "0x3AE1" },
-  { NULL, "0xEBFF" },
-  { NULL, "0xA0B0" },
-  { NULL, "0x3AEA" },
-  { NULL, "0x8B4C" },
-  { NULL, "0x88EC" },
-  { NULL, "0x0046" },
-  { NULL, "0xA5EB" },
-  { NULL, "0xE8A0" },
-  { NULL, "0xEB3A" },
-  { NULL, "0x8BF3" },
-  { NULL, "0x8AEC" },
-  { NULL, "0x0046" },
-  { NULL, "0xA244" },
-  { NULL, "0x3AEA" },
-  { NULL, "0x66E8" },
-  { NULL, "0xEB0F" },
-  { NULL, "0x2692" },
-  { NULL, "0x8BAC" },
-  { NULL, "0x8AD8" },
-  { NULL, "0x6087" },
-  { NULL, "0xA238" },
-  { NULL, "0x3AE4" },
-  { NULL, "0x85EB" },
-  { NULL, "0xAC26" },
-  { NULL, "0xE4A2" },
-  { NULL, "0xE93A" },
-  { NULL, "0xFF7D" },
-  { NULL, "0x2688" },
-  { NULL, "0x3AE4" },
-  { NULL, "0x76E9" },
-  { NULL, "0x26FF" },
-  { NULL, "0x8BAC" },
-  { NULL, "0xA0D8" },
-  { NULL, "0x3AE4" }
+  OP_TABLE(OP_CALL_ENTRY, OP_CALL_EMPTY)
 };
 
+#if defined(VM_PROFILE)
+#define OP_NAME_ENTRY(op, func, addr) [op] = #func,
+#define OP_NAME_EMPTY(op, addr)
+#define OP_ADDR_ENTRY(op, func, addr) [op] = addr,
+#define OP_ADDR_EMPTY(op, addr) [op] = addr,
+
+static const char *const op_names[256] = {
+  OP_TABLE(OP_NAME_ENTRY, OP_NAME_EMPTY)
+};
+
+static const char *const op_addrs[256] = {
+  OP_TABLE(OP_ADDR_ENTRY, OP_ADDR_EMPTY)
+};
+
+#define PROFILE_OP(op) \
+  profile_op((op), running_script->tag, cpu.pc - cpu.base_pc)
+#else
+#define PROFILE_OP(op)
+#endif
+
 
 static void push_byte(uint8_t val)
 {
@@ -806,14 +731,14 @@ static uint16_t peek_word()
 // 0x3B18
 static void set_word_mode()
 {
-  printf("%s - setting 3AE1 to 0xFF\n", __func__);
+  TRACE(SET_WORD_MODE);
   byte_3AE1 = 0xFF;
 }
 
 // 0x3B0E
 static void set_byte_mode()
 {
-  printf("%s - setting 3AE1 to 0\n", __func__);
+  TRACE(SET_BYTE_MODE);
   word_3AE2 &= 0xFF;
   byte_3AE1 = 0;
 }
@@ -858,13 +783,17 @@ static void op_05(void)
 // 0x3B4A
 // op_06 (1 byte operand)
 // loads loop counter.
-static void op_06()
+static void op_06_arg(uint8_t al)
 {
-  uint8_t al = *cpu.pc++;
   cpu.ax = (cpu.ax & 0xFF00) | al;
   word_3AE4 = al;
 }
 
+static void op_06()
+{
+  op_06_arg(*cpu.pc++);
+}
+
 // 0x3B52
 static void op_07()
 {
@@ -882,37 +811,47 @@ static void op_08(void)
   set_game_state(__func__, cpu.bx, al);
 }
 
+// Loads word_3AE2 with an operand that has already been read (width
+// follows byte_3AE1).
+static void set_word3AE2_val(uint16_t val)
+{
+  uint8_t al = val & 0xFF;
+  if (byte_3AE1 != (cpu.ax >> 8)) {
+    // set high byte
+    al = (val & 0xFF00) >> 8;
+  }
+  cpu.ax = (cpu.ax & 0xFF00) | al;
+  word_3AE2 = val;
+}
+
 // 0x3B67
 // op_09
 static void set_word3AE2_arg(void)
 {
-  uint8_t al = *cpu.pc++;
-  cpu.ax = (cpu.ax & 0xFF00) | al;
-  word_3AE2 = al;
-  if (byte_3AE1 != (cpu.ax >> 8))
-  {
-    // set high byte
-    al = *cpu.pc++;
-    cpu.ax = (cpu.ax & 0xFF00) | al;
-    word_3AE2 = (al << 8) | (word_3AE2 & 0xFF); // XXX ? Correct.
+  uint16_t val = *cpu.pc++;
+  if (byte_3AE1 != (cpu.ax >> 8)) {
+    val += *cpu.pc++ << 8;
   }
+  set_word3AE2_val(val);
 }
 
 // 0x3B7A
 // op_0A
-static void load_word3AE2_gamestate(void)
+static void load_word3AE2_gamestate_arg(uint8_t gs_idx)
 {
   uint8_t al, ah;
-  uint8_t gs_idx;
-
-  gs_idx = *cpu.pc++;
 
   // mov ax, [bx + game_state]
   al = game_state.unknown[gs_idx];
   ah = game_state.unknown[gs_idx + 1];
   ah = ah & byte_3AE1; // mask if in byte mode.
   word_3AE2 = (ah << 8) | al;
-  printf("%s - 0x%02X -> word_3AE2: 0x%04X\n", __func__, gs_idx, word_3AE2);
+  TRACE(LOAD_GAMESTATE, gs_idx, word_3AE2);
+}
+
+static void load_word3AE2_gamestate(void)
+{
+  load_word3AE2_gamestate_arg(*cpu.pc++);
 }
 
 // 0x3B8C
@@ -977,14 +916,14 @@ static void op_0D()
 }
 
 // 0x3BED
-static void op_0F(void)
+static void op_0F_arg(uint8_t al)
 {
-  uint8_t ah, al;
-  al = *cpu.pc++;
+  uint8_t ah;
+
   cpu.ax = (cpu.ax & 0xFF00) | al;
   cpu.bx = cpu.ax;
   // load di properly...
-  printf("OP_0F: BX: 0x%04X\n", cpu.bx);
+  TRACE(OP_0F, cpu.bx);
   cpu.di = game_state.unknown[cpu.bx];
   cpu.di += (game_state.unknown[cpu.bx + 1] << 8);
   uint8_t bl = game_state.unknown[cpu.bx + 2];
@@ -1005,6 +944,11 @@ static void op_0F(void)
   word_3AE2 = (ah << 8) | al;
 }
 
+static void op_0F(void)
+{
+  op_0F_arg(*cpu.pc++);
+}
+
 // 0x3C10
 static void op_10(void)
 {
@@ -1034,7 +978,7 @@ static void op_11(void)
   cpu.ax = (cpu.ax & 0xFF00) | al;
   cpu.bx = cpu.ax;
   uint8_t ah = (cpu.ax & 0xFF00) >> 8;
-  printf("op_11: 0x%04X ah: 0x%02X\n", cpu.bx, ah);
+  TRACE(OP_11, cpu.bx, ah);
   set_game_state(__func__, cpu.bx, ah);
   if (byte_3AE1 != ah) {
     set_game_state(__func__, cpu.bx + 1, ah);
@@ -1063,7 +1007,7 @@ static void op_13(void)
   cpu.bx = cpu.ax;
   cpu.cx = word_3AE2;
   cpu.bx += word_3AE4;
-  printf("op_13: 0x%04X\n", cpu.bx);
+  TRACE(OP_13, cpu.bx);
   set_game_state(__func__, cpu.bx, (cpu.cx & 0x00FF));
   if (byte_3AE1 != ((cpu.ax & 0xFF00) >> 8)) {
     set_game_state(__func__, cpu.bx + 1, (cpu.cx & 0xFF00) >> 8);
@@ -1088,6 +1032,7 @@ static void op_14(void)
   if (byte_3AE1 != save_ah) {
     dest[cpu.bx + 1] = (dest_offset & 0xFF00) >> 8;
   }
+  resource_note_write(word_3ADF->index, cpu.bx, 2);
 }
 
 // 0x3CAB
@@ -1107,6 +1052,7 @@ static void op_15()
   if (byte_3AE1 != save_ah) {
     dest[cpu.bx + cpu.di + 1] = (cpu.cx & 0xFF00) >> 8;
   }
+  resource_note_write(word_3ADF->index, cpu.bx + cpu.di, 2);
 }
 
 // 0x3CCB
@@ -1129,17 +1075,16 @@ static void op_16()
   if (byte_3AE1 != ((cpu.ax & 0xFF00) >> 8)) {
     es[cpu.bx + 1] = (cpu.cx & 0xFF00) >> 8;
   }
+  resource_note_write(word_3ADF->index, cpu.bx, 2);
 }
 
 // 0x3CEF (op_17)
 // Stores data into resource bytes.
-static void store_data_into_resource(void)
+static void store_data_into_resource_arg(uint8_t offset_idx)
 {
-  uint8_t offset_idx, resource_idx;
+  uint8_t resource_idx;
   const struct resource *r;
 
-  offset_idx = *cpu.pc++;
-
   // Base offset to write to.
   cpu.di = game_state.unknown[offset_idx];
   cpu.di += (game_state.unknown[offset_idx + 1] << 8);
@@ -1147,18 +1092,24 @@ static void store_data_into_resource(void)
   // Resource to write to (by index)
   resource_idx = game_state.unknown[offset_idx + 2];
 
-  printf("%s  index: 0x%02X base offset: 0x%04X\n",__func__,  resource_idx, cpu.di);
+  TRACE(STORE_RESOURCE, resource_idx, cpu.di);
   r = resource_get_by_index(resource_idx);
   cpu.di += word_3AE4;
   cpu.cx = word_3AE2;
 
-  printf("  %s: setting byte 0x%04X\n", __func__, cpu.di);
+  TRACE(STORE_BYTE, cpu.di);
   r->bytes[cpu.di] = (cpu.cx & 0x00FF);
 
   // Word mode?
   if (byte_3AE1 != ((cpu.ax & 0xFF00) >> 8)) {
     r->bytes[cpu.di + 1] = ((cpu.cx & 0xFF00) >> 8);
   }
+  resource_note_write(r->index, cpu.di, 2);
+}
+
+static void store_data_into_resource(void)
+{
+  store_data_into_resource_arg(*cpu.pc++);
 }
 
 // 0x3D19
@@ -1183,6 +1134,7 @@ static void op_18(void)
   if (byte_3AE1 != ((cpu.ax & 0xFF00) >> 8)) {
     es[cpu.di + 1] = (cpu.cx & 0xFF00) >> 8;
   }
+  resource_note_write(word_3ADF->index, cpu.di, 2);
 }
 
 // 0x3D3D
@@ -1237,6 +1189,7 @@ static void op_1C()
     cpu.ax = (cpu.ax & 0xFF00) | al;
     ds[cpu.di + 1] = al;
   }
+  resource_note_write(word_3ADF->index, cpu.di, 2);
 }
 
 // 0x4ACC
@@ -1258,6 +1211,9 @@ static void op_1D(void)
   }
   // repe movsw (move word ds:si to es:di (si, di += 2), repeat 0x380 times.
   memcpy(dest + dest_offset, src + src_offset, 0x700);
+  if (dest != data_D760) {
+    resource_note_write(word_3ADF->index, dest_offset, 0x700);
+  }
 }
 
 // 0x3DAE
@@ -1739,7 +1695,7 @@ static void op_41(void)
     uint16_t new_address = *cpu.pc++;
     new_address += *cpu.pc++ << 8;
     cpu.ax = new_address;
-    printf("(op41)    New address: 0x%04x\n", new_address);
+    TRACE(JUMP, 0x41, new_address);
     cpu.pc = cpu.base_pc + new_address;
   } else {
     cpu.pc++;
@@ -1759,45 +1715,49 @@ static void op_42(void)
     uint16_t new_address = *cpu.pc++;
     new_address += *cpu.pc++ << 8;
     cpu.ax = new_address;
-    printf("(op42)    New address: 0x%04x\n", new_address);
+    TRACE(JUMP, 0x42, new_address);
     cpu.pc = cpu.base_pc + new_address;
   }
 }
 
 // 0x4099
 // op_44
-// Jump on non-zero flag.
-static void op_jnz(void)
+// Jump on non-zero flag, cpu.pc already points past the address.
+static void op_jnz_arg(uint16_t new_address)
 {
-  if ((word_3AE6 & ZERO_FLAG_MASK) == 0) {
-    cpu.pc++;
-    cpu.pc++;
+  if ((word_3AE6 & ZERO_FLAG_MASK) == 0)
     return;
-  }
-  uint16_t new_address = *cpu.pc++;
-  new_address += *cpu.pc++ << 8;
   cpu.ax = new_address;
-  printf("(%s)    New address: 0x%04x\n", __func__, new_address);
+  TRACE(JUMP, 0x44, new_address);
   cpu.pc = running_script->bytes + new_address;
 }
 
+static void op_jnz(void)
+{
+  uint16_t new_address = *cpu.pc++;
+  new_address += *cpu.pc++ << 8;
+  op_jnz_arg(new_address);
+}
+
 // 0x40A3
 // op_45
-// Jump on zero flag.
-static void op_jz(void)
+// Jump on zero flag, cpu.pc already points past the address.
+static void op_jz_arg(uint16_t new_address)
 {
-  if ((word_3AE6 & ZERO_FLAG_MASK) != 0) {
-    cpu.pc++;
-    cpu.pc++;
+  if ((word_3AE6 & ZERO_FLAG_MASK) != 0)
     return;
-  }
-  uint16_t new_address = *cpu.pc++;
-  new_address += *cpu.pc++ << 8;
   cpu.ax = new_address;
-  printf("(%s)    New address: 0x%04x\n", __func__, new_address);
+  TRACE(JUMP, 0x45, new_address);
   cpu.pc = running_script->bytes + new_address;
 }
 
+static void op_jz(void)
+{
+  uint16_t new_address = *cpu.pc++;
+  new_address += *cpu.pc++ << 8;
+  op_jz_arg(new_address);
+}
+
 // 0x40AF
 // Jump if signed (similar to js)
 static void op_js()
@@ -1843,7 +1803,7 @@ static void op_48()
 
 // 0x4106
 // op_49
-static void loop(void)
+static void loop_arg(uint16_t new_address)
 {
   // This is actually more of a LOOP function.
   // The counter is stored in word_3AE4, although it's only an 8 bit
@@ -1854,18 +1814,20 @@ static void loop(void)
   byte_3AE4--;
   word_3AE4 = (word_3AE4 & 0xFF00) | byte_3AE4;
 
+  // 0x40AA falls through with cpu.pc past the address.
   if (byte_3AE4 != 0xFF) {
-    uint16_t new_address = *cpu.pc++;
-    new_address += *cpu.pc++ << 8;
-    printf("LOOP 0x%04X  Counter: 0x%02X\n", new_address, byte_3AE4);
+    TRACE(LOOP, new_address, byte_3AE4);
     cpu.pc = cpu.base_pc + new_address;
-  } else {
-    // 0x40AA
-    cpu.pc++;
-    cpu.pc++;
   }
 }
 
+static void loop(void)
+{
+  uint16_t new_address = *cpu.pc++;
+  new_address += *cpu.pc++ << 8;
+  loop_arg(new_address);
+}
+
 // 0x4113
 static void op_4A(void)
 {
@@ -1884,7 +1846,7 @@ static void op_4A(void)
     uint16_t new_address = *cpu.pc++;
     new_address += *cpu.pc++ << 8;
     cpu.ax = new_address;
-    printf("(op4A)    New address: 0x%04x\n", new_address);
+    TRACE(JUMP, 0x4A, new_address);
     cpu.pc = cpu.base_pc + new_address;
   }
 }
@@ -1959,24 +1921,28 @@ static void op_51()
   printf("DI: 0x%04X\n", cpu.di);
   printf("AL: 0x%02X\n", al);
   printf("%s: 0x418D unimplemented\n", __func__);
-  exit(1);
+  dw_exit(DW_EXIT_ERROR);
 }
 
 // 0x41B9
-static void op_52(void)
+static void op_52_arg(uint16_t new_address)
 {
   // CALL function ?
   // Save source index.
   // Jump to new source index.
-  uint16_t new_address = *cpu.pc++;
-  new_address += *cpu.pc++ << 8;
-  printf("New address: 0x%04x\n", new_address);
   uint16_t existing_address = cpu.pc - cpu.base_pc;
-  printf("Existing address: 0x%04x\n", existing_address);
+  TRACE(CALL, 0x52, new_address, existing_address);
 
   cpu.pc = cpu.base_pc + new_address;
 }
 
+static void op_52(void)
+{
+  uint16_t new_address = *cpu.pc++;
+  new_address += *cpu.pc++ << 8;
+  op_52_arg(new_address);
+}
+
 // 0x41C0
 static void op_53(void)
 {
@@ -1985,9 +1951,8 @@ static void op_53(void)
   // Jump to new source index.
   uint16_t new_address = *cpu.pc++;
   new_address += *cpu.pc++ << 8;
-  printf("New address: 0x%04x\n", new_address);
   uint16_t existing_address = cpu.pc - cpu.base_pc;
-  printf("Existing address: 0x%04x\n", existing_address);
+  TRACE(CALL, 0x53, new_address, existing_address);
 
   push_word(existing_address);
   cpu.pc = cpu.base_pc + new_address;
@@ -1998,7 +1963,7 @@ static void op_54()
 {
   // RET function.
   uint16_t si = pop_word();
-  printf("%s SI: %04X\n", __func__, si);
+  TRACE(RET, si);
   cpu.pc = cpu.base_pc + si;
 }
 
@@ -2092,6 +2057,9 @@ static void op_58(void)
     r = resource_get_by_index(found);
     if (r->usage_type == 2) {
       dl = 0xFF;
+      // Keep it from being evicted while it runs, op_59 marks it purgeable
+      // again.
+      resource_set_usage_type(found, 1);
     } else {
       // 0x4259
       // xor dl, dl
@@ -2218,8 +2186,7 @@ static void get_character_data(void)
   cpu.bx = bh << 8 | (cpu.bx & 0xFF);
 
   uint8_t al = *cpu.pc++; // Character property offset
-  printf("%s - Player number: %d Property: %s (0x%02X)\n", __func__,
-      player_number, player_property_name(al), al);
+  TRACE(CHARACTER_DATA, player_number, al);
   cpu.ax = (cpu.ax & 0xFF00) | al;
   cpu.bx += cpu.ax;
 
@@ -2255,7 +2222,7 @@ static void set_character_data(void)
   // Validation that we aren't writing outside our array.
   if ((cpu.bx - 0xC960) >= 0xE00) {
     printf("Array of data_C960 not large enough!\n");
-    exit(1);
+    dw_exit(DW_EXIT_ERROR);
   }
   // mov [di], al
   unsigned char *c960 = get_player_data_base();
@@ -2359,7 +2326,7 @@ static void op_63()
   if (data_CA4C[cpu.di - 0xCA4C] != 0) {
     // 0x4430
     printf("%s: 0x4430 unimplemented\n", __func__);
-    exit(1);
+    dw_exit(DW_EXIT_ERROR);
   }
   // 0x444C
   word_3AE6 &= 0xFFFE;
@@ -2430,7 +2397,7 @@ static void op_69(void)
   // Validation that we aren't writing outside our array.
   if ((cpu.di - 0xCA4C) >= sizeof(data_CA4C)) {
     printf("Array of data_CA4C not large enough!\n");
-    exit(1);
+    dw_exit(DW_EXIT_ERROR);
   }
   // mov [di], al
   data_CA4C[cpu.di - 0xCA4C] = cpu.ax & 0xFF;
@@ -2510,7 +2477,7 @@ static void op_6C(void)
   if ((game_state.unknown[0x23] & 0x2) != 0) {
     // 0x45B6
     printf("%s: 0x45B6 unimplemented\n", __func__);
-    exit(1);
+    dw_exit(DW_EXIT_ERROR);
   }
   // 0x45CC
   // pop si
@@ -2651,14 +2618,16 @@ static void op_77()
 // 0x47EC
 static void op_78(void)
 {
-  sub_1C79(cpu.base_pc, cpu.pc - cpu.base_pc);
+  sub_1C79(cpu.base_pc, running_script->len, cpu.pc - cpu.base_pc,
+      resource_text(running_script->index, cpu.base_pc));
   cpu.pc = cpu.base_pc + cpu.bx;
 }
 
 // 0x4801
 static void op_7A()
 {
-  sub_1C79(word_3ADF->bytes, word_3AE2);
+  sub_1C79(word_3ADF->bytes, word_3ADF->len, word_3AE2,
+      resource_text(word_3ADF->index, word_3ADF->bytes));
   word_3AE2 = cpu.bx;
 }
 
@@ -2677,7 +2646,7 @@ static void write_character_name()
   cpu.bx = cpu.ax;
 
   unsigned char *player = get_player_data(val >> 1);
-  printf("%s: 0x%04X, Player number: 0x%02X\n", __func__, cpu.bx, val);
+  TRACE(CHARACTER_NAME, cpu.bx, val);
   while (1) {
     al = *player++;
     ah = al;
@@ -2697,15 +2666,16 @@ static void op_7C(void)
   // si
   unsigned char *dest = word_3ADF->bytes;
   uint16_t dest_offset = word_3AE2;
-  printf("%s - 0x%04X\n", __func__, dest_offset);
-  sub_27E3(dest, dest_offset);
+  TRACE(OP_7C, dest_offset);
+  sub_27E3(dest, word_3ADF->len, dest_offset,
+      resource_text(word_3ADF->index, dest));
   word_3AE2 = cpu.bx;
 }
 
 // 0x483B
 static void op_7D(void)
 {
-  printf("op_7D\n");
+  TRACE(OP_7D);
   write_character_name();
 }
 
@@ -2947,11 +2917,11 @@ static void sub_4B60()
     if (cpu.zf == 1) {
       // 0x4B80
       printf("%s: 0x4B80 unimplemented\n", __func__);
-      exit(1);
+      dw_exit(DW_EXIT_ERROR);
     }
     // 0x4B91
     printf("%s: 0x4B91 unimplemented\n", __func__);
-    exit(1);
+    dw_exit(DW_EXIT_ERROR);
   }
   // 0x4BA7
   cpu.bx = 2;
@@ -2959,7 +2929,7 @@ static void sub_4B60()
   if (cpu.cf == 0 && cpu.zf == 0) {
     // 0x4BB1
     printf("%s: 0x4BB1 unimplemented\n", __func__);
-    exit(1);
+    dw_exit(DW_EXIT_ERROR);
   }
   // 0x4BB6
   cpu.bx = 3;
@@ -2968,15 +2938,15 @@ static void sub_4B60()
     if (cpu.zf == 0) {
       // 0x4BC0
       printf("%s: 0x4BC0 unimplemented\n", __func__);
-      exit(1);
+      dw_exit(DW_EXIT_ERROR);
     } else {
       // 0x4BC4
       printf("%s: 0x4BC4 unimplemented\n", __func__);
-      exit(1);
+      dw_exit(DW_EXIT_ERROR);
     }
     // 0x4BDC
     printf("%s: 0x4BDC unimplemented\n", __func__);
-    exit(1);
+    dw_exit(DW_EXIT_ERROR);
   }
   // 0x4BE7
 }
@@ -2998,7 +2968,7 @@ static void sub_4D97(uint16_t index)
   cpu.si = data_4F19[cpu.bx];
   cpu.si += data_4F19[cpu.bx + 1] << 8;
   printf("%s: 0x4DAA unimplemented\n", __func__);
-  exit(1);
+  dw_exit(DW_EXIT_ERROR);
 }
 
 // 0x4D5C
@@ -3045,7 +3015,7 @@ static void sub_1A72()
     if (al < 0x80) {
       // 0x1A93
       printf("%s: 0x1A93 unimplemented\n", __func__);
-      exit(1);
+      dw_exit(DW_EXIT_ERROR);
     }
     // 0x1AA9
     cpu.bx--;
@@ -3067,7 +3037,7 @@ static void sub_1F10()
   }
 
   printf("%s: 0x1F17 unimplemented\n", __func__);
-  exit(1);
+  dw_exit(DW_EXIT_ERROR);
 }
 
 // 0x2CF5
@@ -3102,7 +3072,7 @@ static int sub_2AEE()
 
   if (cpu.ax > draw_rect.x) {
     printf("%s: 0x2BO2 unimplemented\n", __func__);
-    exit(1);
+    dw_exit(DW_EXIT_ERROR);
   }
 
   if ((word_2AA7 & 0x04) != 0) {
@@ -3116,7 +3086,7 @@ static int sub_2AEE()
     if (cpu.ax >= 0xD8) {
       // 0x2B4B
       printf("%s: 0x2B4B unimplemented\n", __func__);
-      exit(1);
+      dw_exit(DW_EXIT_ERROR);
     }
   }
   // 0x2B81
@@ -3124,7 +3094,7 @@ static int sub_2AEE()
     cpu.ax = word_3856;
     if (cpu.ax >= 0x10) {
       printf("%s: 0x2B8E unimplemented\n", __func__);
-      exit(1);
+      dw_exit(DW_EXIT_ERROR);
     }
   }
 
@@ -3144,7 +3114,7 @@ static uint16_t sub_2D0B()
   cpu.bx = word_2DD9;
   if (cpu.bx < 0x8000) {
     printf("%s: 0x2D13 unimplemented\n", __func__);
-    exit(1);
+    dw_exit(DW_EXIT_ERROR);
   }
   // 0x2D31
   do {
@@ -3154,7 +3124,7 @@ static uint16_t sub_2D0B()
     }
     if (cpu.ax == 0x93) {
       // Ctrl-S
-      printf("xor byte_107, 0x40\n");
+      TRACE(CTRL_S);
     }
   } while (cpu.ax == 0x93);
 
@@ -3168,7 +3138,7 @@ static uint16_t sub_2D0B()
   // 0x2D53
 
   printf("%s: 0x2D53 unimplemented\n", __func__);
-  exit(1);
+  dw_exit(DW_EXIT_ERROR);
 
   return cpu.ax;
 }
@@ -3209,18 +3179,16 @@ static void sub_2A4C()
   uint8_t al;
 
   cpu.di++;
-  printf("%s DI: 0x%04X\n", __func__, cpu.di);
 
   cpu.bx = *(cpu.base_pc + cpu.di);
   cpu.bx += *(cpu.base_pc + cpu.di + 1) << 8;
 
-  printf("%s: BX - 0x%04X\n", __func__, cpu.bx);
-  printf("%s: AX - 0x%04X\n", __func__, cpu.ax);
+  TRACE(SUB_2A4C, cpu.di, cpu.bx, cpu.ax);
   sub_2ADC();
   al = cpu.ax & 0xFF;
   if (al == 1) {
     al = byte_2AA6;
-    printf("%s: AL - 0x%02X\n", __func__, al);
+    TRACE(SUB_2A4C_AL, al);
 
     al -= 0xB1;
     game_state.unknown[0x6] = al;
@@ -3236,7 +3204,7 @@ static void sub_1F8F()
     return;
 
   printf("%s: 0x1F96 unimplemented\n", __func__);
-  exit(1);
+  dw_exit(DW_EXIT_ERROR);
 }
 
 // 0x28B0
@@ -3306,9 +3274,10 @@ static void sub_28B0(unsigned char **src_ptr, unsigned char *base)
     cpu.bx = data_2A68[bl + 4];
     cpu.bx += data_2A68[bl + 5] << 8;
 
-    printf("%s: cpu.bx = 0x%04X\n", __func__, cpu.bx);
+    TRACE(SUB_28B0, cpu.bx);
 
-    sub_1C79(data_2A68, (cpu.bx - 0x2A68));
+    sub_1C79(data_2A68, com_view_len(0x2A68), (cpu.bx - 0x2A68),
+        com_text_cache());
     ui_draw_string();
 
     bl = draw_point.y;
@@ -3323,7 +3292,7 @@ static void sub_28B0(unsigned char **src_ptr, unsigned char *base)
   sub_4D5C();
   sub_4B60();
   sub_1A72();
-  printf("%s: word_2AA7: 0x%04X\n", __func__, word_2AA7);
+  TRACE(WORD_2AA7, word_2AA7);
   // 0x294B
   while (1) {
     if ((word_2AA7 & 0x0080) == 0) {
@@ -3335,7 +3304,7 @@ static void sub_28B0(unsigned char **src_ptr, unsigned char *base)
     uint8_t clicked = sub_3840();
     if (clicked == 0x80) {
       printf("%s: 0x2965 unimplemented\n", __func__);
-      exit(1);
+      dw_exit(DW_EXIT_ERROR);
     }
 
     // 0x2985
@@ -3351,7 +3320,7 @@ static void sub_28B0(unsigned char **src_ptr, unsigned char *base)
 
       // 0x299B
       // All other keys
-      printf("%s: word_2AA7: 0x%04X\n", __func__, word_2AA7);
+      TRACE(WORD_2AA7, word_2AA7);
       if ((word_2AA7 & 0x8000) != 0) {
         if ((word_2AA7 & 0x4000) == 0) {
           if (al == 0xA0) {
@@ -3420,7 +3389,7 @@ static void sub_28B0(unsigned char **src_ptr, unsigned char *base)
       // 0x2A15
       else if (al == 0x02) {
         printf("%s: 0x2A19 unimplemented\n", __func__);
-        exit(1);
+        dw_exit(DW_EXIT_ERROR);
       }
       // 0x2A20
       else if (al != 0x80) {
@@ -3480,7 +3449,7 @@ static void op_88()
 // 0x4977
 static void op_89(void)
 {
-  printf("%s : 0x4977\n", __func__);
+  TRACE(OP_89);
   word_3ADB = cpu.pc - running_script->bytes;
   cpu.base_pc = running_script->bytes;
   cpu.bx = word_3ADB;
@@ -3490,7 +3459,7 @@ static void op_89(void)
   // 0x4984 (A good idea to break here so you can trap keypresses).
   // the key pressed will be in AX (OR'd with 0x80).
   cpu.ax = cpu.ax & 0x00FF;
-  printf("%s: BX: 0x%04X\n", __func__, cpu.bx);
+  TRACE(OP_8A, cpu.bx);
   cpu.pc = cpu.base_pc + cpu.bx;
   word_3AE2 = cpu.ax; // key pressed
 }
@@ -3547,8 +3516,13 @@ static void sub_4C40()
     cpu.bx = 0xC8; // Load a specific resource
     // XXX TEMPORARY END
 
-    printf("Loading Resource: %d\n", cpu.bx);
+    TRACE(LOAD_RESOURCE, cpu.bx);
+    // The companion section (tag + 1) decompresses while this one loads.
+    resource_load_async(cpu.bx + 1, NULL, NULL);
     r = resource_load(cpu.bx);
+    // Without this section nothing takes the companion one.
+    if (r == NULL)
+      resource_cancel(cpu.bx + 1);
     if (r != NULL) {
       sub_4C95(r);
       sub_128D(r->index);
@@ -3556,7 +3530,7 @@ static void sub_4C40()
       uint16_t tag = r->tag;
       tag++;
 
-      r2 = resource_load(tag);
+      r2 = resource_wait(tag);
       if (r2 == NULL) {
         // 4C91
         return;
@@ -3712,9 +3686,9 @@ static void sub_1E49()
   sub_3150(al);
 }
 
-static void sub_1C70(unsigned char *src_ptr)
+static void sub_1C70(unsigned char *src_ptr, size_t len)
 {
-  sub_1C79(src_ptr, 0);
+  sub_1C79(src_ptr, len, 0, NULL);
   cpu.cf = 0;
 }
 
@@ -3772,6 +3746,7 @@ static void sub_57DB()
   struct resource *r = resource_get_by_index(al);
   data_5521 = r->bytes;
   data_5866 = r->bytes;
+  data_5866_len = r->len;
   cpu.di = 0;
   // 0x57F0
   while (cpu.di < 4) {
@@ -3847,7 +3822,7 @@ static void sub_5523()
   }
   // 0x5529
   printf("%s 0x5529 unimplemented,\n", __func__);
-  exit(1);
+  dw_exit(DW_EXIT_ERROR);
 }
 
 // 0x5559
@@ -3862,7 +3837,7 @@ static void sub_5559()
 
   // 0x555F
   printf("%s 0x555F unimplemented,\n", __func__);
-  exit(1);
+  dw_exit(DW_EXIT_ERROR);
 }
 
 // 0x54D8
@@ -3892,7 +3867,7 @@ static void sub_54D8()
   cpu.di = cpu.ax;
   cpu.ax = data_5521[cpu.di];
   cpu.ax += data_5521[cpu.di + 1] << 8;
-  printf("%s - DI: 0x%04X AX: 0x%04X\n", __func__, cpu.di, cpu.ax);
+  TRACE(SUB_54D8, cpu.di, cpu.ax);
   word_11C6 = cpu.ax;
   al = data_5521[cpu.di + 2];
   word_11C8 = al;
@@ -4064,9 +4039,42 @@ static void sub_536B()
 }
 
 // 0x5764
+// Queues the tile sets of a map section (see sub_57DB) for prefetching,
+// runs on a worker.
+static void
+prefetch_map_tiles(enum resource_section sec, const unsigned char *bytes,
+    size_t len)
+{
+  for (size_t i = 4; i < len && i < 4 + 0xF; i++) {
+    resource_prefetch((bytes[i] & 0x7F) + 0x6E, NULL);
+    if (bytes[i] >= 0x80)
+      break;
+  }
+}
+
+// Map data and tile sets are read when the party enters a map, so once
+// the current ones are loaded start reading the maps it's likely to enter
+// next: the one it came from and the one it went to the last time it left
+// this map. The exits of a map are not known yet, and until 0x577C is done
+// the party can't leave the first map so nothing gets prefetched.
+static void
+prefetch_neighbours(void)
+{
+  uint8_t map = game_state.unknown[2];
+  uint8_t prev = map_prev - 1;
+
+  map_prev = 0;
+  map_next[prev] = map + 1;
+  resource_prefetch(prev + 0x46, prefetch_map_tiles);
+  if (map_next[map] != 0)
+    resource_prefetch(map_next[map] - 1 + 0x46, prefetch_map_tiles);
+}
+
 static void sub_5764()
 {
   uint8_t al, bl;
+  // 0x57 is only a map the party was on if its section was loaded.
+  int had_map = game_state.unknown[0x56] != 0xFF;
 
   al = game_state.unknown[2];
   if (al != game_state.unknown[0x57]) {
@@ -4076,7 +4084,7 @@ static void sub_5764()
       if (game_state.unknown[0x56] != 0xFF) {
         // 0x577C
         printf("%s 0x577C unimplemented, al = 0x%02X\n", __func__, al);
-        exit(1);
+        dw_exit(DW_EXIT_ERROR);
       }
       // 0x578A
       bl = game_state.unknown[2];
@@ -4085,6 +4093,8 @@ static void sub_5764()
       al = 1;
       struct resource *r = resource_load(cpu.bx);
       set_game_state(__func__, 0x56, r->index);
+      if (had_map)
+        map_prev = game_state.unknown[0x57] + 1;
       sub_57DB();
       // 579E
       sub_4FD9();
@@ -4127,6 +4137,15 @@ static void sub_59A6()
   uint8_t al, bl;
   struct resource *r;
 
+  // Start loading all the tile sets so they decompress in parallel, the
+  // loop below takes them in order. The list is at most 15 entries, the
+  // slot indexes follow it.
+  for (int i = 0; i < 0xF; i++) {
+    resource_load_async((data_5897[i] & 0x7F) + 0x6E, NULL, NULL);
+    if (data_5897[i] >= 0x80)
+      break;
+  }
+
   cpu.bx = 0xFFFF;
 
   // Cache resources indexes.
@@ -4139,7 +4158,7 @@ static void sub_59A6()
     cpu.bx &= 0x7F;
     cpu.bx += 0x6E;
     al = 1;
-    r = resource_load(cpu.bx);
+    r = resource_wait(cpu.bx);
     cpu.bx = pop_word();
     //       [bx + 0x58A6]
     data_5897[cpu.bx + 0xf] = r->index;
@@ -4173,7 +4192,7 @@ static void sub_CE7(struct viewport_data *vp, uint16_t bx)
   cpu.ax = *ds;
   ds++;
   cpu.ax += (*ds) << 8;
-  printf("%s: BX: 0x%04X AX: 0x%04X\n", __func__, bx, cpu.ax);
+  TRACE(SUB_CE7, bx, cpu.ax);
 
   if (cpu.ax == 0)
     return;
@@ -4229,7 +4248,7 @@ static void sub_56FC()
 
     // 0x5735
     printf("%s 0x5735 unimplemented 0x%04X\n", __func__, cpu.bx);
-    exit(1);
+    dw_exit(DW_EXIT_ERROR);
   }
 }
 
@@ -4264,7 +4283,8 @@ static void start_the_game()
   sub_4D82();
   sub_5764();
   cpu.bx = word_5864;
-  sub_27E3(data_5866, word_5864);
+  sub_27E3(data_5866, data_5866_len, word_5864,
+      resource_text(game_state.unknown[0x56], data_5866));
   cpu.bx = game_state.unknown[3];
   cpu.bx = cpu.bx << 1;
 
@@ -4287,7 +4307,7 @@ static void start_the_game()
     sub_536B();
     cpu.si = pop_word();
     cpu.di = pop_word();
-    printf("%s 0x%04X 11CA: 0x%04X\n", __func__, cpu.di, word_11CA);
+    TRACE(START_GAME, cpu.di, word_11CA);
     al = word_11CA;
     data_5A04[0x52 + cpu.di] = al;
     al = (word_11CA & 0xFF00) >> 8;
@@ -4300,7 +4320,7 @@ static void start_the_game()
   } while (cpu.di != 0xFFFF);
 
   bl = data_5A04[0x5C];
-  printf("%s 0x51FC BL - 0x%02X\n", __func__, bl);
+  TRACE(START_GAME_BL, bl);
   bl = bl >> 4;
 
   if (bl != 0) {
@@ -4314,7 +4334,7 @@ static void start_the_game()
     // 0x37C8
     // draw_viewport ??
     printf("%s 0x5224 (call 37C8) unimplemented\n", __func__);
-    exit(1);
+    dw_exit(DW_EXIT_ERROR);
   }
   // 0x5227
   dl = game_state.unknown[1];
@@ -4328,6 +4348,8 @@ static void start_the_game()
   }
   // 0x523E
   sub_59A6();
+  if (map_prev != 0)
+    prefetch_neighbours();
   sub_56FC();
 
   counter = 8;
@@ -4422,7 +4444,7 @@ static void op_8B()
 // 0x49A5
 static void op_8C()
 {
-  sub_1C70(data_49AB);
+  sub_1C70(data_49AB, sizeof(data_49AB));
   cpu.bx = 0x49CA;
   unsigned char *ptr = data_49CA;
   sub_28B0(&ptr, data_49CA);
@@ -4452,7 +4474,7 @@ static void op_8C()
 // 0x49D3
 static void op_8D()
 {
-  printf("%s : 0x49D3\n", __func__);
+  TRACE(OP_8D);
   sub_1E49();
 }
 
@@ -4461,7 +4483,7 @@ static void sub_5076(int function_idx)
   // Output sound effect based on function.
   if (function_idx >= NUM_FUNCS) {
     printf("%s unknown function %d\n", __func__, function_idx);
-    exit(1);
+    dw_exit(DW_EXIT_ERROR);
   }
 
   func_5060[function_idx]();
@@ -4478,7 +4500,7 @@ static void sub_5096()
 static void sub_50B2()
 {
   printf("%s: unimplemented\n", __func__);
-  exit(1);
+  dw_exit(DW_EXIT_ERROR);
 }
 
 static void sub_5088()
@@ -4705,245 +4727,67 @@ static void op_9D(void)
   sub_40D1();
 }
 
-static void sub_1C79(unsigned char *src_ptr, uint16_t offset)
-{
-  uint8_t ret, bl;
-
-  num_bits = 0;
-  cpu.bx = offset;
-  bit_extractor_info.data = src_ptr;
-  bit_extractor_info.offset = offset;
+// Glyphs of a string for append_string, laid out as a whole.
+struct text_run {
+  unsigned char glyphs[256];
+  size_t n;
+};
 
-  byte_1CE4 = 0;
+static void emit_glyph(uint8_t glyph, void *arg)
+{
+  struct text_run *run = arg;
 
-  // 0x1C8B
-  while (1) {
-    ret = sub_1CF8(); // check for 0
-    if (ret == 0) {
-      // 1CE6
-      cpu.bx = bit_extractor_info.offset;
-      return;
-    }
-    if ((game_state.unknown[8] & 0x80) == 0)
-    {
-      ret |= 0x80;
-      game_state.unknown[8] = ret;
-      ret &= 0x7F;
-    }
-    // 1C9E
-    if (ret == 0xAF || ret == 0xDC) {
-      do {
-        if (ret == 0xAF) {
-          // 0x1CAB
-          bl = 0x80;
-        } else if (ret == 0xDC) {
-          // 0x1CAF
-          bl = 0;
-        }
-        // 0x1CB1
-        if (ret == 0xAF || ret == 0xDC) {
-          byte_1CE1 = ret;
-          if (game_state.unknown[9] != 0) {
-            // 0x1CBB
-            bl = bl ^ 0x80;
-          }
-          byte_1CE2 = bl;
-        }
-        // 0x1CC2
-        ret = sub_1CF8(); // check for 0
-        if (ret == 0) {
-          // 1CE6
-          cpu.bx = bit_extractor_info.offset;
-          return;
-        }
-        if (ret == byte_1CE1) {
-          break;
-        }
-        if (ret == 0xDC || ret == 0xAF) {
-          continue;
-        }
-        if (byte_1CE2 != 0) {
-          sub_3150(ret);
-        }
-      } while (1);
-    } else {
-      sub_3150(ret);
-    }
+  if (run == NULL) {
+    sub_3150(glyph);
+    return;
   }
+  if (run->n == sizeof(run->glyphs)) {
+    ui_append_text(run->glyphs, run->n);
+    run->n = 0;
+  }
+  run->glyphs[run->n++] = glyph;
 }
 
-// 0x1D2A - 0x1D85
-// Some type of character alphabet?
-unsigned char alphabet[] = {
-  0xa0, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xeb, 0xec,
-  0xed, 0xee, 0xef, 0xf0, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf9, 0xae,
-  0xa2, 0xa7, 0xac, 0xa1, 0x8d, 0xea, 0xf1, 0xf8, 0xfa, 0xb0, 0xb1, 0xb2,
-  0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0x30, 0x31, 0x32, 0x33, 0x34,
-  0x35, 0x36, 0x37, 0x38, 0x39, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47,
-  0x48, 0x49, 0x4a, 0x4b, 0x4c, 0x4d, 0x4e, 0x4f, 0x50, 0x51, 0x52, 0x53,
-  0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0xa8, 0xa9, 0xaf, 0xdc, 0xa3,
-  0xaa, 0xbf, 0xbc, 0xbe, 0xba, 0xbb, 0xad, 0xa5
-};
-
-static uint8_t sub_1CF8()
+// Strings decoded from a resource are cached on it, src must be the bytes
+// of the resource at index.
+static struct text_cache *resource_text(int index, const unsigned char *src)
 {
-  while (1) {
-    uint8_t ret = bit_extract(5);
-    if (ret == 0)
-      return 0;
-
-    if (ret == 0x1E) {
-      // stc
-      // rcr byte [byte_1CE4], 1
-      // rotate carry right bit.
-      byte_1CE4 = byte_1CE4 >> 1;
-      byte_1CE4 += 0x80;
-      continue;
-    }
-
-    if (ret > 0x1E) {
-      ret = bit_extract(6);
-      ret += 0x1E;
-    }
-
-    // ret != 0x1E
+  struct resource *r;
 
-    // 0x1D0A
-    // offset
-    uint8_t al = alphabet[ret - 1];
-    byte_1CE4 = byte_1CE4 >> 1;
-    if (byte_1CE4 >= 0x40 && al >= 0xE1 && al <= 0xFA) {
-      al = al & 0xDF;
-    }
-    // test al, al
-    return al;
-  }
+  if (index >= 0x80)
+    return NULL;
+  r = resource_get_by_index(index);
+  if (r->bytes != src)
+    return NULL;
+  if (r->text == NULL)
+    r->text = text_cache_new(r->tag < RESOURCE_MAX ? r->tag : -1);
+  return r->text;
 }
 
-// Extract "n" bits out of each byte.
-// bit_buffer contains leftover bit buffer.
-//
-// 0x1D86 -> 1D8C(6)
-// 0x1D8A -> 1D8C(5)
-// 0x1D8C (num_bits passed in BL)
-static uint8_t bit_extract(int n)
-{
-  int counter = n;
-  int al = 0;
-  int dl = num_bits;
-  while (counter > 0) {
-    dl--;
-    if (dl < 0) {
-      dl = bit_extractor_info.data[bit_extractor_info.offset];
-      bit_buffer = dl;
-      dl = 7;
-      bit_extractor_info.offset++;
-    }
-    // 0x1D96
-    uint8_t tmp = bit_buffer;
-    bit_buffer = bit_buffer << 1;
+// The text decoder is in text.c.
+static void sub_1C79(const unsigned char *src_ptr, size_t len,
+    uint16_t offset, struct text_cache *cache)
+{
+  struct text_run run;
 
-    // rcl al, 1
-    int carry = 0;
-    if (tmp > bit_buffer) {
-      carry = 1;
-    }
-    al = al << 1;
-    al += carry;
-    counter--;
+  if (word_3163 != append_string) {
+    cpu.bx = text_decode_cached(cache, src_ptr, len, offset,
+        &game_state.unknown[8], emit_glyph, NULL);
+    return;
   }
-  num_bits = dl; // leftover bits
-  return al;
+
+  run.n = 0;
+  cpu.bx = text_decode_cached(cache, src_ptr, len, offset,
+      &game_state.unknown[8], emit_glyph, &run);
+  ui_append_text(run.glyphs, run.n);
 }
 
 // 0x3191
 // Append's a byte to string buffer. This may break a long string up into
-// multiple lines.
+// multiple lines, see ui_append_text.
 static void append_string(unsigned char byte)
 {
-  uint8_t al;
-  uint16_t ax, bx, len, dx;
-
-  bx = ui_string.len;
-  ui_string.bytes[bx] = byte;
-  ui_string.len++;
-
-  printf("%s: 0x%02X %c\n", __func__, byte, byte & 0x7F);
-  if (byte == 0x8D) { // new line.
-    printf("data len: %d\n", ui_string.len);
-    printf("2697: 0x%04x\n", draw_rect.x);
-    printf("2697: 0x%04x\n", draw_rect.y);
-    printf("32BF: 0x%04x\n", draw_point.x);
-    printf("32BF: 0x%04x\n", draw_point.y);
-    ui_draw_string();
-    return;
-  }
-
-  ax = bx;
-
-  // Validate that string doesn't run past rectangle.
-  ax += ui_get_byte_3236();
-  if (ax < draw_rect.w)
-    return;
-
-  // String does run past rectangle, so break apart at space.
-  // 0x31AE
-  ui_string.len--;
-  if (ui_string.len != 0) {
-    len = bx;
-
-    // 0x31B6
-    while (len > 0) {
-      al = ui_string.bytes[len];
-      // search for previous space character.
-      if (al == 0xA0) {
-        bx = len;
-        printf("%s: 0x31D2 %02d\n", __func__, len);
-        if (len != 0) {
-          // mov si, 320E
-          uint16_t si = 0;
-
-          // redraw only up to space (line break)
-          while (len > 0) {
-            // lodsb  al = ds:si [si++]
-            al = ui_string.bytes[si++];
-            ui_draw_chr_piece(al);
-            len--;
-          }
-        }
-        // 31E2
-        ui_string.len++;
-        len = 0;
-
-        // 0x31E8
-        bx++;
-        while (bx < ui_string.len) {
-
-          // 0x31EF
-          // move string up.
-          al = ui_string.bytes[bx];
-          ui_string.bytes[len] = al;
-          len++;
-          bx++;
-        }
-        // 0x31FA
-        dx = len;
-        break;
-      }
-      len--;
-    }
-  }
-  else {
-    // 31C1 - length is 0.
-    ui_draw_string();
-    ui_string.bytes[0] = ui_string.bytes[bx];
-    dx = 1;
-  }
-  // 0x31FC
-  ui_string.len = dx;
-  al = 0x8D;
-  ui_draw_chr_piece(al);
-  ui_set_byte_3236(draw_point.x);
+  ui_append_text(&byte, 1);
 }
 
 static void sub_3165()
@@ -4956,12 +4800,13 @@ static void sub_316C()
   word_3163 = append_string;
 }
 
-static void sub_27E3(unsigned char *base_ptr, uint16_t offset)
+static void sub_27E3(unsigned char *base_ptr, size_t len, uint16_t offset,
+    struct text_cache *cache)
 {
   word_3163 = ui_header_set_byte;
   ui_string.len = 0;
   ui_header_reset();
-  sub_1C79(base_ptr, offset);
+  sub_1C79(base_ptr, len, offset, cache);
   sub_316C();
   sub_280E();
 }
@@ -4983,14 +4828,198 @@ static void sub_3150(unsigned char byte)
 // 0x482D
 static void read_header_bytes(void)
 {
-  sub_27E3(cpu.base_pc, cpu.pc - cpu.base_pc);
+  sub_27E3(cpu.base_pc, running_script->len, cpu.pc - cpu.base_pc,
+      resource_text(running_script->index, cpu.base_pc));
   cpu.pc = cpu.base_pc + cpu.bx;
 }
 
+#if defined(VM_DECODE_CACHE)
+/* Decoded forms of the op codes that the VM runs most. They do the same
+ * work as the op handlers above but get their operand from the decoded
+ * instruction instead of the script bytes. Jump and call targets are the
+ * script offsets from the operand, the handlers add cpu.base_pc. cpu.pc
+ * already points at the next instruction when these are called. */
+static void dec_op_06(const struct decoded_op *d)
+{
+  op_06_arg(d->operand);
+}
+
+static void dec_set_word3AE2(const struct decoded_op *d)
+{
+  set_word3AE2_val(d->operand);
+}
+
+static void dec_load_word3AE2_gamestate(const struct decoded_op *d)
+{
+  load_word3AE2_gamestate_arg(d->operand);
+}
+
+static void dec_op_0F(const struct decoded_op *d)
+{
+  op_0F_arg(d->operand);
+}
+
+static void dec_store_data_into_resource(const struct decoded_op *d)
+{
+  store_data_into_resource_arg(d->operand);
+}
+
+static void dec_op_jnz(const struct decoded_op *d)
+{
+  op_jnz_arg(d->operand);
+}
+
+static void dec_op_jz(const struct decoded_op *d)
+{
+  op_jz_arg(d->operand);
+}
+
+static void dec_loop(const struct decoded_op *d)
+{
+  loop_arg(d->operand);
+}
+
+static void dec_op_52(const struct decoded_op *d)
+{
+  op_52_arg(d->operand);
+}
+
+// Operand widths for decode_table.
+#define ARG_NONE 0
+#define ARG_BYTE 1
+#define ARG_WORD 2
+#define ARG_MODE 3 // byte or word depending on byte_3AE1.
+
+struct decode_entry {
+  decoded_func exec;
+  uint8_t arg;
+};
+
+static const struct decode_entry decode_table[256] = {
+  [0x06] = { dec_op_06, ARG_BYTE },
+  [0x09] = { dec_set_word3AE2, ARG_MODE },
+  [0x0A] = { dec_load_word3AE2_gamestate, ARG_BYTE },
+  [0x0F] = { dec_op_0F, ARG_BYTE },
+  [0x17] = { dec_store_data_into_resource, ARG_BYTE },
+  [0x44] = { dec_op_jnz, ARG_WORD },
+  [0x45] = { dec_op_jz, ARG_WORD },
+  [0x49] = { dec_loop, ARG_WORD },
+  [0x52] = { dec_op_52, ARG_WORD },
+};
+
+// Decodes the instruction at offset and stores it in the cache. Returns NULL
+// if the op code has no decoded form.
+static const struct decoded_op *
+decode_op(struct decoded_script *ds, const unsigned char *bytes,
+    size_t offset)
+{
+  struct decoded_op d;
+  const struct decode_entry *e = &decode_table[bytes[offset]];
+  size_t width = e->arg;
+
+  if (e->exec == NULL) {
+    decode_mark_generic(ds, offset);
+    return NULL;
+  }
+
+  d.exec = e->exec;
+  d.op_code = bytes[offset];
+  d.mode = 0xFF;
+  if (e->arg == ARG_MODE) {
+    d.mode = byte_3AE1;
+    width = byte_3AE1 != 0 ? 2 : 1;
+  }
+  if (offset + 1 + width > ds->len) {
+    decode_mark_generic(ds, offset);
+    return NULL;
+  }
+
+  d.operand = 0;
+  if (width >= 1)
+    d.operand = bytes[offset + 1];
+  if (width == 2)
+    d.operand += bytes[offset + 2] << 8;
+  d.next = offset + 1 + width;
+
+  return decode_put(ds, offset, &d);
+}
+
+// The resource whose bytes the VM is running, NULL if cpu.base_pc isn't the
+// bytes of the running script.
+static struct resource *decoded_resource(void)
+{
+  struct resource *r = resource_get_by_index(word_3AE8);
+
+  return r->bytes == cpu.base_pc ? r : NULL;
+}
+
+// Runs instructions of r out of the decode cache until one needs the
+// regular dispatcher. Returns the last op code that was run.
+static uint8_t run_decoded(struct resource *r, uint8_t op_code)
+{
+  const struct decoded_op *d;
+
+  // The slot was freed or loaded again since run_script looked it up.
+  if (r->bytes != cpu.base_pc)
+    return op_code;
+
+  if (r->decoded == NULL) {
+    r->decoded = decode_new(r->len);
+    if (r->decoded == NULL)
+      return op_code;
+  }
+
+  while (1) {
+    size_t offset = cpu.pc - cpu.base_pc;
+
+    d = decode_get(r->decoded, offset);
+    if (d == NULL || (d->mode != 0xFF && d->mode != byte_3AE1)) {
+      if (decode_is_generic(r->decoded, offset))
+        return op_code;
+      d = decode_op(r->decoded, cpu.base_pc, offset);
+      if (d == NULL)
+        return op_code;
+    }
+
+    op_code = d->op_code;
+    PROFILE_OP(op_code);
+    ENGINE->op_count++;
+    cpu.ax = op_code;
+    cpu.bx = cpu.ax;
+    cpu.pc = cpu.base_pc + d->next;
+    d->exec(d);
+  }
+}
+#endif /* VM_DECODE_CACHE */
+
+static void unhandled_op(uint8_t op_code, uint8_t prev_op)
+{
+  printf("OpenDW has reached an unhandled op code and will terminate.\n");
+  printf("  Opcode: 0x%02X (Addr: %s), Previous op: 0x%02X\n", op_code,
+      targets[op_code].src_offset, prev_op);
+  dw_exit(DW_EXIT_ERROR);
+}
+
+/* The script dispatcher is picked at build time (see VM_DISPATCH in the
+ * Makefile):
+ *   VM_DISPATCH_table    - indirect call through targets[] (original loop).
+ *   VM_DISPATCH_switch   - switch over all op codes, handlers get inlined.
+ *   VM_DISPATCH_threaded - computed goto, one indirect jump per op code.
+ * Threaded dispatch needs the GNU "labels as values" extension, without it
+ * we fall back to the switch. */
+#if defined(VM_DISPATCH_threaded) && !defined(__GNUC__)
+#undef VM_DISPATCH_threaded
+#define VM_DISPATCH_switch
+#endif
+
+#if !defined(VM_DISPATCH_table) && !defined(VM_DISPATCH_switch) && \
+  !defined(VM_DISPATCH_threaded)
+#define VM_DISPATCH_table
+#endif
+
 // 0x3AA0
 static void run_script(uint8_t script_index, uint16_t src_offset)
 {
-  int done = 0;
   uint8_t prev_op = 0;
   uint8_t op_code = 0;
 
@@ -5009,33 +5038,106 @@ static void run_script(uint8_t script_index, uint16_t src_offset)
   cpu.pc = running_script->bytes + src_offset;
   cpu.base_pc = running_script->bytes;
 
-  while (!done) {
-    prev_op = op_code;
-    // 0x3ACF
-    // es lodsb
-    op_code = *cpu.pc++;
-    // xor ah, ah
-    cpu.ax = op_code;
-    cpu.bx = cpu.ax;
+  // 0x3ACF
+  // es lodsb
+  // xor ah, ah
+#if defined(VM_DECODE_CACHE)
+  // Script the decode cache was last looked up for, only looked up again
+  // when an op code with a decoded form runs from other bytes.
+  const unsigned char *decoded_base = NULL;
+  struct resource *decoded_res = NULL;
+
+#define RUN_DECODED() do {                           \
+    if (decode_table[*cpu.pc].exec != NULL) {        \
+      if (cpu.base_pc != decoded_base) {             \
+        decoded_base = cpu.base_pc;                  \
+        decoded_res = decoded_resource();            \
+      }                                              \
+      if (decoded_res != NULL)                       \
+        op_code = run_decoded(decoded_res, op_code); \
+    }                                                \
+  } while (0)
+#else
+#define RUN_DECODED()
+#endif
+
+#define FETCH_OP() do {   \
+    RUN_DECODED();        \
+    prev_op = op_code;    \
+    PROFILE_OP(*cpu.pc);  \
+    ENGINE->op_count++;   \
+    op_code = *cpu.pc++;  \
+    cpu.ax = op_code;     \
+    cpu.bx = cpu.ax;      \
+  } while (0)
+
+#if defined(VM_DISPATCH_threaded)
+#define OP_LABEL_ADDR(op, func, addr) [op] = &&label_##op,
+#define OP_LABEL_NONE(op, addr) [op] = &&label_unhandled,
+#define OP_LABEL_BODY(op, func, addr) \
+  label_##op:                         \
+    func();                           \
+    if (op == 0x5A)                   \
+      return;                         \
+    FETCH_OP();                       \
+    goto *dispatch[op_code];
+#define OP_LABEL_SKIP(op, addr)
+
+  static const void *dispatch[256] = {
+    OP_TABLE(OP_LABEL_ADDR, OP_LABEL_NONE)
+  };
+
+  FETCH_OP();
+  goto *dispatch[op_code];
+
+  OP_TABLE(OP_LABEL_BODY, OP_LABEL_SKIP)
+
+label_unhandled:
+  unhandled_op(op_code, prev_op);
+
+#elif defined(VM_DISPATCH_switch)
+#define OP_CASE(op, func, addr) \
+  case op:                      \
+    func();                     \
+    if (op == 0x5A)             \
+      return;                   \
+    break;
+#define OP_CASE_NONE(op, addr)
 
-    void (*callfunc)(void) = targets[op_code].func;
-    if (callfunc != NULL) {
-      callfunc();
-      if (op_code == 0x5A)
-        done = 1;
+  while (1) {
+    FETCH_OP();
+    switch (op_code) {
+    OP_TABLE(OP_CASE, OP_CASE_NONE)
+    default:
+      unhandled_op(op_code, prev_op);
+      return;
+    }
+  }
 
-    } else {
-      printf("OpenDW has reached an unhandled op code and will terminate.\n");
-      printf("  Opcode: 0x%02X (Addr: %s), Previous op: 0x%02X\n", op_code,
-          targets[op_code].src_offset, prev_op);
-      exit(1);
-      done = 1;
+#else
+  while (1) {
+    FETCH_OP();
+
+    void (*callfunc)(void) = targets[op_code].func;
+    if (callfunc == NULL) {
+      unhandled_op(op_code, prev_op);
+      return;
     }
+    callfunc();
+    if (op_code == 0x5A)
+      return;
   }
+#endif
+#undef FETCH_OP
+#undef RUN_DECODED
 }
 
 void run_engine()
 {
+#if defined(VM_PROFILE)
+  profile_init(op_names, op_addrs);
+#endif
+
   timers.timer3 = 1;
 
   game_state.unknown[8] = 0xFF;
@@ -5045,10 +5147,10 @@ void run_engine()
   ui_set_background(0x0000); // Not correct.
 
   // load unknown data from COM file.
-  data_2A68 = com_extract(0x2A68, 0x39);
-  data_5303 = com_extract(0x5303, 512); // XXX: Validate that this is 512 bytes
-  data_D760 = com_extract(0xD760, 0x700);
-  data_1E21 = com_extract(0x1E21, 0xEF);
+  data_2A68 = com_view(0x2A68, 0x39);
+  data_5303 = com_view(0x5303, 512); // XXX: Validate that this is 512 bytes
+  data_D760 = com_extract(0xD760, 0x700); // Written by op_1D.
+  data_1E21 = com_view(0x1E21, 0xEF);
 
   // 0x1A6
   // Loads into 0x1887:0000
@@ -5063,8 +5165,17 @@ void run_engine()
 
   // 0x3AA0
   run_script(code_res->index, 0);
+#if defined(VM_PROFILE)
+  profile_stop();
+#endif
+}
 
+// Frees what run_engine allocated, games mostly end through dw_exit so
+// this is called from game_end instead of at the end of run_engine.
+void engine_clean(void)
+{
   free(data_D760);
+  data_D760 = NULL;
 }
 
 // 0x1ABD
@@ -5190,7 +5301,7 @@ static void sub_1ABD(uint8_t val)
   }
   // 1B95
   printf("%s 0x1B95 %d %d unimplemented\n", __func__, si, found);
-  exit(1);
+  dw_exit(DW_EXIT_ERROR);
 }
 
 // 0x1A68
@@ -5295,7 +5406,7 @@ static void sub_11CE()
     word_11CC = (word_11CC << 1) + old_carry;
     old_carry = carry;
 
-    printf("%s: 0x%04X 0x%04X 0x%04X 0x%04X\n", __func__, word_11C6, word_11C8, word_11CA, word_11CC);
+    TRACE(SUB_11CE, word_11C6, word_11C8, word_11CA, word_11CC);
 
     cpu.ax = word_11CA;
     uint16_t old16 = cpu.ax;
@@ -17,19 +17,214 @@
 #ifndef DW_ENGINE_H
 #define DW_ENGINE_H
 
+#include <stdint.h>
+
+#include "context.h"
+#include "resource.h"
+#include "vga.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-extern unsigned char byte_104E;
-extern unsigned char byte_2476;
-extern unsigned char data_2AAA[32];
-extern unsigned char word_4C31[4];
-extern unsigned char byte_4F0F;
-extern unsigned char byte_4F10;
+/* Timers? */
+struct timer_ctx {
+  uint8_t  timer0; // 0x4C35
+  uint8_t  timer1; // 0x4C36
+  uint8_t  timer2; // 0x4C37
+  uint16_t timer3; // 0x4C38
+  uint16_t timer4; // 0x4C3A
+  uint8_t  timer5; // 0x4C3C
+};
+
+// Small stack, hopefully we don't use much of it.
+#define STACK_SIZE 32
+
+// virtual CPU
+struct virtual_cpu {
+  // registers
+  uint16_t ax;
+  uint16_t bx;
+  uint16_t cx;
+  uint16_t dx;
+
+  uint16_t di;
+  uint16_t si;
+
+  // stack
+  uint8_t stack[STACK_SIZE]; // stacks;
+  uint8_t sp;
+
+  // flags
+  uint8_t cf;
+  uint8_t zf;
+  uint8_t sf;
+
+  // program counter
+  unsigned char *pc;
+  unsigned char *base_pc;
+};
+
+/* Variables of the engine for one game, see context.h.
+ *
+ * Lots of variables here until we can figure out how they are used. */
+struct engine_state {
+  uint16_t counter_104D;
+
+  unsigned char byte_104E;
+  // 104F is technically a dword with segment:offset.
+  uint16_t word_104F; // offset into 1051
+  struct resource *word_1051;
+
+  uint16_t word_11C0;
+  uint16_t word_11C2;
+  uint16_t word_11C4;
+  uint16_t word_11C6;
+  uint16_t word_11C8;
+
+  uint16_t word_11CA;
+  uint16_t word_11CC;
+
+  uint8_t byte_1BE5;
+
+  // 0x1C63
+  // Typically will be (player number * 0x200) + 0xC960
+  uint16_t player_base_offset;
+
+  uint8_t byte_1E1F;
+  uint8_t byte_1E20;
+
+  // This is an unknown size, currently guessing at
+  // 0x1E21 - 0x1F0F
+  const unsigned char *data_1E21;
+
+  uint8_t byte_1F07;
+  uint8_t byte_1F08;
+
+  // 0x246D
+  uint16_t word_246D;
+
+  unsigned char byte_2476;
+
+  uint16_t word_2AA2;
+  unsigned char *word_2AA4;
+
+  uint8_t byte_2AA6;
+  // 0x2AA7
+  uint16_t word_2AA7;
+  uint8_t byte_2AA9;
+  uint8_t data_2AAA[32];
+
+  // 0x2D09
+  uint16_t word_2D09; // timer ticks?
+  uint8_t data_2DDB[160];
+
+  uint16_t word_36C0;
+  uint16_t word_36C2;
+  uint16_t g_linenum; // 36C4
+
+  uint8_t byte_3855;
+  uint16_t word_3856;
+  uint8_t byte_3867;
+  uint8_t byte_387F;
+
+  uint8_t byte_3AE1;
+  uint16_t word_3AE2;
+  uint16_t word_3AE4;
+  uint16_t word_3AE6;
+  uint16_t word_3AE8;
+  uint16_t word_3AEA;
+  // 0x3AEC
+  uint16_t saved_stack;
+
+  uint16_t word_3ADB;
+
+  // "Bit extraction"
+  // 0x1CEF
+
+  /* 0x3ADD */
+  const struct resource *running_script;
+  const struct resource *word_3ADF;
+
+  uint16_t word_42D6;
+  uint16_t word_4454;
+
+  unsigned char byte_4F0F;
+  unsigned char byte_4F10;
+
+  // 0x4F19 - 0x4F2A ? (how big is this really?)
+  unsigned char data_4F19[17];
+  uint8_t byte_4F2B;
+
+  // Another function pointer.
+  void (*word_5038)(unsigned char *dest, unsigned int offset);
+
+  // Length unknown, purpose unknown, from COM file.
+  const unsigned char *data_5303;
+
+  unsigned char *data_5521;
+  uint8_t byte_551E;
+  uint16_t word_551F;
+
+  // Unknown how large this is.
+  // But also referenced as: 56E5 (not sure if this is correct at this point)
+  unsigned char data_56C7[128];
+  unsigned char data_56E5[128];
+  unsigned char data_5A04[128];
+
+  struct resource *data_59E4[128];
+
+  uint16_t word_5864; // offset
+  unsigned char *data_5866; // data
+  size_t data_5866_len;
+
+  // Unknown how large this is
+  // 0x5897
+  unsigned char data_5897[256];
+
+  // Map entered last from each map, plus one (0 if not seen yet). Guesses
+  // the next map for prefetching.
+  uint16_t map_next[256];
+  // Map the party just came from, plus one, until its neighbours are
+  // prefetched.
+  uint16_t map_prev;
+
+  // 0x4C31 - 0x4C34
+  unsigned char word_4C31[4];
+
+  struct timer_ctx timers;
+
+  const unsigned char *data_2A68;
+  unsigned char *data_D760;
+
+  // XXX:How big should these be???
+  // It looks like they can be 0x0E00 bytes, but we round up to 4096.
+  unsigned char data_CA4C[4096];
+
+  // The function signature for this function pointer is not entirely correct
+  // but we'll figure it out as we decode more of DW.
+  void (*word_3163)(unsigned char byte);
+
+  struct virtual_cpu cpu;
+  struct mouse_status mouse;
+
+  // Script op codes executed.
+  uint64_t op_count;
+};
+
+// Engine variables that are also used outside of engine.c.
+#define byte_104E (dw_ctx->engine->byte_104E)
+#define byte_2476 (dw_ctx->engine->byte_2476)
+#define data_2AAA (dw_ctx->engine->data_2AAA)
+#define word_4C31 (dw_ctx->engine->word_4C31)
+#define byte_4F0F (dw_ctx->engine->byte_4F0F)
+#define byte_4F10 (dw_ctx->engine->byte_4F10)
+
+struct engine_state *engine_state_new(void);
 
 void reset_game_state();
 void run_engine();
+void engine_clean(void);
 void sub_4D82();
 
 #ifdef __cplusplus
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "expand.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define EXPAND_X86 1
+#else
+#define EXPAND_X86 0
+#endif
+
+static void
+expand_scalar(uint8_t *dst, const unsigned char *src, size_t n)
+{
+  for (size_t i = 0; i < n; i++) {
+    uint8_t al = src[i];
+
+    /* Each nibble represents a color */
+    /* for example 0x82 represents color 8 then color 2. */
+    dst[2 * i] = (al >> 4) & 0xf;
+    dst[2 * i + 1] = al & 0xf;
+  }
+}
+
+#if EXPAND_X86
+// 16 bytes to 32 pixels per step: the high and low nibbles are split into
+// two vectors and interleaved back, high first.
+__attribute__((target("sse2"))) static void
+expand_sse2(uint8_t *dst, const unsigned char *src, size_t n)
+{
+  const __m128i mask = _mm_set1_epi8(0x0F);
+  size_t i = 0;
+
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+    __m128i lo = _mm_and_si128(v, mask);
+
+    _mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i *)(dst + 2 * i + 16),
+        _mm_unpackhi_epi8(hi, lo));
+  }
+  expand_scalar(dst + 2 * i, src + i, n - i);
+}
+
+// Same with 32 bytes per step. The unpacks work inside each 128 bit lane,
+// so the lanes are put back in order before storing.
+__attribute__((target("avx2"))) static void
+expand_avx2(uint8_t *dst, const unsigned char *src, size_t n)
+{
+  const __m256i mask = _mm256_set1_epi8(0x0F);
+  size_t i = 0;
+
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), mask);
+    __m256i lo = _mm256_and_si256(v, mask);
+    __m256i a = _mm256_unpacklo_epi8(hi, lo);
+    __m256i b = _mm256_unpackhi_epi8(hi, lo);
+
+    _mm256_storeu_si256((__m256i *)(dst + 2 * i),
+        _mm256_permute2x128_si256(a, b, 0x20));
+    _mm256_storeu_si256((__m256i *)(dst + 2 * i + 32),
+        _mm256_permute2x128_si256(a, b, 0x31));
+  }
+  expand_sse2(dst + 2 * i, src + i, n - i);
+}
+#endif
+
+typedef void (*expand_func)(uint8_t *dst, const unsigned char *src,
+    size_t n);
+
+static void expand_pick(uint8_t *dst, const unsigned char *src, size_t n);
+
+// The kernel for this CPU once expand_pick has run.
+static expand_func expand_impl = expand_pick;
+
+static void
+expand_pick(uint8_t *dst, const unsigned char *src, size_t n)
+{
+  expand_func fn = expand_scalar;
+
+#if EXPAND_X86
+  // Reads the CPUID bits libgcc saved at startup.
+  if (__builtin_cpu_supports("avx2"))
+    fn = expand_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    fn = expand_sse2;
+#endif
+  // Every thread picks the same one, the store only needs to be atomic.
+  __atomic_store_n(&expand_impl, fn, __ATOMIC_RELAXED);
+  fn(dst, src, n);
+}
+
+void
+expand_4bpp(uint8_t *dst, const unsigned char *src, size_t n)
+{
+  __atomic_load_n(&expand_impl, __ATOMIC_RELAXED)(dst, src, n);
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef DW_EXPAND_H
+#define DW_EXPAND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* 4 bit pixels to 8 bit pixels.
+ *
+ * The game keeps its pictures two pixels to a byte, high nibble first, so
+ * 0x82 is color 8 then color 2. expand_4bpp writes the 2 * n pixels of the
+ * n bytes at src to dst. On x86 the AVX2 or SSE2 version is picked on the
+ * first call when the CPU has it, elsewhere it's a plain loop. */
+void expand_4bpp(uint8_t *dst, const unsigned char *src, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DW_EXPAND_H */
@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef DW_GAME_H
+#define DW_GAME_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Original Dragon Wars resoluation */
+#define GAME_WIDTH 320
+#define GAME_HEIGHT 200
+
+// Checks that the game files are in the current directory.
+int check_files(void);
+
+// Plays a game in the current context, from the title screen until the
+// script engine stops. Returns one of the DW_EXIT_ values.
+int game_run(void);
+
+// Frees what game_run left behind, the framebuffer and game state can be
+// inspected until then.
+void game_end(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DW_GAME_H */
@@ -15,17 +15,15 @@
  */
 
 #include <stdint.h>
+#include <stdlib.h>
 
 #include "offsets.h"
 
-#define NUM_OFFSETS 0x88
-
-// 0xB042
-uint16_t offsets[NUM_OFFSETS];
-
-// 0x1053 (always gets set to 0x50 ?)
-unsigned short word_1053 = 0;
-unsigned short word_1055 = 0;
+struct offsets_state *
+offsets_state_new(void)
+{
+  return calloc(1, sizeof(struct offsets_state));
+}
 
 /* 0x17DD */
 void init_offsets()
@@ -37,12 +35,12 @@ void init_offsets()
 
   // 0x17E5
   for (i = 0; i < NUM_OFFSETS; i++) {
-    offsets[i] = val;
+    dw_ctx->offsets->table[i] = val;
     val += 0x50;
   }
 }
 
 uint16_t get_offset(int pos)
 {
-  return offsets[pos];
+  return dw_ctx->offsets->table[pos];
 }
@@ -19,12 +19,26 @@
 
 #include <stdint.h>
 
+#include "context.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-extern unsigned short word_1053;
-extern unsigned short word_1055;
+#define NUM_OFFSETS 0x88
+
+struct offsets_state {
+  // 0xB042
+  uint16_t table[NUM_OFFSETS];
+  // 0x1053 (always gets set to 0x50 ?)
+  unsigned short word_1053;
+  unsigned short word_1055;
+};
+
+#define word_1053 (dw_ctx->offsets->word_1053)
+#define word_1055 (dw_ctx->offsets->word_1055)
+
+struct offsets_state *offsets_state_new(void);
 
 void init_offsets();
 uint16_t get_offset(int pos);
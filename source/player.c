@@ -15,7 +15,9 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 
+#include "context.h"
 #include "player.h"
 
 // Much of the source of this material comes from the following blog:
@@ -268,10 +270,21 @@ struct player_record {
 //
 // This is character data. A Dragon Wars party can be 7 people.
 // Each character uses 512 bytes (0x200) so 512 * 7 = 0xE00
-static unsigned char data_C960[0xE00] = { 0 };
+//
+// There's one per engine context.
+struct player_state {
+  unsigned char data_C960[0xE00];
+};
+
+#define data_C960 (dw_ctx->player->data_C960)
 
 #define SIZE_OF_PLAYER 512
 
+struct player_state *player_state_new(void)
+{
+  return calloc(1, sizeof(struct player_state));
+}
+
 unsigned char *get_player_data_base()
 {
   return data_C960;
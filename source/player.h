@@ -21,6 +21,8 @@
 extern "C" {
 #endif
 
+struct player_state *player_state_new(void);
+
 unsigned char *get_player_data_base();
 unsigned char *get_player_data(int player);
 
@@ -0,0 +1,275 @@
+/*
+ * Copyright (c) 2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+struct task {
+  pool_func fn;
+  void *arg;
+};
+
+// Ring of tasks, the owner works at the tail and thieves take the head.
+struct worker {
+  pthread_mutex_t lock;
+  struct task *tasks;
+  size_t cap;
+  size_t head;
+  size_t count;
+
+  pthread_t thread;
+  struct pool *pool;
+  int id;
+};
+
+struct pool {
+  struct worker *workers;
+  int nthreads;
+
+  // Guards pending, queued, next and stop. Idle workers sleep on work, pool_wait
+  // sleeps on done.
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  size_t pending; // submitted tasks that haven't finished.
+  size_t queued;  // pushed tasks no worker has claimed yet.
+  unsigned int next;
+  int stop;
+};
+
+static int
+worker_push(struct worker *w, pool_func fn, void *arg)
+{
+  pthread_mutex_lock(&w->lock);
+  if (w->count == w->cap) {
+    size_t cap = w->cap ? w->cap * 2 : 16;
+    struct task *tasks = malloc(cap * sizeof(struct task));
+
+    if (tasks == NULL) {
+      pthread_mutex_unlock(&w->lock);
+      return -1;
+    }
+    for (size_t i = 0; i < w->count; i++)
+      tasks[i] = w->tasks[(w->head + i) % w->cap];
+    free(w->tasks);
+    w->tasks = tasks;
+    w->cap = cap;
+    w->head = 0;
+  }
+  w->tasks[(w->head + w->count) % w->cap] = (struct task){ fn, arg };
+  w->count++;
+  pthread_mutex_unlock(&w->lock);
+  return 0;
+}
+
+// Own tasks are taken newest first.
+static int
+worker_pop(struct worker *w, struct task *t)
+{
+  int found = 0;
+
+  pthread_mutex_lock(&w->lock);
+  if (w->count > 0) {
+    w->count--;
+    *t = w->tasks[(w->head + w->count) % w->cap];
+    found = 1;
+  }
+  pthread_mutex_unlock(&w->lock);
+  return found;
+}
+
+// Other workers' tasks are taken oldest first.
+static int
+worker_steal(struct worker *w, struct task *t)
+{
+  int found = 0;
+
+  pthread_mutex_lock(&w->lock);
+  if (w->count > 0) {
+    *t = w->tasks[w->head];
+    w->head = (w->head + 1) % w->cap;
+    w->count--;
+    found = 1;
+  }
+  pthread_mutex_unlock(&w->lock);
+  return found;
+}
+
+static int
+find_task(struct worker *w, struct task *t)
+{
+  struct pool *p = w->pool;
+
+  if (worker_pop(w, t))
+    return 1;
+  for (int i = 1; i < p->nthreads; i++) {
+    if (worker_steal(&p->workers[(w->id + i) % p->nthreads], t))
+      return 1;
+  }
+  return 0;
+}
+
+static void *
+worker_main(void *arg)
+{
+  struct worker *w = arg;
+  struct pool *p = w->pool;
+  struct task t;
+
+  while (1) {
+    pthread_mutex_lock(&p->lock);
+    while (p->queued == 0 && !p->stop)
+      pthread_cond_wait(&p->work, &p->lock);
+    if (p->queued == 0 && p->stop) {
+      pthread_mutex_unlock(&p->lock);
+      break;
+    }
+    p->queued--;
+    pthread_mutex_unlock(&p->lock);
+
+    // There are at least as many tasks in the rings as claims, but another
+    // worker can take the one we'd find while a new one lands in a ring we
+    // already looked at.
+    while (!find_task(w, &t))
+      sched_yield();
+
+    t.fn(t.arg);
+
+    pthread_mutex_lock(&p->lock);
+    if (--p->pending == 0)
+      pthread_cond_broadcast(&p->done);
+    pthread_mutex_unlock(&p->lock);
+  }
+  return NULL;
+}
+
+struct pool *
+pool_new(int nthreads)
+{
+  struct pool *p;
+
+  if (nthreads <= 0) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = n > 0 ? n : 1;
+  }
+
+  p = calloc(1, sizeof(struct pool));
+  if (p == NULL)
+    return NULL;
+  p->workers = calloc(nthreads, sizeof(struct worker));
+  if (p->workers == NULL) {
+    free(p);
+    return NULL;
+  }
+
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->work, NULL);
+  pthread_cond_init(&p->done, NULL);
+
+  for (int i = 0; i < nthreads; i++) {
+    struct worker *w = &p->workers[i];
+
+    pthread_mutex_init(&w->lock, NULL);
+    w->pool = p;
+    w->id = i;
+    if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+      fprintf(stderr, "Failed to start pool thread.\n");
+      pthread_mutex_destroy(&w->lock);
+      break;
+    }
+    p->nthreads++;
+  }
+
+  if (p->nthreads == 0) {
+    pool_free(p);
+    return NULL;
+  }
+  return p;
+}
+
+int
+pool_threads(const struct pool *p)
+{
+  return p->nthreads;
+}
+
+int
+pool_submit(struct pool *p, pool_func fn, void *arg)
+{
+  struct worker *w;
+
+  // Pending before the push, a worker can run the task as soon as it's in
+  // the ring and its decrement must not come first. Queued only after, so
+  // a worker that claims it always finds a task.
+  pthread_mutex_lock(&p->lock);
+  w = &p->workers[p->next++ % p->nthreads];
+  p->pending++;
+  pthread_mutex_unlock(&p->lock);
+
+  if (worker_push(w, fn, arg) != 0) {
+    pthread_mutex_lock(&p->lock);
+    if (--p->pending == 0)
+      pthread_cond_broadcast(&p->done);
+    pthread_mutex_unlock(&p->lock);
+    return -1;
+  }
+
+  pthread_mutex_lock(&p->lock);
+  p->queued++;
+  pthread_cond_signal(&p->work);
+  pthread_mutex_unlock(&p->lock);
+  return 0;
+}
+
+void
+pool_wait(struct pool *p)
+{
+  pthread_mutex_lock(&p->lock);
+  while (p->pending != 0)
+    pthread_cond_wait(&p->done, &p->lock);
+  pthread_mutex_unlock(&p->lock);
+}
+
+void
+pool_free(struct pool *p)
+{
+  if (p == NULL)
+    return;
+
+  pthread_mutex_lock(&p->lock);
+  p->stop = 1;
+  pthread_cond_broadcast(&p->work);
+  pthread_mutex_unlock(&p->lock);
+
+  // Workers still running may try to steal from those that have stopped.
+  for (int i = 0; i < p->nthreads; i++)
+    pthread_join(p->workers[i].thread, NULL);
+  for (int i = 0; i < p->nthreads; i++) {
+    pthread_mutex_destroy(&p->workers[i].lock);
+    free(p->workers[i].tasks);
+  }
+
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->work);
+  pthread_cond_destroy(&p->done);
+  free(p->workers);
+  free(p);
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Work stealing thread pool.
+ *
+ * Every worker has its own queue of tasks. Tasks are handed out to the
+ * queues round robin, a worker runs its own tasks newest first and when
+ * it runs out it steals the oldest task of another worker. */
+
+#ifndef DW_POOL_H
+#define DW_POOL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void (*pool_func)(void *arg);
+
+struct pool;
+
+// nthreads <= 0 uses one worker per online CPU.
+struct pool *pool_new(int nthreads);
+int pool_threads(const struct pool *p);
+
+// Queues fn(arg) to run on one of the workers, returns 0 on success.
+int pool_submit(struct pool *p, pool_func fn, void *arg);
+
+// Waits until every task submitted so far has finished.
+void pool_wait(struct pool *p);
+
+// Waits for the queued tasks and stops the workers.
+void pool_free(struct pool *p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DW_POOL_H */
@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "profile.h"
+#include "trace.h"
+
+#define PROFILE_UNIT (TRACE_CLOCK_CYCLES ? "cycles" : "ns")
+
+// Distinct call sites remembered per op code, the rest are only counted.
+#define PROFILE_SITES 16
+
+struct call_site {
+  int tag;
+  uint16_t offset;
+  uint64_t count;
+};
+
+struct op_profile {
+  uint64_t count;
+  uint64_t ticks;
+  int nsites;
+  struct call_site sites[PROFILE_SITES];
+  uint64_t other_sites;
+};
+
+// Counters of one thread, so the games of dwbatch never share them. They
+// are added to totals when the thread exits.
+struct thread_profile {
+  struct op_profile ops[256];
+  int running_op;
+  uint64_t running_since;
+  struct thread_profile *prev, *next;
+};
+
+static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+static pthread_key_t profile_key;
+
+// Guards the list of live threads, totals and the op code names.
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct thread_profile *threads;
+static struct op_profile totals[256];
+static const char *const *op_names;
+static const char *const *op_addrs;
+
+static _Thread_local struct thread_profile *profile_self;
+
+static void
+add_call_site(struct op_profile *p, int tag, uint16_t offset, uint64_t n)
+{
+  for (int i = 0; i < p->nsites; i++) {
+    if (p->sites[i].tag == tag && p->sites[i].offset == offset) {
+      p->sites[i].count += n;
+      return;
+    }
+  }
+  if (p->nsites == PROFILE_SITES) {
+    p->other_sites += n;
+    return;
+  }
+  p->sites[p->nsites].tag = tag;
+  p->sites[p->nsites].offset = offset;
+  p->sites[p->nsites].count = n;
+  p->nsites++;
+}
+
+static void
+merge_ops(struct op_profile *dst, const struct op_profile *src)
+{
+  for (int op = 0; op < 256; op++) {
+    dst[op].count += src[op].count;
+    dst[op].ticks += src[op].ticks;
+    dst[op].other_sites += src[op].other_sites;
+    for (int i = 0; i < src[op].nsites; i++) {
+      add_call_site(&dst[op], src[op].sites[i].tag, src[op].sites[i].offset,
+          src[op].sites[i].count);
+    }
+  }
+}
+
+// Key destructor, runs as a thread that profiled exits.
+static void
+thread_exit(void *arg)
+{
+  struct thread_profile *tp = arg;
+
+  pthread_mutex_lock(&profile_lock);
+  merge_ops(totals, tp->ops);
+  if (tp->prev != NULL)
+    tp->prev->next = tp->next;
+  else
+    threads = tp->next;
+  if (tp->next != NULL)
+    tp->next->prev = tp->prev;
+  pthread_mutex_unlock(&profile_lock);
+
+  if (profile_self == tp)
+    profile_self = NULL;
+  free(tp);
+}
+
+static void
+register_exit(void)
+{
+  pthread_key_create(&profile_key, thread_exit);
+  atexit(profile_dump);
+}
+
+void
+profile_init(const char *const *names, const char *const *addrs)
+{
+  pthread_once(&exit_once, register_exit);
+
+  pthread_mutex_lock(&profile_lock);
+  op_names = names;
+  op_addrs = addrs;
+  pthread_mutex_unlock(&profile_lock);
+}
+
+static struct thread_profile *
+profile_attach(void)
+{
+  struct thread_profile *tp;
+
+  tp = calloc(1, sizeof(struct thread_profile));
+  if (tp == NULL)
+    return NULL;
+  tp->running_op = -1;
+
+  pthread_once(&exit_once, register_exit);
+  pthread_mutex_lock(&profile_lock);
+  tp->next = threads;
+  if (threads != NULL)
+    threads->prev = tp;
+  threads = tp;
+  pthread_mutex_unlock(&profile_lock);
+
+  pthread_setspecific(profile_key, tp);
+  profile_self = tp;
+  return tp;
+}
+
+void
+profile_op(uint8_t op, int tag, uint16_t offset)
+{
+  struct thread_profile *tp = profile_self;
+  uint64_t now = trace_ticks();
+
+  if (tp == NULL && (tp = profile_attach()) == NULL)
+    return;
+
+  if (tp->running_op != -1)
+    tp->ops[tp->running_op].ticks += now - tp->running_since;
+
+  tp->ops[op].count++;
+  add_call_site(&tp->ops[op], tag, offset, 1);
+
+  tp->running_op = op;
+  tp->running_since = now;
+}
+
+void
+profile_stop(void)
+{
+  struct thread_profile *tp = profile_self;
+
+  if (tp != NULL && tp->running_op != -1) {
+    tp->ops[tp->running_op].ticks += trace_ticks() - tp->running_since;
+    tp->running_op = -1;
+  }
+}
+
+void
+profile_dump(void)
+{
+  struct op_profile *ops;
+  const char *fname;
+  FILE *fp;
+
+  // Charge the op code that was running when we exited.
+  profile_stop();
+
+  // Threads still running are added as they are now.
+  ops = calloc(256, sizeof(struct op_profile));
+  if (ops == NULL) {
+    fprintf(stderr, "Failed to allocate VM profile.\n");
+    return;
+  }
+  pthread_mutex_lock(&profile_lock);
+  merge_ops(ops, totals);
+  for (struct thread_profile *tp = threads; tp != NULL; tp = tp->next)
+    merge_ops(ops, tp->ops);
+  pthread_mutex_unlock(&profile_lock);
+
+  fname = getenv("DW_PROFILE");
+  if (fname == NULL)
+    fname = "vm_profile.csv";
+
+  fp = fopen(fname, "w");
+  if (fp == NULL) {
+    fprintf(stderr, "Failed to write VM profile to %s\n", fname);
+    free(ops);
+    return;
+  }
+
+  fprintf(fp, "op,address,handler,count,%s,%s_per_op,call_sites\n",
+      PROFILE_UNIT, PROFILE_UNIT);
+  for (int op = 0; op < 256; op++) {
+    const struct op_profile *p = &ops[op];
+    const char *name = op_names != NULL ? op_names[op] : NULL;
+
+    if (p->count == 0)
+      continue;
+
+    fprintf(fp, "0x%02X,%s,%s,%llu,%llu,%llu,\"", op,
+        op_addrs != NULL ? op_addrs[op] : "",
+        name != NULL ? name : "(unhandled)",
+        (unsigned long long)p->count, (unsigned long long)p->ticks,
+        (unsigned long long)(p->ticks / p->count));
+
+    // Call sites are written as tag:offset=count.
+    for (int i = 0; i < p->nsites; i++) {
+      fprintf(fp, "%s0x%02X:0x%04X=%llu", i > 0 ? " " : "",
+          p->sites[i].tag, p->sites[i].offset,
+          (unsigned long long)p->sites[i].count);
+    }
+    if (p->other_sites != 0)
+      fprintf(fp, " other=%llu", (unsigned long long)p->other_sites);
+    fprintf(fp, "\"\n");
+  }
+
+  fclose(fp);
+  free(ops);
+}
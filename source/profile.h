@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Per op code execution profile of the script VM.
+ *
+ * Built in with VM_PROFILE=1. Every op code that the VM starts is counted
+ * together with the script location it was fetched from, and the time up
+ * to the next op code is charged to it. The histogram is written as CSV
+ * when the program exits (including the exit on an unhandled op code). */
+
+#ifndef DW_PROFILE_H
+#define DW_PROFILE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// names and addrs are indexed by op code, names[op] is NULL for op codes
+// without a handler.
+void profile_init(const char *const *names, const char *const *addrs);
+
+// Called as op code "op" starts running from tag:offset.
+void profile_op(uint8_t op, int tag, uint16_t offset);
+
+// Charges the running op code, call when the VM stops.
+void profile_stop(void);
+
+// Writes the histogram, done automatically at exit.
+void profile_dump(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DW_PROFILE_H */
@@ -14,86 +14,380 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "bufio.h"
 #include "compress.h"
+#include "context.h"
+#include "decode.h"
 #include <resource.h>
 #include "player.h"
+#include "pool.h"
+#include "text.h"
+#include "trace.h"
 #include "ui.h"
 
 /* Only deals with data1 */
 /* I'm not sure yet how data2 is used */
 
-// 0xBC52
-static unsigned char data1_hdr[768];
-static struct buf_rdr *header_rdr = NULL;
+// 0xBC52, the section lengths at the start of data1.
+#define DATA1_HEADER_SIZE 768
+
+#define NUM_ALLOCATIONS 128
+
+// Tags below this are data1 sections, there's at most one slot per section
+// (resource_load checks the cache first). Other allocations use 0xFFFF.
+#define NUM_SECTION_TAGS 256
+
+// A section being read and decompressed by a worker for
+// resource_load_async. The worker only fills in bytes and len, the slot is
+// taken on the game's thread when the request completes.
+enum {
+  REQUEST_IDLE,
+  REQUEST_RUNNING,  // queued or running on a worker.
+  REQUEST_DONE,     // bytes (or NULL on errors) ready to be adopted.
+};
+
+struct resource_request {
+  int state;
+  enum resource_section sec;
+  unsigned char *bytes;
+  size_t len;
+  resource_callback callback;
+  void *arg;
+};
+
+// Resources of one game, there's one per engine context.
+struct resource_state {
+  struct resource allocations[NUM_ALLOCATIONS];
+
+  // Slot of each loaded section, -1 if it isn't loaded.
+  int16_t tag_slots[NUM_SECTION_TAGS];
+  // Bit i is set while allocations[i] is free.
+  uint64_t free_slots[NUM_ALLOCATIONS / 64];
+
+  // Least recently used purgeable slots (usage_type 2) are evicted when
+  // the cache runs out of slots or goes over budget (0 is no limit).
+  uint64_t last_use[NUM_ALLOCATIONS];
+  uint64_t use_clock;
+  struct resource_cache_stats stats;
+
+  // Loads started by resource_load_async, by section.
+  struct resource_request requests[NUM_SECTION_TAGS];
+  int requests_pending;
+
+  struct text_cache *com_text;
+
+  unsigned char *ptr3; // 0x313E
+};
+
+#define allocations (dw_ctx->resource->allocations)
+#define tag_slots (dw_ctx->resource->tag_slots)
+#define free_slots (dw_ctx->resource->free_slots)
+#define last_use (dw_ctx->resource->last_use)
+#define use_clock (dw_ctx->resource->use_clock)
+#define cache_stats (dw_ctx->resource->stats)
+#define requests (dw_ctx->resource->requests)
+#define requests_pending (dw_ctx->resource->requests_pending)
+#define com_text (dw_ctx->resource->com_text)
+#define ptr3 (dw_ctx->resource->ptr3)
 
-static struct resource allocations[128] = { 0 };
 static struct resource *resource_load_cache_miss(enum resource_section sec);
 
-static unsigned char *ptr3; // 0x313E
+// Decompressed sections shared read only by every context, see
+// resource_store_load.
+struct shared_section {
+  unsigned char *bytes;
+  size_t len;
+};
+
+static struct shared_section *shared_sections;
+
+// data1 and dragon.com, mapped read only by resource_open for every
+// context to share.
+static struct file_view data1_file;
+static struct file_view com_file;
+
+// Where every section of data1 is, built from its header by resource_open.
+static struct resource_dir_entry directory[RESOURCE_MAX];
+
+// File of decompressed sections named by $DW_SECTION_CACHE, written by
+// resource_open when it is missing or data1 has changed. Layout (host byte
+// order): the header, RESOURCE_MAX entries, then the sections.
+#define SECTION_CACHE_MAGIC "DWSECT"
+#define SECTION_CACHE_VERSION 1
+
+struct section_cache_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t nsections;
+  uint64_t data1_hash; // FNV-1a of the whole data1 file.
+};
+
+struct section_cache_entry {
+  uint32_t offset; // 0 for sections that aren't cached.
+  uint32_t len;
+};
+
+static struct file_view cache_file;
+static const struct section_cache_entry *cache_toc;
+
+// Strings of data1 indexed by dwstrings, named by $DW_TEXT_INDEX.
+static struct file_view text_index_file;
+
+// Workers for resource_load_async, started by the first request. Finished
+// requests are announced on request_done, waiters check their own request
+// under request_lock.
+static struct pool *load_pool;
+static pthread_mutex_t request_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t request_done = PTHREAD_COND_INITIALIZER;
+
+// Sections read ahead by resource_prefetch for the next cache miss to take,
+// guarded by request_lock. prefetch_bytes counts the running ones too.
+#define PREFETCH_BUDGET 0
+
+enum {
+  PREFETCH_NONE,
+  PREFETCH_RUNNING,
+  PREFETCH_DONE
+};
+
+struct prefetched_section {
+  int state;
+  unsigned char *bytes;
+  size_t len;
+  uint64_t stamp; // Order of completion, the oldest are dropped first.
+  resource_prefetch_func then;
+};
+
+static struct prefetched_section prefetched[RESOURCE_MAX];
+static size_t prefetch_bytes;
+static size_t prefetch_budget = PREFETCH_BUDGET;
+static uint64_t prefetch_clock;
 
 #ifndef nitems
 #define nitems(_a) (sizeof((_a)) / sizeof((_a)[0]))
 #endif /* nitems */
 
 static int
-load_data1_header(void)
+map_file(const char *fname, struct file_view *view)
 {
-  FILE *fp;
-  size_t n;
-  int rc = -1;
+  struct stat st;
+  void *p;
+  int fd;
 
-  fp = fopen("data1", "rb");
-  if (fp == NULL) {
-    fprintf(stderr, "Failed to open data1 file.\n");
+  fd = open(fname, O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to open %s file.\n", fname);
     return -1;
   }
 
-  n = fread(data1_hdr, 1, sizeof(data1_hdr), fp);
-  if (n != sizeof(data1_hdr)) {
+  if (fstat(fd, &st) == -1 || st.st_size == 0) {
+    fprintf(stderr, "Failed to get size of %s file.\n", fname);
+    close(fd);
+    return -1;
+  }
+
+  p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "Failed to map %s file.\n", fname);
+    return -1;
+  }
+
+  view->bytes = p;
+  view->len = st.st_size;
+  return 0;
+}
+
+static void
+unmap_file(struct file_view *view)
+{
+  if (view->bytes != NULL)
+    munmap((void *)view->bytes, view->len);
+  view->bytes = NULL;
+  view->len = 0;
+}
+
+// Sums up the section lengths of the data1 header so that finding a
+// section needs no scan of the header.
+static int
+build_directory(const struct file_view *d1)
+{
+  size_t offset = DATA1_HEADER_SIZE;
+  struct buf_rdr hdr;
+
+  memset(directory, 0, sizeof(directory));
+  if (d1->len < DATA1_HEADER_SIZE) {
     fprintf(stderr, "Failed to read data1 header bytes.\n");
-    goto done;
+    return -1;
+  }
+
+  buf_rdr_open(&hdr, d1->bytes, DATA1_HEADER_SIZE);
+  for (int sec = 0; sec < RESOURCE_MAX; sec++) {
+    struct resource_dir_entry *e = &directory[sec];
+    uint16_t len = buf_get16le(&hdr);
+
+    // Missing section.
+    if (len >= 0xFF00)
+      continue;
+
+    if (offset + len > d1->len) {
+      fprintf(stderr, "Section 0x%02X is past the end of data1 file.\n", sec);
+    } else if (sec > 0x17 && len < 2) {
+      fprintf(stderr, "Section 0x%02X is too short.\n", sec);
+    } else {
+      e->offset = offset;
+      e->stored_len = len;
+      e->is_compressed = sec > 0x17;
+      if (e->is_compressed)
+        e->uncompressed_len = d1->bytes[offset] | (d1->bytes[offset + 1] << 8);
+      else
+        e->uncompressed_len = len;
+    }
+    offset += len;
   }
+  return 0;
+}
+
+const struct resource_dir_entry *
+resource_dir_lookup(enum resource_section sec)
+{
+  if (sec >= RESOURCE_MAX || directory[sec].offset == 0)
+    return NULL;
+  return &directory[sec];
+}
+
+struct resource_state *
+resource_state_new(void)
+{
+  return calloc(1, sizeof(struct resource_state));
+}
+
+// Changes the usage type of a slot, keeping the free slots, the section
+// index and the cache size up to date.
+static void
+set_slot_usage(struct resource *a, int usage_type)
+{
+  int i = a->index;
+  uint64_t bit = 1ULL << (i % 64);
 
-  if ((header_rdr = buf_rdr_init(data1_hdr, sizeof(data1_hdr))) == NULL) {
-    fprintf(stderr, "Failed to create header reader.\n");
-    goto done;
+  if (usage_type == 0) {
+    free_slots[i / 64] |= bit;
+    if ((unsigned int)a->tag < NUM_SECTION_TAGS && tag_slots[a->tag] == i)
+      tag_slots[a->tag] = -1;
+    if (a->usage_type != 0 && a->usage_type != 0xFF)
+      cache_stats.bytes -= a->len;
+  } else {
+    free_slots[i / 64] &= ~bit;
+    if ((unsigned int)a->tag < NUM_SECTION_TAGS && tag_slots[a->tag] == -1)
+      tag_slots[a->tag] = i;
+    if (a->usage_type == 0 && usage_type != 0xFF)
+      cache_stats.bytes += a->len;
   }
+  a->usage_type = usage_type;
+}
 
-  rc = 0;
-done:
-  fclose(fp);
-  return rc;
+static void
+touch_slot(int index)
+{
+  last_use[index] = ++use_clock;
 }
 
-/* 0x1348 */
-struct resource* game_memory_alloc(size_t nbytes, int marker, int tag)
+static void
+free_slot(struct resource *a)
+{
+  set_slot_usage(a, 0);
+  free(a->bytes);
+  a->bytes = NULL;
+  decode_free(a->decoded);
+  a->decoded = NULL;
+  text_cache_free(a->text);
+  a->text = NULL;
+}
+
+// Evicts the least recently used purgeable slot, returns 0 if there was
+// none.
+static int
+cache_evict_one(void)
+{
+  struct resource *victim = NULL;
+
+  for (int i = 2; i < nitems(allocations); i++) {
+    struct resource *a = &allocations[i];
+
+    if (a->usage_type != 2)
+      continue;
+    if (victim == NULL || last_use[i] < last_use[victim->index])
+      victim = a;
+  }
+
+  if (victim == NULL)
+    return 0;
+
+  TRACE(CACHE_EVICT, victim->index, victim->tag, victim->len);
+  free_slot(victim);
+  cache_stats.evictions++;
+  return 1;
+}
+
+// Stores bytes (allocated with malloc) in the lowest free slot, evicting
+// purgeable slots to stay within the budget.
+static struct resource *
+game_memory_adopt(unsigned char *bytes, size_t nbytes, int marker, int tag)
 {
-  int i;
   struct resource *a;
+  int w;
 
-  for (i = 0; i < nitems(allocations); i++) {
-    a = &allocations[i];
-    if (a->usage_type == 0) {
-      break;
+  if (cache_stats.budget != 0) {
+    while (cache_stats.bytes + nbytes > cache_stats.budget) {
+      if (!cache_evict_one())
+        break;
     }
   }
 
-  if (i == nitems(allocations))
-    return NULL;
+  do {
+    for (w = 0; w < nitems(free_slots); w++) {
+      if (free_slots[w] != 0)
+        break;
+    }
+  } while (w == nitems(free_slots) && cache_evict_one());
 
-  a = &allocations[i];
-  a->bytes = malloc(nbytes);
-  if (a->bytes == NULL)
+  if (w == nitems(free_slots)) {
+    fprintf(stderr, "Out of resource slots.\n");
     return NULL;
+  }
 
-  a->usage_type = marker;
+  a = &allocations[w * 64 + __builtin_ctzll(free_slots[w])];
+  a->bytes = bytes;
   a->len = nbytes;
   a->tag = tag;
+  set_slot_usage(a, marker);
+  touch_slot(a->index);
+
+  return a;
+}
+
+/* 0x1348 */
+struct resource* game_memory_alloc(size_t nbytes, int marker, int tag)
+{
+  struct resource *a;
+  unsigned char *bytes;
+
+  bytes = malloc(nbytes);
+  if (bytes == NULL)
+    return NULL;
 
+  a = game_memory_adopt(bytes, nbytes, marker, tag);
+  if (a == NULL)
+    free(bytes);
   return a;
 }
 
@@ -102,9 +396,18 @@ struct resource* game_memory_alloc(size_t nbytes, int marker, int tag)
 int find_index_by_tag(int tag)
 {
   int i;
+
+  if ((unsigned int)tag < NUM_SECTION_TAGS) {
+    i = tag_slots[tag];
+    if (i != -1)
+      touch_slot(i);
+    return i;
+  }
+
   for (i = 0; i < nitems(allocations); i++) {
     struct resource *a = &allocations[i];
     if (a->tag == tag && a->usage_type != 0) {
+      touch_slot(i);
       return i;
     }
   }
@@ -116,40 +419,63 @@ int find_index_by_tag(int tag)
 int
 rm_init(void)
 {
+  const char *budget;
+
   /* First two entries are some unknown data in the COM file, I think,
    * but I'm not sure how they are used.
    * For now we just load unknown_data and hope they aren't used. */
+  for (int i = 0; i < nitems(allocations); i++) {
+    allocations[i].index = i;
+  }
+  memset(free_slots, 0xFF, sizeof(free_slots));
+  for (int i = 0; i < nitems(tag_slots); i++) {
+    tag_slots[i] = -1;
+  }
+
   allocations[0].bytes = get_player_data_base();
   allocations[0].tag = 0xFFFF;
-  allocations[0].usage_type = 0xFF;
   allocations[0].len = 1;
+  set_slot_usage(&allocations[0], 0xFF);
 
   allocations[1].bytes = get_player_data_base();
   allocations[1].tag = 0xFFFF;
-  allocations[1].usage_type = 0xFF;
   allocations[1].len = 0x0E00;
+  set_slot_usage(&allocations[1], 0xFF);
 
-  for (int i = 0; i < nitems(allocations); i++) {
-    allocations[i].index = i;
-  }
+  budget = getenv("DW_CACHE_BUDGET");
+  if (budget != NULL)
+    cache_stats.budget = strtoul(budget, NULL, 0);
 
   // first allocation will be saved at 0x02.
-  return load_data1_header();
+  if (data1_file.bytes == NULL) {
+    fprintf(stderr, "Game files are not open.\n");
+    return -1;
+  }
+  return 0;
 }
 
 void
 rm_exit(void)
 {
-  if (header_rdr != NULL) {
-    buf_rdr_free(header_rdr);
-  }
+  // Workers may still write to the requests.
+  resource_cancel_all();
+
+  free(ptr3);
+  ptr3 = NULL;
 
   // Clean up resource cache.
   for (int i = 0; i < nitems(allocations); i++) {
-    if (allocations[i].bytes != NULL && allocations[i].usage_type == 1) {
+    if (allocations[i].bytes != NULL && (allocations[i].usage_type == 1 ||
+          allocations[i].usage_type == 2)) {
       free(allocations[i].bytes);
     }
+    decode_free(allocations[i].decoded);
+    allocations[i].decoded = NULL;
+    text_cache_free(allocations[i].text);
+    allocations[i].text = NULL;
   }
+  text_cache_free(com_text);
+  com_text = NULL;
 }
 
 // Essentially 0x2EB0 but not exactly.
@@ -165,10 +491,16 @@ struct resource* resource_load(enum resource_section sec)
   // Check cache.
   int index = find_index_by_tag(sec);
   if (index != -1) {
+    // Loading a purgeable resource makes it resident again (the marker in
+    // AL).
+    if (allocations[index].usage_type == 2)
+      set_slot_usage(&allocations[index], 1);
+    cache_stats.hits++;
     return &allocations[index];
   }
 
   // Not found.
+  cache_stats.misses++;
   return resource_load_cache_miss(sec);
 }
 
@@ -187,9 +519,7 @@ void resource_index_release(int index)
   if (index < 2)
     return;
 
-  allocations[index].usage_type = 0;
-  free(allocations[index].bytes);
-  allocations[index].bytes = NULL;
+  free_slot(&allocations[index]);
 }
 
 // 0x1297
@@ -201,77 +531,687 @@ void resource_set_usage_type(int index, int usage_type)
   if (index < 2)
     return;
 
-  allocations[index].usage_type = usage_type;
+  set_slot_usage(&allocations[index], usage_type);
 }
 
-static struct resource *
-resource_load_cache_miss(enum resource_section sec)
+void
+resource_cache_set_budget(size_t bytes)
 {
-  int i;
-  unsigned int offset = sizeof(data1_hdr);
-  FILE *fp;
-  size_t n;
-  uint16_t len;
-  int needs_decompression = 0;
-
-  buf_reset(header_rdr);
-  for (i = 0; i < sec; i++) {
-    uint16_t header_val = buf_get16le(header_rdr);
-    if (header_val < 0xFF00) {
-      offset += header_val;
+  cache_stats.budget = bytes;
+}
+
+void
+resource_cache_get_stats(struct resource_cache_stats *st)
+{
+  *st = cache_stats;
+}
+
+// Called after the VM writes into a resource so that any decoded script
+// instructions covering those bytes are decoded again.
+void resource_note_write(int index, size_t offset, size_t n)
+{
+  struct decoded_script *ds = allocations[index].decoded;
+
+  if (ds != NULL)
+    decode_invalidate(ds, offset, n);
+}
+
+// Makes a writable copy of section sec of data1, decompressing it if
+// needed.
+unsigned char *
+resource_read_section(enum resource_section sec, size_t *lenp)
+{
+  const struct resource_dir_entry *e;
+  struct file_view stored;
+  size_t len;
+  unsigned char *bytes;
+
+  if ((e = resource_dir_lookup(sec)) == NULL) {
+    fprintf(stderr, "Failed to find section 0x%02X in data1 file.\n", sec);
+    return NULL;
+  }
+  stored.bytes = data1_file.bytes + e->offset;
+  stored.len = e->stored_len;
+  TRACE(SECTION_LOAD, sec, e->offset, e->stored_len);
+
+  if (cache_toc != NULL && cache_toc[sec].offset != 0) {
+    len = cache_toc[sec].len;
+    TRACE(SECTION_CACHED, sec, len);
+    bytes = malloc(len);
+    if (bytes == NULL)
+      return NULL;
+    memcpy(bytes, cache_file.bytes + cache_toc[sec].offset, len);
+  } else if (e->is_compressed) {
+    struct data1_decoder dec;
+
+    len = e->uncompressed_len;
+    TRACE(SECTION_DECOMPRESS, sec, stored.len, len);
+    bytes = malloc(len);
+    if (bytes == NULL)
+      return NULL;
+
+    // Decode straight into the resource.
+    data1_decoder_init(&dec, bytes, len);
+    data1_decoder_feed(&dec, stored.bytes, stored.len);
+    if (data1_decoder_finish(&dec) != DATA1_OK) {
+      fprintf(stderr, "Failed to decompress section 0x%02X.\n", sec);
+      free(bytes);
+      return NULL;
     }
+  } else {
+    len = stored.len;
+    bytes = malloc(len);
+    if (bytes == NULL)
+      return NULL;
+    memcpy(bytes, stored.bytes, len);
+  }
+
+  *lenp = len;
+  return bytes;
+}
+
+int
+data1_view(enum resource_section sec, struct file_view *view)
+{
+  const struct resource_dir_entry *e = resource_dir_lookup(sec);
+
+  if (e == NULL)
+    return -1;
+  view->bytes = data1_file.bytes + e->offset;
+  view->len = e->stored_len;
+  return 0;
+}
+
+// Takes the prefetched bytes of sec, waiting for a prefetch that's still
+// running if asked to. Returns NULL if sec wasn't prefetched.
+static unsigned char *
+take_prefetched(enum resource_section sec, size_t *lenp, int wait)
+{
+  struct prefetched_section *p = &prefetched[sec];
+  unsigned char *bytes = NULL;
+
+  pthread_mutex_lock(&request_lock);
+  while (wait && p->state == PREFETCH_RUNNING)
+    pthread_cond_wait(&request_done, &request_lock);
+  if (p->state == PREFETCH_DONE) {
+    bytes = p->bytes;
+    *lenp = p->len;
+    prefetch_bytes -= p->len;
+    p->bytes = NULL;
+    p->state = PREFETCH_NONE;
   }
-  len = buf_get16le(header_rdr);
-  printf("Section (0x%02x), Offset: 0x%04x Size: 0x%04x\n", sec, offset,
-    (unsigned int)len);
+  pthread_mutex_unlock(&request_lock);
+  return bytes;
+}
+
+static struct resource *
+resource_load_cache_miss(enum resource_section sec)
+{
+  struct resource *res;
+  unsigned char *bytes;
+  size_t len;
 
-  struct resource* res = game_memory_alloc(len, 1, sec);
-  if (sec > 0x17) {
-    needs_decompression = 1;
+  // The VM writes into resources so each game gets its own copy.
+  if (shared_sections != NULL && shared_sections[sec].bytes != NULL) {
+    res = game_memory_alloc(shared_sections[sec].len, 1, sec);
+    if (res != NULL)
+      memcpy(res->bytes, shared_sections[sec].bytes, res->len);
+    return res;
   }
 
-  fp = fopen("data1", "rb");
-  if (fp == NULL) {
-    fprintf(stderr, "Failed to open data1 file.\n");
+  bytes = take_prefetched(sec, &len, 1);
+  if (bytes != NULL) {
+    TRACE(PREFETCH_HIT, sec, len);
+    cache_stats.prefetched++;
+  } else {
+    bytes = resource_read_section(sec, &len);
+  }
+  if (bytes == NULL)
     return NULL;
+
+  res = game_memory_adopt(bytes, len, 1, sec);
+  if (res == NULL)
+    free(bytes);
+  return res;
+}
+
+static int
+request_state(const struct resource_request *req)
+{
+  int state;
+
+  pthread_mutex_lock(&request_lock);
+  state = req->state;
+  pthread_mutex_unlock(&request_lock);
+  return state;
+}
+
+static void
+wait_request(const struct resource_request *req)
+{
+  pthread_mutex_lock(&request_lock);
+  while (req->state != REQUEST_DONE)
+    pthread_cond_wait(&request_done, &request_lock);
+  pthread_mutex_unlock(&request_lock);
+}
+
+static void
+load_request(void *arg)
+{
+  struct resource_request *req = arg;
+  unsigned char *bytes;
+  size_t len;
+
+  // Waiting for a prefetch could tie up every worker.
+  bytes = take_prefetched(req->sec, &len, 0);
+  if (bytes == NULL)
+    bytes = resource_read_section(req->sec, &len);
+
+  pthread_mutex_lock(&request_lock);
+  req->bytes = bytes;
+  req->len = len;
+  req->state = REQUEST_DONE;
+  pthread_cond_broadcast(&request_done);
+  pthread_mutex_unlock(&request_lock);
+}
+
+int
+resource_load_async(enum resource_section sec, resource_callback callback,
+    void *arg)
+{
+  struct resource_request *req;
+  struct pool *pool;
+
+  if (sec >= RESOURCE_MAX) {
+    fprintf(stderr, "Attempted to load unknown resource 0x%02X.\n", sec);
+    return -1;
   }
 
-  fseek(fp, offset, SEEK_SET);
-  n = fread(res->bytes, 1, res->len, fp);
-  if (n != res->len) {
-    fprintf(stderr, "Failed to read section in data1 file.\n");
-    free(res->bytes);
-    free(res);
-    fclose(fp);
-    return NULL;
+  req = &requests[sec];
+  if (request_state(req) != REQUEST_IDLE) {
+    // Already on its way, there's room for one callback.
+    if (callback == NULL)
+      return 0;
+    if (req->callback != NULL)
+      return -1;
+    req->callback = callback;
+    req->arg = arg;
+    return 0;
   }
-  fclose(fp);
 
-  if (needs_decompression) {
-    struct buf_rdr *compression_rdr;
-    struct buf_wri *uncompressed_wri;
-    unsigned short uncompressed_sz;
+  req->sec = sec;
+  req->bytes = NULL;
+  req->len = 0;
+  req->callback = callback;
+  req->arg = arg;
+  requests_pending++;
+
+  // Cached, shared or missing sections need no worker, resource_load deals
+  // with them when the request completes.
+  if (find_index_by_tag(sec) != -1 || resource_dir_lookup(sec) == NULL ||
+      (shared_sections != NULL && shared_sections[sec].bytes != NULL)) {
+    req->state = REQUEST_DONE;
+    return 0;
+  }
 
-    compression_rdr = buf_rdr_init(res->bytes, res->len);
-    uncompressed_sz = buf_get16le(compression_rdr);
-    printf("Section 0x%02X needs decompression. %d -> %d\n", sec,
-        (unsigned int)res->len, uncompressed_sz);
-    uncompressed_wri = buf_wri_init(uncompressed_sz);
-    decompress_data1(compression_rdr, uncompressed_wri, uncompressed_sz);
+  pthread_mutex_lock(&request_lock);
+  if (load_pool == NULL)
+    load_pool = pool_new(0);
+  pool = load_pool;
+  req->state = REQUEST_RUNNING;
+  pthread_mutex_unlock(&request_lock);
+
+  if (pool == NULL || pool_submit(pool, load_request, req) != 0)
+    req->state = REQUEST_DONE;
+  return 0;
+}
+
+// Takes the slot for a finished request and runs its callback.
+static struct resource *
+complete_request(struct resource_request *req)
+{
+  resource_callback callback = req->callback;
+  void *arg = req->arg;
+  struct resource *res = NULL;
 
-    // After decompressing we can get rid of the compressed copy, and store the
-    // data directly in the resource.
-    free(res->bytes);
-    res->len = uncompressed_sz;
-    // move pointer.
-    res->bytes = uncompressed_wri->base;
-    free(uncompressed_wri);
-    buf_rdr_free(compression_rdr);
+  // A plain resource_load may have beaten the worker to it.
+  if (req->bytes != NULL && find_index_by_tag(req->sec) == -1) {
+    cache_stats.misses++;
+    res = game_memory_adopt(req->bytes, req->len, 1, req->sec);
+    if (res == NULL)
+      free(req->bytes);
+  } else {
+    free(req->bytes);
+    res = resource_load(req->sec);
   }
 
+  req->state = REQUEST_IDLE;
+  req->bytes = NULL;
+  req->callback = NULL;
+  requests_pending--;
+
+  if (callback != NULL)
+    callback(res, arg);
   return res;
 }
 
+struct resource *
+resource_wait(enum resource_section sec)
+{
+  if (sec >= RESOURCE_MAX || request_state(&requests[sec]) == REQUEST_IDLE)
+    return resource_load(sec);
+
+  wait_request(&requests[sec]);
+  return complete_request(&requests[sec]);
+}
+
+static void
+cancel_request(struct resource_request *req)
+{
+  if (request_state(req) == REQUEST_IDLE)
+    return;
+
+  wait_request(req);
+  free(req->bytes);
+  req->bytes = NULL;
+  req->callback = NULL;
+  req->state = REQUEST_IDLE;
+  requests_pending--;
+}
+
+void
+resource_cancel(enum resource_section sec)
+{
+  if (sec < RESOURCE_MAX)
+    cancel_request(&requests[sec]);
+}
+
+void
+resource_cancel_all(void)
+{
+  for (int sec = 0; sec < RESOURCE_MAX && requests_pending > 0; sec++)
+    cancel_request(&requests[sec]);
+}
+
+// Drops the oldest finished prefetch, returns 0 if there was none. Called
+// with request_lock held.
+static int
+prefetch_evict_one(void)
+{
+  struct prefetched_section *victim = NULL;
+
+  for (int sec = 0; sec < RESOURCE_MAX; sec++) {
+    struct prefetched_section *p = &prefetched[sec];
+
+    if (p->state != PREFETCH_DONE)
+      continue;
+    if (victim == NULL || p->stamp < victim->stamp)
+      victim = p;
+  }
+
+  if (victim == NULL)
+    return 0;
+
+  prefetch_bytes -= victim->len;
+  free(victim->bytes);
+  victim->bytes = NULL;
+  victim->state = PREFETCH_NONE;
+  return 1;
+}
+
+static void
+prefetch_section(void *arg)
+{
+  struct prefetched_section *p = arg;
+  enum resource_section sec = p - prefetched;
+  unsigned char *bytes;
+  size_t len;
+
+  // Nobody else can see the bytes until the section is done.
+  bytes = resource_read_section(sec, &len);
+  if (bytes != NULL && p->then != NULL)
+    p->then(sec, bytes, len);
+
+  pthread_mutex_lock(&request_lock);
+  p->then = NULL;
+  if (bytes != NULL) {
+    p->bytes = bytes;
+    p->state = PREFETCH_DONE;
+    p->stamp = ++prefetch_clock;
+  } else {
+    prefetch_bytes -= p->len;
+    p->state = PREFETCH_NONE;
+  }
+  pthread_cond_broadcast(&request_done);
+  pthread_mutex_unlock(&request_lock);
+}
+
+int
+resource_prefetch(enum resource_section sec, resource_prefetch_func then)
+{
+  const struct resource_dir_entry *e = resource_dir_lookup(sec);
+  struct prefetched_section *p;
+  struct pool *pool;
+  int index;
+
+  if (e == NULL || prefetch_budget == 0)
+    return -1;
+
+  // Already loaded by this game or shared by all of them.
+  index = dw_ctx != NULL ? tag_slots[sec] : -1;
+  if (index != -1) {
+    if (then != NULL)
+      then(sec, allocations[index].bytes, allocations[index].len);
+    return 0;
+  }
+  if (shared_sections != NULL && shared_sections[sec].bytes != NULL) {
+    if (then != NULL)
+      then(sec, shared_sections[sec].bytes, shared_sections[sec].len);
+    return 0;
+  }
+
+  pthread_mutex_lock(&request_lock);
+  p = &prefetched[sec];
+  if (p->state != PREFETCH_NONE) {
+    pthread_mutex_unlock(&request_lock);
+    return 0;
+  }
+
+  while (prefetch_bytes + e->uncompressed_len > prefetch_budget &&
+      prefetch_evict_one())
+    ;
+  if (prefetch_bytes + e->uncompressed_len > prefetch_budget) {
+    pthread_mutex_unlock(&request_lock);
+    return -1;
+  }
+
+  if (load_pool == NULL)
+    load_pool = pool_new(0);
+  pool = load_pool;
+  if (pool == NULL) {
+    pthread_mutex_unlock(&request_lock);
+    return -1;
+  }
+  p->state = PREFETCH_RUNNING;
+  p->len = e->uncompressed_len;
+  p->then = then;
+  prefetch_bytes += p->len;
+  pthread_mutex_unlock(&request_lock);
+
+  if (pool_submit(pool, prefetch_section, p) != 0) {
+    pthread_mutex_lock(&request_lock);
+    prefetch_bytes -= p->len;
+    p->then = NULL;
+    p->state = PREFETCH_NONE;
+    pthread_mutex_unlock(&request_lock);
+    return -1;
+  }
+  return 0;
+}
+
+uint64_t
+resource_hash(const void *bytes, size_t len)
+{
+  const unsigned char *p = bytes;
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  for (size_t i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+uint64_t
+resource_data1_hash(void)
+{
+  return resource_hash(data1_file.bytes, data1_file.len);
+}
+
+// Maps the section cache if it was written for this data1.
+static int
+map_section_cache(const char *fname, uint64_t hash)
+{
+  const struct section_cache_header *hdr;
+  size_t toc_end;
+
+  if (access(fname, R_OK) != 0 || map_file(fname, &cache_file) != 0)
+    return -1;
+
+  hdr = (const struct section_cache_header *)cache_file.bytes;
+  toc_end = sizeof(*hdr) + RESOURCE_MAX * sizeof(struct section_cache_entry);
+  if (cache_file.len < toc_end ||
+      memcmp(hdr->magic, SECTION_CACHE_MAGIC, sizeof(SECTION_CACHE_MAGIC)) ||
+      hdr->version != SECTION_CACHE_VERSION ||
+      hdr->nsections != RESOURCE_MAX || hdr->data1_hash != hash)
+    goto stale;
+
+  cache_toc = (const struct section_cache_entry *)(hdr + 1);
+  for (int sec = 0; sec < RESOURCE_MAX; sec++) {
+    const struct section_cache_entry *c = &cache_toc[sec];
+    const struct resource_dir_entry *e = resource_dir_lookup(sec);
+
+    if (c->offset == 0)
+      continue;
+    if (e == NULL || c->len != e->uncompressed_len || c->offset < toc_end ||
+        c->offset + (size_t)c->len > cache_file.len)
+      goto stale;
+  }
+  return 0;
+
+stale:
+  cache_toc = NULL;
+  unmap_file(&cache_file);
+  return -1;
+}
+
+// Decompresses every compressed section into a new cache file, written
+// under a temporary name first so that a cache is never seen half done.
+static int
+write_section_cache(const char *fname, uint64_t hash)
+{
+  struct section_cache_header hdr;
+  struct section_cache_entry toc[RESOURCE_MAX];
+  size_t offset = sizeof(hdr) + sizeof(toc);
+  char tmp[FILENAME_MAX];
+  int rc = 0;
+  FILE *fp;
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, SECTION_CACHE_MAGIC, sizeof(SECTION_CACHE_MAGIC));
+  hdr.version = SECTION_CACHE_VERSION;
+  hdr.nsections = RESOURCE_MAX;
+  hdr.data1_hash = hash;
+
+  memset(toc, 0, sizeof(toc));
+  for (int sec = 0; sec < RESOURCE_MAX; sec++) {
+    const struct resource_dir_entry *e = resource_dir_lookup(sec);
+
+    // Uncompressed sections are read from data1 as they are.
+    if (e == NULL || !e->is_compressed)
+      continue;
+    toc[sec].offset = offset;
+    toc[sec].len = e->uncompressed_len;
+    offset += e->uncompressed_len;
+  }
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", fname);
+  fp = fopen(tmp, "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "Failed to open section cache %s.\n", tmp);
+    return -1;
+  }
+  if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+      fwrite(toc, sizeof(toc), 1, fp) != 1)
+    rc = -1;
+
+  for (int sec = 0; sec < RESOURCE_MAX && rc == 0; sec++) {
+    unsigned char *bytes;
+    size_t len;
+
+    if (toc[sec].offset == 0)
+      continue;
+    bytes = resource_read_section(sec, &len);
+    if (bytes == NULL || fwrite(bytes, 1, len, fp) != len)
+      rc = -1;
+    free(bytes);
+  }
+
+  if (fclose(fp) != 0 || rc != 0 || rename(tmp, fname) != 0) {
+    fprintf(stderr, "Failed to write section cache %s.\n", fname);
+    remove(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+// With $DW_SECTION_CACHE set every section is read from the cache file
+// instead of being decompressed, the cache is (re)built when needed.
+static void
+open_section_cache(void)
+{
+  const char *fname = getenv("DW_SECTION_CACHE");
+  uint64_t hash;
+
+  if (fname == NULL || *fname == '\0')
+    return;
+
+  hash = resource_data1_hash();
+  if (map_section_cache(fname, hash) == 0)
+    return;
+  if (write_section_cache(fname, hash) == 0)
+    map_section_cache(fname, hash);
+}
+
+// The text caches take the strings in the index instead of decoding them.
+static void
+open_text_index(void)
+{
+  const char *fname = getenv("DW_TEXT_INDEX");
+  const struct text_index_header *hdr;
+
+  if (fname == NULL || *fname == '\0')
+    return;
+  if (map_file(fname, &text_index_file) != 0)
+    return;
+
+  hdr = (const struct text_index_header *)text_index_file.bytes;
+  if (text_index_file.len < sizeof(*hdr) ||
+      hdr->data1_hash != resource_data1_hash() ||
+      text_index_set(text_index_file.bytes, text_index_file.len) != 0) {
+    fprintf(stderr, "Text index %s doesn't match data1 file.\n", fname);
+    unmap_file(&text_index_file);
+  }
+}
+
+int
+resource_open_data1(const char *fname)
+{
+  if (map_file(fname, &data1_file) != 0)
+    return -1;
+  if (build_directory(&data1_file) != 0) {
+    unmap_file(&data1_file);
+    return -1;
+  }
+  return 0;
+}
+
+int
+resource_open(void)
+{
+  const char *budget;
+
+  if (resource_open_data1("data1") != 0)
+    return -1;
+  if (map_file("dragon.com", &com_file) != 0) {
+    unmap_file(&data1_file);
+    return -1;
+  }
+  open_section_cache();
+  open_text_index();
+
+  budget = getenv("DW_PREFETCH_BUDGET");
+  if (budget != NULL)
+    prefetch_budget = strtoul(budget, NULL, 0);
+  return 0;
+}
+
+void
+resource_close(void)
+{
+  pool_free(load_pool);
+  load_pool = NULL;
+
+  for (int sec = 0; sec < RESOURCE_MAX; sec++) {
+    free(prefetched[sec].bytes);
+    prefetched[sec].bytes = NULL;
+    prefetched[sec].state = PREFETCH_NONE;
+  }
+  prefetch_bytes = 0;
+
+  cache_toc = NULL;
+  unmap_file(&cache_file);
+  text_index_set(NULL, 0);
+  unmap_file(&text_index_file);
+  unmap_file(&data1_file);
+  unmap_file(&com_file);
+  memset(directory, 0, sizeof(directory));
+}
+
+static void
+load_shared_section(void *arg)
+{
+  struct shared_section *s = arg;
+
+  s->bytes = resource_read_section(s - shared_sections, &s->len);
+}
+
+int
+resource_store_load(struct pool *pool)
+{
+  if (shared_sections != NULL)
+    return 0;
+
+  shared_sections = calloc(RESOURCE_MAX, sizeof(struct shared_section));
+  if (shared_sections == NULL)
+    return -1;
+
+  // Every task fills in its own section, nothing else is shared.
+  for (int sec = 0; sec < RESOURCE_MAX; sec++) {
+    struct shared_section *s = &shared_sections[sec];
+
+    // Missing section.
+    if (resource_dir_lookup(sec) == NULL)
+      continue;
+
+    if (pool == NULL || pool_submit(pool, load_shared_section, s) != 0)
+      load_shared_section(s);
+  }
+  if (pool != NULL)
+    pool_wait(pool);
+
+  for (int sec = 0; sec < RESOURCE_MAX; sec++) {
+    if (resource_dir_lookup(sec) != NULL &&
+        shared_sections[sec].bytes == NULL) {
+      resource_store_free();
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void
+resource_store_free(void)
+{
+  if (shared_sections == NULL)
+    return;
+
+  for (int sec = 0; sec < RESOURCE_MAX; sec++)
+    free(shared_sections[sec].bytes);
+  free(shared_sections);
+  shared_sections = NULL;
+}
+
 /* The DOS COM executable format sets the origin by default at 0x100. So when
  * extracting from COM files we subtract this from the offset.
  *
@@ -279,33 +1219,49 @@ resource_load_cache_miss(enum resource_section sec)
  * file, so we extract them with this function. */
 
 #define COM_ORG_START 0x100
-unsigned char *com_extract(size_t off, size_t sz)
+const unsigned char *com_view(size_t off, size_t sz)
 {
-  unsigned char *ptr;
-  FILE *fp;
-
   if (off < COM_ORG_START) {
-    fprintf(stderr, "com_extract: Invalid offset specified, too low!\n");
+    fprintf(stderr, "com_view: Invalid offset specified, too low!\n");
     return NULL;
   }
   off -= COM_ORG_START;
 
-  fp = fopen("dragon.com", "rb");
-  if (fp == NULL)
+  if (off + sz > com_file.len) {
+    fprintf(stderr, "com_view: Failed to read %zu bytes from file.\n", sz);
     return NULL;
+  }
+  return com_file.bytes + off;
+}
 
-  ptr = malloc(sz);
-  if (ptr == NULL)
+size_t com_view_len(size_t off)
+{
+  if (off < COM_ORG_START || off - COM_ORG_START >= com_file.len)
+    return 0;
+  return com_file.len - (off - COM_ORG_START);
+}
+
+struct text_cache *com_text_cache(void)
+{
+  if (com_text == NULL)
+    com_text = text_cache_new(-1);
+  return com_text;
+}
+
+unsigned char *com_extract(size_t off, size_t sz)
+{
+  const unsigned char *src;
+  unsigned char *ptr;
+
+  src = com_view(off, sz);
+  if (src == NULL)
     return NULL;
 
-  fseek(fp, off, SEEK_SET);
-  if (fread(ptr, 1, sz, fp) != sz) {
-    fprintf(stderr, "com_extract: Failed to read %zu bytes from file.\n", sz);
-    free(ptr);
+  ptr = malloc(sz);
+  if (ptr == NULL)
     return NULL;
-  }
 
-  fclose(fp);
+  memcpy(ptr, src, sz);
   return ptr;
 }
 
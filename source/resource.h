@@ -22,6 +22,7 @@ extern "C" {
 #endif
 
 #include <stddef.h>
+#include <stdint.h>
 
 /* Resource file maps to "data1" and "data2" files. */
 enum resource_section {
@@ -36,6 +37,10 @@ enum resource_section {
   RESOURCE_MAX
 };
 
+struct decoded_script;
+struct pool;
+struct text_cache;
+
 struct resource {
   unsigned char *bytes;
   size_t len;
@@ -47,20 +52,129 @@ struct resource {
   int usage_type;
   int tag;
   int index;
+  // Decoded script instructions, built when the VM runs this resource.
+  struct decoded_script *decoded;
+  // Strings decoded from this resource.
+  struct text_cache *text;
+};
+
+// Read only view into a game file, valid until resource_close.
+struct file_view {
+  const unsigned char *bytes;
+  size_t len;
+};
+
+// Where a section is stored in data1.
+struct resource_dir_entry {
+  size_t offset;
+  size_t stored_len;
+  size_t uncompressed_len; // Same as stored_len when not compressed.
+  int is_compressed;
 };
 
+// Resource cache counters of the current game.
+struct resource_cache_stats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t prefetched; // Misses served by resource_prefetch.
+  size_t bytes;  // Held by loaded resources.
+  size_t budget; // 0 is no limit.
+};
+
+struct resource_state *resource_state_new(void);
+
+// Maps data1 and dragon.com for every game of the process, call before
+// rm_init and load_chr_table.
+int resource_open(void);
+void resource_close(void);
+// Maps only the data1 file fname, for tools that read its sections
+// without running a game. resource_close unmaps it.
+int resource_open_data1(const char *fname);
+
 int rm_init(void);
 void rm_exit(void);
 
 struct resource* resource_get_by_index(int index);
 void resource_index_release(int index);
 void resource_set_usage_type(int index, int usage_type);
+void resource_note_write(int index, size_t offset, size_t n);
+
+// Purgeable resources (usage type 2) are evicted, least recently used
+// first, to keep the cache under bytes. rm_init sets the budget from
+// $DW_CACHE_BUDGET.
+void resource_cache_set_budget(size_t bytes);
+void resource_cache_get_stats(struct resource_cache_stats *st);
 
 // 0x2EB0
 struct resource* resource_load(enum resource_section sec);
 
+// Called with the loaded resource (NULL on errors) when a request started
+// by resource_load_async completes.
+typedef void (*resource_callback)(struct resource *res, void *arg);
+
+// Starts reading and decompressing sec on a worker thread, callback may be
+// NULL. The resource is put in the cache and callback runs on the calling
+// thread, from resource_wait. Returns -1 if sec is unknown or already has a
+// callback.
+int resource_load_async(enum resource_section sec, resource_callback callback,
+    void *arg);
+
+// Completes the request for sec, waiting for it if needed, and returns the
+// resource. Without a request it's resource_load.
+struct resource *resource_wait(enum resource_section sec);
+
+// Waits for and drops the request for sec, its callback doesn't run.
+void resource_cancel(enum resource_section sec);
+// Waits for and drops every pending request, no callbacks run.
+void resource_cancel_all(void);
+
+// Called with the bytes of a section read by resource_prefetch before
+// anyone can take them, the bytes must not be kept or changed.
+typedef void (*resource_prefetch_func)(enum resource_section sec,
+    const unsigned char *bytes, size_t len);
+
+// Reads and decompresses sec on a worker thread ahead of time, the next
+// cache miss of any game takes the bytes. The prefetched sections are
+// limited to $DW_PREFETCH_BUDGET bytes (0, the default, turns prefetching
+// off), the oldest are dropped to make room. then (may be NULL) runs on the
+// worker, or right away if sec is already loaded. Returns -1 if sec is
+// unknown or doesn't fit.
+int resource_prefetch(enum resource_section sec, resource_prefetch_func then);
+
+// Loads every DATA1 section once into memory that all contexts share read
+// only, cache misses then copy from it instead of reading data1. With a
+// pool the sections are decompressed in parallel, one task per section.
+// Does nothing when the store is already loaded.
+int resource_store_load(struct pool *pool);
+void resource_store_free(void);
+
+// Location and sizes of a section, NULL if the section is missing.
+const struct resource_dir_entry *resource_dir_lookup(enum resource_section sec);
+
+// Stored bytes of a section, compressed for sections above 0x17. Returns
+// -1 if the section is missing.
+int data1_view(enum resource_section sec, struct file_view *view);
+// Malloc'd copy of a section, decompressed. NULL if the section is missing
+// or can't be decompressed.
+unsigned char *resource_read_section(enum resource_section sec, size_t *lenp);
+
 int find_index_by_tag(int tag);
+
+// FNV-1a of len bytes. data1 is hashed with it to match the section cache
+// and the text index to the data1 file they were built from.
+uint64_t resource_hash(const void *bytes, size_t len);
+uint64_t resource_data1_hash(void);
+
+// Tables inside DRAGON.COM, off is the address in the running program.
+// com_view points into the file, com_extract returns a malloc'd copy for
+// tables the game writes to. com_view_len is the number of bytes from off
+// to the end of the file, 0 if off is outside of it.
+const unsigned char *com_view(size_t off, size_t sz);
 unsigned char *com_extract(size_t off, size_t sz);
+size_t com_view_len(size_t off);
+// Strings decoded from dragon.com by the current game.
+struct text_cache *com_text_cache(void);
 struct resource* game_memory_alloc(size_t nbytes, int marker, int tag);
 void setup_memory();
 
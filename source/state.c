@@ -23,8 +23,7 @@
 // The game state is a 256 byte "scratch/work" area for the game engine
 // to manage and keep track of various aspects of the game.
 //
-// It starts at address 0x3860
-struct game_state game_state = {0};
+// It starts at address 0x3860, there's one per engine context.
 
 void set_game_state(const char *func_src, int offset, unsigned char value)
 {
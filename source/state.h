@@ -17,6 +17,8 @@
 #ifndef DW_STATE_H
 #define DW_STATE_H
 
+#include "context.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -30,7 +32,8 @@ struct game_state {
   unsigned char unknown[256];
 };
 
-extern struct game_state game_state;
+// Game state of the current game.
+#define game_state (*dw_ctx->state)
 
 void set_game_state(const char *func_src, int offset, unsigned char value);
 
@@ -17,6 +17,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "context.h"
 #include "tables.h"
 #include "resource.h"
 
@@ -257,16 +258,16 @@ static uint16_t unknown_4456[] = {
  * ##  ##
  *
  **/
-static unsigned char *chr_table;
+static const unsigned char *chr_table;
 
 void load_chr_table()
 {
-  chr_table = com_extract(0xBF52, 0x400);
+  chr_table = com_view(0xBF52, 0x400);
 }
 
 void unload_chr_table()
 {
-  free(chr_table);
+  chr_table = NULL;
 }
 
 const unsigned char *get_chr(int chr_num)
@@ -311,7 +312,7 @@ uint16_t get_unknown_4456(uint8_t index)
 {
   if (index >= sizeof(unknown_4456) / sizeof(unknown_4456[0])) {
     printf("Requested %d index out of bounds in unknown 4456\n", index);
-    exit(1);
+    dw_exit(DW_EXIT_ERROR);
   }
   return unknown_4456[index];
 }
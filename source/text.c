@@ -0,0 +1,450 @@
+/*
+ * Copyright (c) 2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "text.h"
+
+#ifndef nitems
+#define nitems(_a) (sizeof((_a)) / sizeof((_a)[0]))
+#endif /* nitems */
+
+// 0x1D2A - 0x1D85
+// Glyph of each code, starting at code 1. Codes above 0x1E are 0x1E plus
+// the 6 bit value that follows 0x1F.
+static const unsigned char alphabet[] = {
+  0xa0, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xeb, 0xec,
+  0xed, 0xee, 0xef, 0xf0, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf9, 0xae,
+  0xa2, 0xa7, 0xac, 0xa1, 0x8d, 0xea, 0xf1, 0xf8, 0xfa, 0xb0, 0xb1, 0xb2,
+  0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0x30, 0x31, 0x32, 0x33, 0x34,
+  0x35, 0x36, 0x37, 0x38, 0x39, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47,
+  0x48, 0x49, 0x4a, 0x4b, 0x4c, 0x4d, 0x4e, 0x4f, 0x50, 0x51, 0x52, 0x53,
+  0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0xa8, 0xa9, 0xaf, 0xdc, 0xa3,
+  0xaa, 0xbf, 0xbc, 0xbe, 0xba, 0xbb, 0xad, 0xa5
+};
+
+// The longest code (0x1F and 6 more bits).
+#define TEXT_CODE_BITS 11
+
+// Reads whole bytes into a 64 bit buffer, most significant bit first, so
+// that a code takes one shift and most codes need no refill.
+struct text_reader {
+  const unsigned char *src;
+  size_t len;
+  size_t pos;    // Next byte to load.
+  uint64_t bits; // nbits unread bits at the top.
+  int nbits;
+};
+
+static inline uint64_t
+load_be64(const unsigned char *p)
+{
+  return ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) |
+    ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+    ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) |
+    ((uint64_t)p[6] << 8) | p[7];
+}
+
+static inline void
+reader_refill(struct text_reader *r)
+{
+  if (r->pos + 8 <= r->len) {
+    // The bits below the bytes taken are the next bytes, loading them again
+    // later ORs in the same bits.
+    int n = (63 - r->nbits) >> 3;
+
+    r->bits |= load_be64(r->src + r->pos) >> r->nbits;
+    r->pos += n;
+    r->nbits += n * 8;
+    return;
+  }
+
+  while (r->nbits <= 56) {
+    uint8_t b = r->pos < r->len ? r->src[r->pos] : 0;
+
+    r->bits |= (uint64_t)b << (56 - r->nbits);
+    r->pos++;
+    r->nbits += 8;
+  }
+}
+
+static inline void
+reader_skip(struct text_reader *r, int n)
+{
+  r->bits <<= n;
+  r->nbits -= n;
+}
+
+// Next glyph of the string, after the 0x1E shifts (0x1CF8). Returns 0 at
+// the end of the string and -1 for the last 6 bit code, which the
+// original looks up past the end of the alphabet.
+static inline int
+next_glyph(struct text_reader *r, uint8_t *shift)
+{
+  while (1) {
+    unsigned int code;
+    uint8_t glyph;
+
+    if (r->nbits < TEXT_CODE_BITS)
+      reader_refill(r);
+    code = r->bits >> 59;
+    if (code == 0) {
+      reader_skip(r, 5);
+      return 0;
+    }
+    if (code == 0x1E) {
+      // stc, rcr byte [0x1CE4], 1
+      *shift = (*shift >> 1) | 0x80;
+      reader_skip(r, 5);
+      continue;
+    }
+    if (code == 0x1F) {
+      code = ((r->bits >> 53) & 0x3F) + 0x1E;
+      reader_skip(r, TEXT_CODE_BITS);
+    } else {
+      reader_skip(r, 5);
+    }
+
+    if (code > nitems(alphabet))
+      return -1;
+    glyph = alphabet[code - 1];
+    *shift >>= 1;
+    if (*shift >= 0x40 && glyph >= 0xE1 && glyph <= 0xFA)
+      glyph &= 0xDF;
+    return glyph;
+  }
+}
+
+// 0xAF/0xDC text and byte 8 (0x1C8B).
+struct text_filter {
+  uint8_t marker; // 0x1CE1, 0 outside of 0xAF/0xDC text.
+  uint8_t shown;  // 0x1CE2
+};
+
+static inline void
+filter_glyph(struct text_filter *f, uint8_t glyph, uint8_t *flags,
+    text_emit_func emit, void *arg)
+{
+  if (f->marker == 0) {
+    if ((flags[0] & 0x80) == 0) {
+      flags[0] = glyph | 0x80;
+      glyph &= 0x7F;
+    }
+    if (glyph != 0xAF && glyph != 0xDC) {
+      emit(glyph, arg);
+      return;
+    }
+  } else if (glyph == f->marker) {
+    f->marker = 0;
+    return;
+  } else if (glyph != 0xAF && glyph != 0xDC) {
+    if (f->shown)
+      emit(glyph, arg);
+    return;
+  }
+
+  // 0x1CAB, starts (or switches) conditional text.
+  f->marker = glyph;
+  f->shown = (glyph == 0xAF) ^ (flags[1] != 0);
+}
+
+// Bytes that were only loaded ahead weren't read.
+static inline size_t
+reader_end(const struct text_reader *r)
+{
+  return r->pos - r->nbits / 8;
+}
+
+// 0x1C79
+size_t
+text_decode(const unsigned char *src, size_t len, size_t offset,
+    uint8_t *flags, text_emit_func emit, void *arg)
+{
+  struct text_reader r = { src, len, offset, 0, 0 };
+  struct text_filter f = { 0, 0 };
+  uint8_t shift = 0; // 0x1CE4
+  int glyph;
+
+  while ((glyph = next_glyph(&r, &shift)) > 0)
+    filter_glyph(&f, glyph, flags, emit, arg);
+  return reader_end(&r);
+}
+
+int
+text_unpack(const unsigned char *src, size_t len, size_t offset,
+    struct text_string *ts)
+{
+  struct text_reader r = { src, len, offset, 0, 0 };
+  uint8_t shift = 0;
+  size_t cap = 0;
+  int glyph;
+
+  memset(ts, 0, sizeof(*ts));
+  while ((glyph = next_glyph(&r, &shift)) > 0) {
+    if (ts->nglyphs == cap) {
+      unsigned char *glyphs;
+
+      cap = cap ? cap * 2 : 64;
+      glyphs = realloc(ts->glyphs, cap);
+      if (glyphs == NULL) {
+        free(ts->glyphs);
+        ts->glyphs = NULL;
+        return -1;
+      }
+      ts->glyphs = glyphs;
+    }
+    ts->glyphs[ts->nglyphs++] = glyph;
+  }
+
+  ts->end = reader_end(&r);
+  ts->end_bit = r.pos * 8 - r.nbits;
+  ts->complete = glyph == 0;
+  return 0;
+}
+
+void
+text_replay(const unsigned char *glyphs, size_t n, uint8_t *flags,
+    text_emit_func emit, void *arg)
+{
+  struct text_filter f = { 0, 0 };
+
+  for (size_t i = 0; i < n; i++)
+    filter_glyph(&f, glyphs[i], flags, emit, arg);
+}
+
+// Index written by dwstrings, see text_index_set.
+static const struct text_index_entry *index_entries;
+static size_t index_count;
+static const unsigned char *index_bytes;
+
+int
+text_index_set(const unsigned char *bytes, size_t len)
+{
+  const struct text_index_header *hdr;
+  const struct text_index_entry *entries;
+  size_t data_start;
+
+  index_entries = NULL;
+  index_count = 0;
+  index_bytes = NULL;
+  if (bytes == NULL)
+    return 0;
+
+  hdr = (const struct text_index_header *)bytes;
+  if (len < sizeof(*hdr) ||
+      memcmp(hdr->magic, TEXT_INDEX_MAGIC, sizeof(TEXT_INDEX_MAGIC)) ||
+      hdr->version != TEXT_INDEX_VERSION ||
+      hdr->count > (len - sizeof(*hdr)) / sizeof(struct text_index_entry))
+    return -1;
+
+  entries = (const struct text_index_entry *)(hdr + 1);
+  data_start = sizeof(*hdr) + hdr->count * sizeof(struct text_index_entry);
+  for (uint32_t i = 0; i < hdr->count; i++) {
+    const struct text_index_entry *e = &entries[i];
+
+    if (e->data < data_start || e->data > len ||
+        len - e->data < (size_t)e->nsrc + e->nglyphs)
+      return -1;
+    // Sorted by section and offset for text_index_find.
+    if (i > 0 && (e->section < e[-1].section ||
+          (e->section == e[-1].section && e->offset <= e[-1].offset)))
+      return -1;
+  }
+
+  index_entries = entries;
+  index_count = hdr->count;
+  index_bytes = bytes;
+  return 0;
+}
+
+const struct text_index_entry *
+text_index_find(int section, size_t offset, const unsigned char **datap)
+{
+  size_t lo = 0, hi = index_count;
+  uint32_t key = ((uint32_t)section << 16) | offset;
+
+  if (section < 0 || offset > 0xFFFF)
+    return NULL;
+
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    const struct text_index_entry *e = &index_entries[mid];
+    uint32_t k = ((uint32_t)e->section << 16) | e->offset;
+
+    if (k == key) {
+      *datap = index_bytes + e->data;
+      return e;
+    }
+    if (k < key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return NULL;
+}
+
+struct text_entry {
+  uint32_t key;     // Offset plus one, 0 for empty entries.
+  uint32_t end;     // Offset returned by text_decode.
+  uint32_t nglyphs;
+  uint32_t nsrc;
+  unsigned char *bytes; // The nsrc packed bytes, then the glyphs.
+};
+
+// Open addressing, the table is never more than half full.
+struct text_cache {
+  int section;
+  struct text_entry *entries;
+  size_t cap; // Power of two.
+  size_t count;
+};
+
+#define TEXT_CACHE_MIN 64
+
+struct text_cache *
+text_cache_new(int section)
+{
+  struct text_cache *tc;
+
+  tc = calloc(1, sizeof(struct text_cache));
+  if (tc != NULL)
+    tc->section = section;
+  return tc;
+}
+
+void
+text_cache_free(struct text_cache *tc)
+{
+  if (tc == NULL)
+    return;
+
+  for (size_t i = 0; i < tc->cap; i++)
+    free(tc->entries[i].bytes);
+  free(tc->entries);
+  free(tc);
+}
+
+static struct text_entry *
+cache_slot(struct text_cache *tc, uint32_t key)
+{
+  size_t i = (key * 2654435761u) & (tc->cap - 1);
+
+  while (tc->entries[i].key != 0 && tc->entries[i].key != key)
+    i = (i + 1) & (tc->cap - 1);
+  return &tc->entries[i];
+}
+
+static int
+cache_grow(struct text_cache *tc)
+{
+  struct text_cache grown = *tc;
+
+  grown.cap = tc->cap ? tc->cap * 2 : TEXT_CACHE_MIN;
+  grown.entries = calloc(grown.cap, sizeof(struct text_entry));
+  if (grown.entries == NULL)
+    return -1;
+
+  for (size_t i = 0; i < tc->cap; i++) {
+    if (tc->entries[i].key != 0)
+      *cache_slot(&grown, tc->entries[i].key) = tc->entries[i];
+  }
+  free(tc->entries);
+  *tc = grown;
+  return 0;
+}
+
+static struct text_entry *
+cache_put(struct text_cache *tc, uint32_t key, size_t end,
+    const unsigned char *src, size_t nsrc, const unsigned char *glyphs,
+    size_t nglyphs)
+{
+  struct text_entry *e;
+  unsigned char *bytes;
+
+  if (2 * (tc->count + 1) > tc->cap && cache_grow(tc) != 0)
+    return NULL;
+
+  bytes = malloc(nsrc + nglyphs + 1);
+  if (bytes == NULL)
+    return NULL;
+  memcpy(bytes, src, nsrc);
+  if (nglyphs != 0)
+    memcpy(bytes + nsrc, glyphs, nglyphs);
+
+  e = cache_slot(tc, key);
+  if (e->key == 0)
+    tc->count++;
+  free(e->bytes);
+  e->key = key;
+  e->end = end;
+  e->nglyphs = nglyphs;
+  e->nsrc = nsrc;
+  e->bytes = bytes;
+  return e;
+}
+
+// Fills the cache entry for offset from the text index or by decoding.
+static struct text_entry *
+cache_fill(struct text_cache *tc, uint32_t key, const unsigned char *src,
+    size_t len, size_t offset)
+{
+  const struct text_index_entry *ie;
+  const unsigned char *data;
+  struct text_string ts;
+  struct text_entry *e;
+
+  ie = text_index_find(tc->section, offset, &data);
+  if (ie != NULL && ie->nsrc <= len - offset &&
+      memcmp(data, src + offset, ie->nsrc) == 0) {
+    return cache_put(tc, key, offset + ie->nsrc, data, ie->nsrc,
+        data + ie->nsrc, ie->nglyphs);
+  }
+
+  if (text_unpack(src, len, offset, &ts) != 0)
+    return NULL;
+  e = cache_put(tc, key, ts.end, src + offset,
+      (ts.end < len ? ts.end : len) - offset, ts.glyphs, ts.nglyphs);
+  free(ts.glyphs);
+  return e;
+}
+
+size_t
+text_decode_cached(struct text_cache *tc, const unsigned char *src,
+    size_t len, size_t offset, uint8_t *flags, text_emit_func emit,
+    void *arg)
+{
+  struct text_entry *e = NULL;
+  uint32_t key;
+
+  if (tc == NULL || offset >= len || offset >= UINT32_MAX)
+    return text_decode(src, len, offset, flags, emit, arg);
+
+  key = offset + 1;
+  if (tc->cap != 0) {
+    e = cache_slot(tc, key);
+    if (e->key != key || e->nsrc > len - offset ||
+        memcmp(e->bytes, src + offset, e->nsrc) != 0)
+      e = NULL;
+  }
+  if (e == NULL)
+    e = cache_fill(tc, key, src, len, offset);
+  if (e == NULL)
+    return text_decode(src, len, offset, flags, emit, arg);
+
+  text_replay(e->bytes + e->nsrc, e->nglyphs, flags, emit, arg);
+  return e->end;
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef DW_TEXT_H
+#define DW_TEXT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Packed game text (0x1C79 - 0x1DA5 inside dragon.com).
+ *
+ * A string is a stream of 5 bit codes, most significant bit first, ended
+ * by code 0. Codes 1 - 0x1D are letters, 0x1E makes the next letter upper
+ * case and 0x1F is followed by 6 more bits for the rest of the alphabet.
+ *
+ * Text between two 0xAF glyphs is only shown while game_state byte 9 is
+ * clear, text between two 0xDC glyphs only while it's set. The first glyph
+ * outside of those is stored in byte 8 (with bit 7 set) if bit 7 of byte 8
+ * is clear, that glyph loses its bit 7. */
+
+typedef void (*text_emit_func)(uint8_t glyph, void *arg);
+
+// Decodes the string at offset in src (len bytes, reading past the end
+// gives 0 bits), passing every glyph shown to emit. flags points to game
+// state bytes 8 and 9. Returns the offset just past the last byte read.
+size_t text_decode(const unsigned char *src, size_t len, size_t offset,
+    uint8_t *flags, text_emit_func emit, void *arg);
+
+// Glyphs of a string before the 0xAF/0xDC text and byte 8 are applied.
+struct text_string {
+  unsigned char *glyphs; // malloc'd
+  size_t nglyphs;
+  size_t end;     // As returned by text_decode.
+  size_t end_bit; // Bit after the last code, counted from the start of src.
+  int complete;   // Ended by code 0, not by the code past the alphabet.
+};
+
+// Reads the string at offset of src into ts, returns -1 if out of memory.
+int text_unpack(const unsigned char *src, size_t len, size_t offset,
+    struct text_string *ts);
+
+// Passes the glyphs of a string unpacked by text_unpack to emit the way
+// text_decode would.
+void text_replay(const unsigned char *glyphs, size_t n, uint8_t *flags,
+    text_emit_func emit, void *arg);
+
+// Decoded strings of one resource by offset. An entry keeps the packed
+// bytes it was decoded from and is only used while those bytes are the
+// same.
+struct text_cache;
+
+// section is the data1 section the strings come from, -1 if none. Strings
+// missing from the cache are looked up in the text index first.
+struct text_cache *text_cache_new(int section);
+void text_cache_free(struct text_cache *tc);
+
+// text_decode that remembers the glyphs and the end offset in tc, so that
+// decoding the same string again is a lookup. tc may be NULL.
+size_t text_decode_cached(struct text_cache *tc, const unsigned char *src,
+    size_t len, size_t offset, uint8_t *flags, text_emit_func emit,
+    void *arg);
+
+/* Text index, written by dwstrings.
+ *
+ * The header, count entries sorted by section and offset, then the data of
+ * every entry: the nsrc packed bytes of the string followed by its nglyphs
+ * glyphs (as text_unpack returns them). Host byte order. */
+#define TEXT_INDEX_MAGIC "DWTEXT"
+#define TEXT_INDEX_VERSION 1
+
+struct text_index_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t count;
+  uint64_t data1_hash; // FNV-1a of the whole data1 file.
+};
+
+struct text_index_entry {
+  uint16_t section;
+  uint16_t offset;
+  uint16_t nsrc;    // Packed bytes, the string ends at offset + nsrc.
+  uint16_t nglyphs;
+  uint32_t end_bit;
+  uint32_t data;    // Where the packed bytes are, from the start of the file.
+};
+
+// Makes the index in bytes (kept until the next call) the one the text
+// caches use, NULL for none. Returns -1 if the index is malformed.
+int text_index_set(const unsigned char *bytes, size_t len);
+
+// Entry for the string at offset of section, NULL if there's none. *datap
+// is set to its data.
+const struct text_index_entry *text_index_find(int section, size_t offset,
+    const unsigned char **datap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DW_TEXT_H */
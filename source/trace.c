@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+_Thread_local struct trace_ring *trace_ring_self;
+
+// Every ring ever attached, pushed lock free and never removed so the
+// records of finished threads are still dumped.
+static struct trace_ring *rings;
+static uint32_t next_ring_id;
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+
+static void
+trace_exit(void)
+{
+  const char *fname = getenv("DW_TRACE");
+
+  if (fname != NULL && *fname != '\0')
+    trace_dump(fname);
+}
+
+// Key destructor, gives the ring of an exiting thread back.
+static void
+ring_release(void *arg)
+{
+  struct trace_ring *ring = arg;
+
+  __atomic_store_n(&ring->in_use, 0, __ATOMIC_RELEASE);
+  trace_ring_self = NULL;
+}
+
+static void
+trace_init(void)
+{
+  pthread_key_create(&ring_key, ring_release);
+  atexit(trace_exit);
+}
+
+// A ring given back by a thread that has exited, NULL if there's none.
+static struct trace_ring *
+reuse_ring(void)
+{
+  struct trace_ring *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+
+  for (; ring != NULL; ring = ring->next) {
+    int free_ring = 0;
+
+    if (__atomic_compare_exchange_n(&ring->in_use, &free_ring, 1, 0,
+          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      return ring;
+  }
+  return NULL;
+}
+
+struct trace_ring *
+trace_ring_attach(void)
+{
+  struct trace_ring *ring;
+
+  pthread_once(&trace_once, trace_init);
+
+  ring = reuse_ring();
+  if (ring == NULL) {
+    ring = calloc(1, sizeof(struct trace_ring));
+    if (ring == NULL)
+      return NULL;
+
+    ring->in_use = 1;
+    ring->id = __atomic_fetch_add(&next_ring_id, 1, __ATOMIC_RELAXED);
+    ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 1,
+          __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+  }
+
+  pthread_setspecific(ring_key, ring);
+  trace_ring_self = ring;
+  return ring;
+}
+
+static int
+dump_ring(FILE *fp, const struct trace_ring *ring)
+{
+  struct trace_file_ring hdr;
+  uint64_t head = ring->head;
+  uint64_t first;
+
+  first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+  hdr.id = ring->id;
+  hdr.count = head - first;
+  hdr.dropped = first;
+  if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+    return -1;
+
+  // The ring may have wrapped, write it out oldest record first.
+  for (uint64_t i = first; i < head; ) {
+    size_t pos = i & (TRACE_RING_SIZE - 1);
+    size_t n = TRACE_RING_SIZE - pos;
+
+    if (n > head - i)
+      n = head - i;
+    if (fwrite(&ring->records[pos], sizeof(struct trace_record), n, fp) != n)
+      return -1;
+    i += n;
+  }
+  return 0;
+}
+
+int
+trace_dump(const char *fname)
+{
+  struct trace_file_header hdr;
+  struct trace_ring *head, *ring;
+  FILE *fp;
+
+  fp = fopen(fname, "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "Failed to open trace file %s.\n", fname);
+    return -1;
+  }
+
+  head = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+  hdr.version = TRACE_VERSION;
+  hdr.record_size = sizeof(struct trace_record);
+  hdr.clock_cycles = TRACE_CLOCK_CYCLES;
+  for (ring = head; ring != NULL; ring = ring->next)
+    hdr.nrings++;
+
+  if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+    goto fail;
+
+  for (ring = head; ring != NULL; ring = ring->next) {
+    if (dump_ring(fp, ring) != 0)
+      goto fail;
+  }
+
+  if (fclose(fp) != 0) {
+    fprintf(stderr, "Failed to write trace file %s.\n", fname);
+    return -1;
+  }
+  return 0;
+
+fail:
+  fprintf(stderr, "Failed to write trace file %s.\n", fname);
+  fclose(fp);
+  return -1;
+}
@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2021 Devin Smith <devin@devinsmith.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Binary execution trace.
+ *
+ * Debug output of the engine is recorded as fixed size records into a ring
+ * buffer owned by the calling thread, so recording never takes a lock and
+ * never formats text. The newest TRACE_RING_SIZE records of every thread
+ * are written to $DW_TRACE at exit (nothing is written when it is unset),
+ * and "dwtrace <file>" prints them using the formats below. */
+
+#ifndef DW_TRACE_H
+#define DW_TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define TRACE_CLOCK_CYCLES 1
+#else
+#define TRACE_CLOCK_CYCLES 0
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum trace_subsystem {
+  TRACE_VM,
+  TRACE_UI,
+  TRACE_RES,
+  TRACE_SUBSYSTEM_COUNT
+};
+
+// X(name, subsystem, printf format taking up to TRACE_MAX_ARGS ints)
+// Only append to this list, the event numbers are stored in trace files.
+#define TRACE_EVENTS(X)                                                       \
+  X(SET_WORD_MODE, VM, "set_word_mode - setting 3AE1 to 0xFF")                \
+  X(SET_BYTE_MODE, VM, "set_byte_mode - setting 3AE1 to 0")                   \
+  X(LOAD_GAMESTATE, VM, "load_word3AE2_gamestate - 0x%02X -> word_3AE2: 0x%04X") \
+  X(OP_0F, VM, "OP_0F: BX: 0x%04X")                                           \
+  X(OP_11, VM, "op_11: 0x%04X ah: 0x%02X")                                    \
+  X(OP_13, VM, "op_13: 0x%04X")                                               \
+  X(STORE_RESOURCE, VM, "store_data_into_resource  index: 0x%02X base offset: 0x%04X") \
+  X(STORE_BYTE, VM, "  store_data_into_resource: setting byte 0x%04X")       \
+  X(JUMP, VM, "(op%02X)    New address: 0x%04x")                              \
+  X(LOOP, VM, "LOOP 0x%04X  Counter: 0x%02X")                                 \
+  X(CALL, VM, "(op%02X)    New address: 0x%04x Existing address: 0x%04x")     \
+  X(RET, VM, "op_54 SI: %04X")                                                \
+  X(CHARACTER_DATA, VM, "get_character_data - Player number: %d Property: 0x%02X") \
+  X(CHARACTER_NAME, VM, "write_character_name: 0x%04X, Player number: 0x%02X") \
+  X(OP_7C, VM, "op_7C - 0x%04X")                                              \
+  X(OP_7D, VM, "op_7D")                                                       \
+  X(CTRL_S, VM, "xor byte_107, 0x40")                                         \
+  X(SUB_2A4C, VM, "sub_2A4C DI: 0x%04X BX: 0x%04X AX: 0x%04X")               \
+  X(SUB_2A4C_AL, VM, "sub_2A4C: AL - 0x%02X")                                 \
+  X(SUB_28B0, VM, "sub_28B0: cpu.bx = 0x%04X")                                \
+  X(WORD_2AA7, VM, "sub_28B0: word_2AA7: 0x%04X")                             \
+  X(OP_89, VM, "op_89 : 0x4977")                                              \
+  X(OP_8A, VM, "op_8A: BX: 0x%04X")                                           \
+  X(LOAD_RESOURCE, VM, "Loading Resource: %d")                                \
+  X(SUB_54D8, VM, "sub_54D8 - DI: 0x%04X AX: 0x%04X")                         \
+  X(SUB_CE7, VM, "sub_CE7: BX: 0x%04X AX: 0x%04X")                            \
+  X(START_GAME, VM, "start_the_game 0x%04X 11CA: 0x%04X")                     \
+  X(START_GAME_BL, VM, "start_the_game 0x51FC BL - 0x%02X")                   \
+  X(OP_8D, VM, "op_8D : 0x49D3")                                              \
+  X(APPEND_NEWLINE, VM, "append_string: newline len: %d rect: 0x%04x 0x%04x point: 0x%04x 0x%04x") \
+  X(APPEND_BREAK, VM, "append_string: 0x31D2 %02d")                           \
+  X(SUB_11CE, VM, "sub_11CE: 0x%04X 0x%04X 0x%04X 0x%04X")                    \
+  X(QUADRANT, UI, "process_quadrant: 0x%02X 0x%02X, 0x%02X offset: %04x (%d bytes)") \
+  X(SUB_DEB, UI, "sub_DEB: (0x%04X)")                                         \
+  X(SUB_E6D, UI, "sub_E6D: lodsb: 0x%02X")                                    \
+  X(UI_PIECE, UI, "draw_ui_piece: Line number: %d - FB offset: 0x%04x")       \
+  X(PATTERN, UI, "draw_pattern: x_pos: %d DX: 0x%04x")                        \
+  X(UI_PIECE_OFFSET, UI, "ui_load: Piece: %d Offset: %04x")                   \
+  X(VIEWPORT, UI, "update_viewport: di = 0x%04X")                             \
+  X(SUB_269F, UI, "sub_269F(%d, %d, 0x80)")                                   \
+  X(SECTION_LOAD, RES, "Section (0x%02x), Offset: 0x%04x Size: 0x%04x")       \
+  X(SECTION_DECOMPRESS, RES, "Section 0x%02X needs decompression. %d -> %d")  \
+  X(DICTIONARY, RES, "build_dictionary: offset: %d Counter: %d DX: %04x")     \
+  X(CACHE_EVICT, RES, "Evicted slot %d (section 0x%02X, %d bytes)")         \
+  X(SECTION_CACHED, RES, "Section 0x%02X read from the section cache, %d bytes") \
+  X(PREFETCH_HIT, RES, "Section 0x%02X was prefetched, %d bytes")             \
+  X(APPEND_TEXT, VM, "append_text: %d glyphs, %d on the line")
+
+enum trace_event {
+#define TRACE_EVENT_ENUM(name, sub, fmt) TRACE_##name,
+  TRACE_EVENTS(TRACE_EVENT_ENUM)
+#undef TRACE_EVENT_ENUM
+  TRACE_EVENT_COUNT
+};
+
+// Subsystem of each event as a constant, TRACE_SUB_name.
+enum {
+#define TRACE_EVENT_SUB(name, sub, fmt) TRACE_SUB_##name = TRACE_##sub,
+  TRACE_EVENTS(TRACE_EVENT_SUB)
+#undef TRACE_EVENT_SUB
+};
+
+#define TRACE_MAX_ARGS 5
+
+struct trace_record {
+  uint64_t timestamp;
+  uint16_t subsystem;
+  uint16_t event;
+  int32_t args[TRACE_MAX_ARGS];
+};
+
+// Records per thread, must be a power of two.
+#define TRACE_RING_SIZE (1 << 16)
+
+// A ring is handed to the next thread that starts tracing once its thread
+// exits, so there are only as many rings as threads tracing at once. The
+// records of a ring can come from several threads, one after the other.
+struct trace_ring {
+  uint64_t head; // total records written, only touched by the owner.
+  uint32_t id;
+  int in_use;    // Owned by a running thread.
+  struct trace_ring *next;
+  struct trace_record records[TRACE_RING_SIZE];
+};
+
+// Trace file layout (host byte order):
+//   struct trace_file_header
+//   per ring: struct trace_file_ring, then count records oldest first.
+#define TRACE_MAGIC "DWTRACE"
+#define TRACE_VERSION 2
+
+struct trace_file_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t clock_cycles; // 1 = timestamps are rdtsc cycles, 0 = ns.
+  uint32_t nrings;
+};
+
+struct trace_file_ring {
+  uint32_t id;
+  uint32_t count;
+  uint64_t dropped; // older records overwritten in the ring.
+};
+
+extern _Thread_local struct trace_ring *trace_ring_self;
+
+struct trace_ring *trace_ring_attach(void);
+
+// Writes the rings of all threads to fname, done at exit when $DW_TRACE
+// is set. Returns 0 on success.
+int trace_dump(const char *fname);
+
+static inline uint64_t
+trace_ticks(void)
+{
+#if TRACE_CLOCK_CYCLES
+  return __rdtsc();
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static inline void
+trace_write(uint16_t subsystem, uint16_t event, int32_t a0, int32_t a1,
+    int32_t a2, int32_t a3, int32_t a4)
+{
+  struct trace_ring *ring = trace_ring_self;
+  struct trace_record *rec;
+
+  if (ring == NULL && (ring = trace_ring_attach()) == NULL)
+    return;
+
+  rec = &ring->records[ring->head++ & (TRACE_RING_SIZE - 1)];
+  rec->timestamp = trace_ticks();
+  rec->subsystem = subsystem;
+  rec->event = event;
+  rec->args[0] = a0;
+  rec->args[1] = a1;
+  rec->args[2] = a2;
+  rec->args[3] = a3;
+  rec->args[4] = a4;
+}
+
+// TRACE(LOOP, new_address, counter) records event TRACE_LOOP, missing
+// arguments are 0.
+#define TRACE_PAD_(_, a0, a1, a2, a3, a4, ...) a0, a1, a2, a3, a4
+#define TRACE(name, ...)                                                      \
+  trace_write(TRACE_SUB_##name, TRACE_##name,                                 \
+      TRACE_PAD_(_, ##__VA_ARGS__, 0, 0, 0, 0, 0))
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DW_TRACE_H */
@@ -19,23 +19,15 @@
 #include <string.h>
 
 #include "engine.h"
+#include "expand.h"
 #include "offsets.h"
 #include "resource.h"
 #include "tables.h"
+#include "trace.h"
 #include "ui.h"
 #include "utils.h"
 #include "vga.h"
 
-struct pic_data {
-  uint8_t width;
-  uint8_t height;
-  uint8_t offset_delta;
-  uint8_t y_pos; // Starting line.
-  unsigned char *data;
-};
-
-uint8_t ui_drawn_yet = 0; // 0x268E
-
 static void draw_indexed_picture9();
 static void sub_1F54(uint8_t al);
 static void sub_27CC();
@@ -48,10 +40,6 @@ void (*ui_draw_funcs[5])() = {
   sub_27CC
 };
 
-static struct ui_rect data_268F;
-// 0x2697
-struct ui_rect draw_rect;
-
 // 0x2794-0x27CB
 static unsigned char data_2794[56] = {
   0x00, 0xB8, 0x28, 0xC0, 0x00, 0x98, 0x01, 0xB8, // 0x2794-0x279B
@@ -68,25 +56,7 @@ static unsigned char color_data[] = {
   0x00, 0xFF, 0xCC, 0xAA, 0x99
 };
 
-static uint8_t byte_3236 = 0;
-// 0x32BF
-struct ui_point draw_point;
-
-// 0x320C
-struct ui_string_line ui_string = { 0 };
-
-// 0x2AC3
-uint8_t data_2AC3[0x19];
-
-static int loaded = 0;
-
-// At 0x4F11 in memory.
-// 10880 bytes. (136 x 80)
-static unsigned char *viewport_memory; // 0x4F11
-static unsigned char *viewport_mem_save; // 0x4F13
 static const int viewport_mem_sz = 10880;
-unsigned short word_4F15; // 0x4F15
-unsigned short word_4F17; // 0x4F17
 
 // Viewport metadata.
 // 0x6748
@@ -97,8 +67,8 @@ unsigned char viewport_metadata[] = {
   0xE8, 0x67, 0x98, 0x7B
 };
 
-// Populated from data extracted from 0x6748
-struct viewport_data viewports[] = {
+// Initial viewports, populated from data extracted from 0x6748
+static const struct viewport_data viewports_init[4] = {
   {
     0x00, 0x00, 0x04, 0x0A, 0x00, 0x00,
     NULL
@@ -120,9 +90,7 @@ struct viewport_data viewports[] = {
 #define COLOR_BLACK 0
 #define COLOR_WHITE 0xF
 
-#define UI_PIECE_COUNT 0x2B
 #define UI_BRICK_FIRST_PICTURE 0x17
-static struct pic_data ui_pieces[UI_PIECE_COUNT];
 
 // 0x288B
 // Initially "Loading..."
@@ -130,22 +98,39 @@ unsigned char ui_header_loading[] = {
   0xCC, 0xEF, 0xE1, 0xE4, 0xE9, 0xEE, 0xE7, 0xAE, 0xAE, 0xAE
 };
 
-struct ui_header {
-  int len; // 0x288A
-  unsigned char data[16]; // 0x288B
-};
+// 0x359C
+static uint16_t backgrounds[2] = { 0xFFFF, 0x0000 };
 
-static struct ui_header ui_header;
+struct ui_state *
+ui_state_new(void)
+{
+  struct ui_state *ui;
 
-// 0x3598
-static uint8_t prev_bg_index = 0;
-// 0x3599
-static uint8_t curr_bg_index = 0;
+  ui = calloc(1, sizeof(struct ui_state));
+  if (ui == NULL)
+    return NULL;
 
-// 0x359A
-static uint16_t current_background = 0xFFFF;
-// 0x359C
-static uint16_t backgrounds[2] = { 0xFFFF, 0x0000 };
+  memcpy(ui->viewports, viewports_init, sizeof(viewports_init));
+  ui->current_background = 0xFFFF;
+  return ui;
+}
+
+// Variables of the current game.
+#define UI (dw_ctx->ui)
+#define data_268F (UI->data_268F)
+#define byte_3236 (UI->byte_3236)
+#define data_2AC3 (UI->data_2AC3)
+#define loaded (UI->loaded)
+#define viewport_memory (UI->viewport_memory)
+#define viewport_mem_save (UI->viewport_mem_save)
+#define word_4F15 (UI->word_4F15)
+#define word_4F17 (UI->word_4F17)
+#define viewports (UI->viewports)
+#define ui_pieces (UI->ui_pieces)
+#define ui_header (UI->ui_header)
+#define prev_bg_index (UI->prev_bg_index)
+#define curr_bg_index (UI->curr_bg_index)
+#define current_background (UI->current_background)
 
 /* D88 */
 static void process_quadrant(const struct viewport_data *d, unsigned char *data)
@@ -171,12 +156,11 @@ static void process_quadrant(const struct viewport_data *d, unsigned char *data)
 #endif
   }
 
-  printf("0x%02X 0x%02X, 0x%02X\n", d->xpos, d->ypos, newx);
   offset = get_offset(d->ypos);
   offset += newx;
-  printf("Offset: %04x (%d bytes)\n", offset, d->numruns * d->runlength);
+  TRACE(QUADRANT, d->xpos, d->ypos, newx, offset, d->numruns * d->runlength);
   unsigned char *p = data + offset;
-  unsigned char *q = d->data + 4;
+  const unsigned char *q = d->data + 4;
   for (int i = 0; i < d->numruns; i++) {
     for (int j = 0; j < d->runlength; j++) {
       unsigned char val = *q;
@@ -223,7 +207,7 @@ static void sub_DEB(const struct viewport_data *d, unsigned char *data)
     // 0x0E06
     word_104A -= ax;
     printf("%s 0xE06 unhandled\n", __func__);
-    exit(1);
+    dw_exit(DW_EXIT_ERROR);
   }
   // 0xE0F
   byte_104C = dl;
@@ -239,7 +223,7 @@ static void sub_DEB(const struct viewport_data *d, unsigned char *data)
   cx = word_104A;
   // 0xE35
   unsigned char *p = data + offset;
-  unsigned char *ds = d->data + 4;
+  const unsigned char *ds = d->data + 4;
 
   // 1048 = 13 ?
   for (int i = 0; i < d->numruns; i++) {
@@ -257,7 +241,7 @@ static void sub_DEB(const struct viewport_data *d, unsigned char *data)
       *p = dx & 0xFF;
       p++;
       *p = (dx & 0xFF00) >> 8;
-      printf("(0x%04X) ", dx);
+      TRACE(SUB_DEB, dx);
       ds++;
     }
     // 0xE4C
@@ -270,7 +254,6 @@ static void sub_DEB(const struct viewport_data *d, unsigned char *data)
     // offset += 1055
     offset += word_1055;
     p = data + offset;
-    printf("\n");
   }
 }
 
@@ -282,8 +265,8 @@ static void sub_EC5(const struct viewport_data *d, unsigned char *data)
   int sign, word_104A;
   uint16_t offset, save;
   uint16_t dx;
-  unsigned char *ds = d->data + 4;
-  unsigned char *base;
+  const unsigned char *ds = d->data + 4;
+  const unsigned char *base;
   uint8_t al;
 
   ax = d->xpos;
@@ -385,8 +368,8 @@ static void sub_E6D(const struct viewport_data *d, unsigned char *data)
     offset = dx;
     // bp = si
     unsigned char *p = data + offset;
-    unsigned char *ds = d->data + si;
-    printf("%s: lodsb: 0x%02X\n", __func__, *ds);
+    const unsigned char *ds = d->data + si;
+    TRACE(SUB_E6D, *ds);
 
     // 0xE9E
     for (int j = 0; j < cx; j++) {
@@ -421,18 +404,9 @@ void draw_viewport()
   const unsigned char *src = viewport_memory;
   for (int y = 0; y < rows; y++) {
     uint16_t fb_off = get_line_offset(line_num) + 0x10;
-    for (int x = 0; x < cols; x++) {
-      uint8_t al = *src++;
-      int hi, lo;
 
-      /* Each nibble represents a color */
-      /* for example 0x82 represents color 8 then color 2. */
-      hi = (al >> 4) & 0xf;
-      lo = al & 0xf;
-
-      framebuffer[fb_off++] = hi;
-      framebuffer[fb_off++] = lo;
-    }
+    expand_4bpp(framebuffer + fb_off, src, cols);
+    src += cols;
     line_num++;
   }
   vga->update();
@@ -444,23 +418,13 @@ void draw_ui_piece(const struct pic_data *pic)
   uint16_t starting_off = get_line_offset(pic->y_pos);
   starting_off += (pic->offset_delta * 4);
   uint16_t fb_off = starting_off;
-  printf("Line number: %d - FB offset: 0x%04x\n", pic->y_pos, fb_off);
-  unsigned char *src = pic->data;
+  TRACE(UI_PIECE, pic->y_pos, fb_off);
+  const unsigned char *src = pic->data;
   uint8_t *framebuffer = vga->memory();
 
   for (int y = 0; y < pic->height; y++) {
-    for (int x = 0; x < pic->width; x++) {
-      uint8_t al = *src++;
-      int hi, lo;
-
-      /* Each nibble represents a color */
-      /* for example 0x82 represents color 8 then color 2. */
-      hi = (al >> 4) & 0xf;
-      lo = al & 0xf;
-
-      framebuffer[fb_off++] = hi;
-      framebuffer[fb_off++] = lo;
-    }
+    expand_4bpp(framebuffer + fb_off, src, pic->width);
+    src += pic->width;
     starting_off += 0x140;
     fb_off = starting_off;
   }
@@ -556,8 +520,7 @@ void draw_pattern(struct ui_rect *rect)
   int x_pos = rect->x << 3;
   dx = dx << 2;
   ax = ax & 0x0F0F;
-  printf("x_pos: %d\n", x_pos);
-  printf("DX: 0x%04x\n", dx);
+  TRACE(PATTERN, x_pos, dx);
 
   for (int i = 0; i < num_lines; i++) {
     uint16_t fb_off = get_line_offset(starting_line);
@@ -611,7 +574,7 @@ static void sub_1F54(uint8_t al)
   }
   // 0x1F5B
   printf("%s: 0x1F5B unhandled.\n", __func__);
-  exit(1);
+  dw_exit(DW_EXIT_ERROR);
 }
 
 // 0x35A0
@@ -619,7 +582,7 @@ void sub_35A0(uint8_t piece_index)
 {
   if (piece_index >= UI_PIECE_COUNT) {
     printf("%s: Piece count is too high! 0x%02X\n", __func__, piece_index);
-    exit(1);
+    dw_exit(DW_EXIT_ERROR);
   }
 
   sub_1F54(9);
@@ -672,31 +635,27 @@ void ui_header_draw()
 void ui_load()
 {
   /* Viewport data is stored in the dragon.com file */
-  viewports[0].data = com_extract(0x6758, 4 + (4 * 0xA));
-  viewports[1].data = com_extract(0x6784, 4 + (4 * 0xA));
-  viewports[2].data = com_extract(0x67B0, 4 + (4 * 0xD));
-  viewports[3].data = com_extract(0x67E8, 4 + (4 * 0xD));
+  viewports[0].data = com_view(0x6758, 4 + (4 * 0xA));
+  viewports[1].data = com_view(0x6784, 4 + (4 * 0xA));
+  viewports[2].data = com_view(0x67B0, 4 + (4 * 0xD));
+  viewports[3].data = com_view(0x67E8, 4 + (4 * 0xD));
 
-  unsigned char *ui_piece_offsets_base = com_extract(0x6AE0, UI_PIECE_COUNT * 2);
-  unsigned char *ui_piece_offsets = ui_piece_offsets_base;
+  const unsigned char *ui_piece_offsets = com_view(0x6AE0, UI_PIECE_COUNT * 2);
   printf("UI Pieces:\n");
   dump_hex(ui_piece_offsets, UI_PIECE_COUNT * 2);
   for (size_t ui_idx = 0; ui_idx < UI_PIECE_COUNT; ui_idx++) {
     uint16_t ui_off = *ui_piece_offsets++;
     ui_off += *ui_piece_offsets++ << 8;
-    printf("Piece: %zu Offset: %04x\n", ui_idx, ui_off);
+    TRACE(UI_PIECE_OFFSET, ui_idx, ui_off);
     /* Next 4 bytes are encoded into pic data */
-    unsigned char *piece_struct = com_extract(ui_off, 4);
-    unsigned char *org = piece_struct;
+    const unsigned char *piece_struct = com_view(ui_off, 4);
     ui_pieces[ui_idx].width = *piece_struct++;
     ui_pieces[ui_idx].height = *piece_struct++;
     ui_pieces[ui_idx].offset_delta = *piece_struct++;
     ui_pieces[ui_idx].y_pos = *piece_struct;
-    free(org);
     size_t data_sz = ui_pieces[ui_idx].width * ui_pieces[ui_idx].height;
-    ui_pieces[ui_idx].data = com_extract(ui_off + 4, data_sz);
+    ui_pieces[ui_idx].data = com_view(ui_off + 4, data_sz);
   }
-  free(ui_piece_offsets_base);
 
   memcpy(ui_header.data, ui_header_loading, strlen("Loading..."));
   ui_header.len = strlen("Loading...");
@@ -705,16 +664,9 @@ void ui_load()
 
 void ui_clean()
 {
-  free(viewports[0].data);
-  free(viewports[1].data);
-  free(viewports[2].data);
-  free(viewports[3].data);
-
-  for (size_t ui_idx = 0; ui_idx < UI_PIECE_COUNT; ui_idx++) {
-    free(ui_pieces[ui_idx].data);
-  }
-
+  // Viewport and UI piece data point into dragon.com, see com_view.
   free(viewport_memory);
+  free(viewport_mem_save);
 }
 
 void ui_header_reset()
@@ -747,7 +699,7 @@ void ui_draw_chr_piece(uint8_t chr)
     al += 8;
     if (al > draw_rect.h) {
       printf("BP CS:3275\n");
-      exit(1);
+      dw_exit(DW_EXIT_ERROR);
     }
     draw_point.y = al;
     return;
@@ -819,6 +771,104 @@ void ui_draw_string(void)
   vga->update();
 }
 
+// ui_draw_chr_piece for a run of glyphs on the current line, the run can't
+// hold 0x8D.
+static void draw_run(const unsigned char *s, size_t n)
+{
+  int16_t bx = (int16_t)draw_point.y;
+
+  bx -= draw_rect.y;
+  for (size_t i = 0; i < n; i++) {
+    if ((s[i] & 0x80) == 0 && bx > 0) {
+      data_2AC3[bx >> 3] = s[i];
+      data_2AAA[bx >> 3] = 0xFF;
+    }
+    draw_character(draw_point.x, draw_point.y, get_chr(s[i]));
+    draw_point.x++;
+  }
+}
+
+// Glyphs of ui_string that fit before draw_rect.w.
+static int line_room(void)
+{
+  int room = draw_rect.w - byte_3236;
+
+  if (room < 0)
+    room = 0;
+  if (room > (int)sizeof(ui_string.bytes) - 1)
+    room = sizeof(ui_string.bytes) - 1;
+  return room;
+}
+
+// Last 0xA0 of ui_string that a line can be broken at, 0 if none.
+static int last_space(const unsigned char *line, int len)
+{
+  while (--len > 0) {
+    if (line[len] == 0xA0)
+      return len;
+  }
+  return 0;
+}
+
+// 0x3191
+// Appends glyphs to the line kept in ui_string. A line is drawn when 0x8D
+// ends it or when a glyph doesn't fit, then the line is broken after its
+// last 0xA0 (which isn't drawn) and the rest starts the next line. The
+// break points are found in one pass and each line is drawn once.
+void ui_append_text(const unsigned char *s, size_t n)
+{
+  unsigned char *line = ui_string.bytes;
+  int len = ui_string.len;
+  int space = last_space(line, len);
+  int room = line_room();
+
+  TRACE(APPEND_TEXT, (int)n, len);
+  for (size_t i = 0; i < n; i++) {
+    unsigned char c = s[i];
+
+    if (c == 0x8D) { // new line.
+      line[len++] = c;
+      ui_string.len = len;
+      TRACE(APPEND_NEWLINE, len, draw_rect.x, draw_rect.y,
+          draw_point.x, draw_point.y);
+      ui_draw_string();
+      len = 0;
+      space = 0;
+      room = line_room();
+      continue;
+    }
+
+    if (c == 0xA0 && len > 0)
+      space = len;
+    if (len < room) {
+      line[len++] = c;
+      continue;
+    }
+
+    // 0x31AE
+    // Doesn't fit, break apart at space.
+    if (space > 0) {
+      TRACE(APPEND_BREAK, space);
+      draw_run(line, space);
+      line[len] = c;
+      len -= space;
+      memmove(line, line + space + 1, len);
+    } else {
+      // 31C1 - no space, the line goes as it is.
+      ui_string.len = len;
+      ui_draw_string();
+      line[0] = c;
+      len = 1;
+    }
+    // 0x31FC
+    ui_draw_chr_piece(0x8D);
+    byte_3236 = draw_point.x;
+    space = last_space(line, len);
+    room = line_room();
+  }
+  ui_string.len = len;
+}
+
 // 0x2720
 void ui_rect_expand()
 {
@@ -886,11 +936,11 @@ int ui_adjust_rect(uint8_t input)
 
 // 0xCF8
 // extract and process viewport data.
-void sub_CF8(unsigned char *data, struct viewport_data *vp)
+void sub_CF8(const unsigned char *data, struct viewport_data *vp)
 {
   uint8_t al;
   uint16_t ax, bx;
-  unsigned char *ds = data;
+  const unsigned char *ds = data;
 
   vp->runlength = *ds++;
   vp->numruns = *ds++;
@@ -951,7 +1001,7 @@ void sub_CF8(unsigned char *data, struct viewport_data *vp)
     break;
   default:
     printf("%s: An unhandled BX (0x%04X) was specified.\n", __func__, bx);
-    exit(1);
+    dw_exit(DW_EXIT_ERROR);
     break;
   }
 }
@@ -973,7 +1023,7 @@ void update_viewport()
     ds[di + 0x4F] &= 0xF0;
     di += 0x50;
   }
-  printf("di = 0x%04X\n", di);
+  TRACE(VIEWPORT, di);
   byte_104E = 0;
 
   // 0xCBF
@@ -1038,7 +1088,7 @@ void draw_rectangle(uint16_t x, uint16_t y, uint16_t w, uint16_t h)
     draw_point.y = draw_rect.y;
 
     // 0x32BF, 0x32C1, 0x80
-    printf("sub_269F(%d, %d, 0x80)\n", draw_point.x, draw_point.y);
+    TRACE(SUB_269F, draw_point.x, draw_point.y);
     // 0x269F
     ui_draw_box_segment(0x80);
 
@@ -21,7 +21,9 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
+#include "context.h"
 #include "resource.h"
 
 // data_320C
@@ -37,12 +39,9 @@ struct viewport_data {
   int numruns;
   int unknown1;
   int unknown2;
-  unsigned char *data;
+  const unsigned char *data;
 };
 
-// 0x320C
-extern struct ui_string_line ui_string;
-
 struct ui_rect {
   uint16_t x; // 0x2697
   uint16_t y; // 0x2699
@@ -55,16 +54,76 @@ struct ui_point {
   uint16_t y; // 0x32C1
 };
 
-extern uint8_t ui_drawn_yet; // 0x268E
-// 2697
-extern struct ui_rect draw_rect;
-// 32BF
-extern struct ui_point draw_point;
+struct pic_data {
+  uint8_t width;
+  uint8_t height;
+  uint8_t offset_delta;
+  uint8_t y_pos; // Starting line.
+  const unsigned char *data;
+};
+
+struct ui_header {
+  int len; // 0x288A
+  unsigned char data[16]; // 0x288B
+};
+
+#define UI_PIECE_COUNT 0x2B
+
+/* UI variables of one game, see context.h. */
+struct ui_state {
+  uint8_t ui_drawn_yet; // 0x268E
+
+  struct ui_rect data_268F;
+  // 0x2697
+  struct ui_rect draw_rect;
+
+  uint8_t byte_3236;
+  // 0x32BF
+  struct ui_point draw_point;
+
+  // 0x320C
+  struct ui_string_line ui_string;
+
+  // 0x2AC3
+  uint8_t data_2AC3[0x19];
+
+  int loaded;
+
+  // At 0x4F11 in memory.
+  // 10880 bytes. (136 x 80)
+  unsigned char *viewport_memory; // 0x4F11
+  unsigned char *viewport_mem_save; // 0x4F13
+  unsigned short word_4F15; // 0x4F15
+  unsigned short word_4F17; // 0x4F17
+
+  // Populated from data extracted from 0x6748
+  struct viewport_data viewports[4];
+
+  struct pic_data ui_pieces[UI_PIECE_COUNT];
+
+  struct ui_header ui_header;
+
+  // 0x3598
+  uint8_t prev_bg_index;
+  // 0x3599
+  uint8_t curr_bg_index;
+
+  // 0x359A
+  uint16_t current_background;
+};
+
+// UI variables that are also used outside of ui.c.
+#define ui_drawn_yet (dw_ctx->ui->ui_drawn_yet)
+#define draw_rect (dw_ctx->ui->draw_rect)
+#define draw_point (dw_ctx->ui->draw_point)
+#define ui_string (dw_ctx->ui->ui_string)
+
+struct ui_state *ui_state_new(void);
 
 void ui_load();
 void sub_37C8();
 void update_viewport();
-void sub_CF8(unsigned char *data, struct viewport_data *vp);
+void sub_CF8(const unsigned char *data, struct viewport_data *vp);
 void draw_viewport();
 void ui_draw();
 void ui_draw_full();
@@ -80,6 +139,7 @@ void sub_35A0(uint8_t piece_index);
 void draw_pattern(struct ui_rect *rect);
 void ui_set_background(uint16_t val);
 void ui_draw_string(void);
+void ui_append_text(const unsigned char *s, size_t n);
 void ui_draw_solid_color(uint8_t color, uint16_t line_num,
     uint16_t inset, uint16_t count);
 void reset_ui_background();
@@ -14,19 +14,21 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <ctype.h>
 
 #include "utils.h"
 
-void dump_hex(void *vp, size_t len)
+void dump_hex(const void *vp, size_t len)
 {
   char linebuf[80];
   int i;
   int linebuf_dirty = 0;
-  unsigned char *p = (unsigned char *)vp;
+  const unsigned char *p = (const unsigned char *)vp;
 
   memset(linebuf, ' ', sizeof(linebuf));
   linebuf[70] = '\0';
@@ -103,3 +105,35 @@ void dosbox_hexdump_file(int segment, void *ptr, int buflen)
 
   fclose(fp);
 }
+
+unsigned char *
+read_file(const char *fname, size_t *lenp)
+{
+  unsigned char *buf;
+  long len;
+  FILE *fp;
+
+  fp = fopen(fname, "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "Failed to open %s: %s\n", fname, strerror(errno));
+    return NULL;
+  }
+  if (fseek(fp, 0, SEEK_END) != 0 || (len = ftell(fp)) < 0 ||
+      fseek(fp, 0, SEEK_SET) != 0) {
+    fprintf(stderr, "Failed to read %s: %s\n", fname, strerror(errno));
+    fclose(fp);
+    return NULL;
+  }
+
+  // Keep empty files from returning NULL.
+  buf = malloc(len + 1);
+  if (buf == NULL || fread(buf, 1, len, fp) != (size_t)len) {
+    fprintf(stderr, "Failed to read %s.\n", fname);
+    free(buf);
+    fclose(fp);
+    return NULL;
+  }
+  fclose(fp);
+  *lenp = len;
+  return buf;
+}
@@ -23,9 +23,13 @@
 extern "C" {
 #endif
 
-void dump_hex(void *vp, size_t len);
+void dump_hex(const void *vp, size_t len);
 void hexdump(void *ptr, int buflen);
 
+// Reads a whole file into a malloc'd buffer, NULL (after printing why) on
+// errors.
+unsigned char *read_file(const char *fname, size_t *lenp);
+
 #ifdef __cplusplus
 }
 #endif
@@ -17,18 +17,55 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "context.h"
 #include "vga.h"
+#include "vga_null.h"
 
 #define VGA_WIDTH 320
 #define VGA_HEIGHT 200
 
-/* Represents 0xA0000 (0xA000:0000) memory. */
-static uint8_t *framebuffer;
+/* One display per engine context so that several games can run headless
+ * in one process. */
+struct null_display {
+  /* Represents 0xA0000 (0xA000:0000) memory. */
+  uint8_t *framebuffer;
+
+  // Scripted key presses, NULL when there are none.
+  const uint16_t *keys;
+  size_t nkeys;
+  size_t next_key;
+};
+
+static struct null_display *
+get_display(void)
+{
+  if (dw_ctx->vga == NULL)
+    dw_ctx->vga = calloc(1, sizeof(struct null_display));
+  return dw_ctx->vga;
+}
+
+int
+vga_null_set_keys(const uint16_t *keys, size_t nkeys)
+{
+  struct null_display *d = get_display();
+
+  if (d == NULL) {
+    fprintf(stderr, "Display could not be allocated.\n");
+    return -1;
+  }
+  d->keys = keys;
+  d->nkeys = nkeys;
+  d->next_key = 0;
+  return 0;
+}
 
 static int
 display_start(int game_width, int game_height)
 {
-  if ((framebuffer = calloc(VGA_WIDTH * VGA_HEIGHT, 1)) == NULL) {
+  struct null_display *d = get_display();
+
+  if (d == NULL ||
+      (d->framebuffer = calloc(VGA_WIDTH * VGA_HEIGHT, 1)) == NULL) {
     fprintf(stderr, "Framebuffer could not be allocated.\n");
     return -1;
   }
@@ -39,7 +76,13 @@ display_start(int game_width, int game_height)
 static void
 display_end(void)
 {
-  free(framebuffer);
+  struct null_display *d = dw_ctx->vga;
+
+  if (d == NULL)
+    return;
+  free(d->framebuffer);
+  free(d);
+  dw_ctx->vga = NULL;
 }
 
 static void
@@ -54,13 +97,21 @@ static void waitkey()
 static uint8_t *
 get_fb_mem()
 {
-  return framebuffer;
+  struct null_display *d = dw_ctx->vga;
+
+  return d != NULL ? d->framebuffer : NULL;
 }
 
 static uint16_t
 get_key()
 {
-  return 0;
+  struct null_display *d = dw_ctx->vga;
+
+  if (d == NULL || d->keys == NULL)
+    return 0;
+  if (d->next_key == d->nkeys)
+    dw_exit(DW_EXIT_NO_INPUT);
+  return d->keys[d->next_key++];
 }
 
 struct vga_driver null_driver = {